@@ -0,0 +1,182 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include "feed.h"
+#include "readahead.h"
+
+/* Replay of many daily files (a backfill) in one process.
+ *
+ * Starting one process per day pays for the oid map, the level pools and
+ * the page faults that come with them every time. Here a pool of engines
+ * is built once, as many as fit in a RAM budget (and no more than there
+ * are cores or days), and each engine runs on its own thread, taking the
+ * next day from a shared counter until none are left. Between days an
+ * engine is emptied with engine::reset, which clears the books and pools
+ * in place and marks the oid map's pages MADV_FREE rather than freeing
+ * and reallocating anything, so later days mostly run on memory that is
+ * already mapped.
+ *
+ * The size of an engine is estimated from the largest day: oids are
+ * dense and every add or replace takes at least 37 bytes on the wire,
+ * which bounds the oid map as in nbbo.h. The books' own vectors and the
+ * level pools grow with the data and are not counted.
+ */
+
+struct batch_day_t {
+  std::string file;
+  size_t npkts = 0;
+  size_t nanos = 0;
+  bool ok = false;
+};
+
+// regular files in dir, sorted by name (so days run in date order)
+inline std::vector<std::string> batch_files(std::string const &dir)
+{
+  std::vector<std::string> files;
+  DIR *d = opendir(dir.c_str());
+  if (!d) return files;
+  std::string const prefix = dir.empty() || dir.back() == '/' ? dir : dir + "/";
+  while (dirent *e = readdir(d)) {
+    if (DT_REG == e->d_type || DT_LNK == e->d_type || DT_UNKNOWN == e->d_type) {
+      if ('.' == e->d_name[0]) continue;
+      files.push_back(prefix + e->d_name);
+    }
+  }
+  closedir(d);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+// bytes one engine needs for a day with at most max_oid orders
+template<typename T>
+size_t engine_bytes(size_t const max_oid)
+{
+  size_t bytes = sizeof(engine<T>) + max_oid * sizeof(typename engine<T>::order_t);
+#if CROSS_CHECK
+  if constexpr (engine<T>::HAS_REFERENCE) {
+    bytes += engine_bytes<order_book_scalar<TRACE::DISABLED>>(max_oid);
+  }
+#endif
+  return bytes;
+}
+
+template<typename T>
+class batch_replay
+{
+ public:
+  std::vector<batch_day_t> m_days;
+  size_t m_engines = 0;
+  size_t m_engine_bytes = 0;
+  size_t m_reset_nanos = 0;  // summed over all engines
+  // with readahead, summed over all days (see readahead.h)
+  long m_majflt = 0;
+  size_t m_stall_nanos = 0;
+
+  batch_replay(std::vector<std::string> const &files, size_t const readahead = 0)
+      : m_readahead(readahead)
+  {
+    for (auto const &f : files) {
+      m_days.push_back(batch_day_t{f});
+    }
+  }
+
+  /* Sizes the pool for budget bytes and runs every day. Returns the
+   * wall time in nanoseconds. */
+  size_t run(size_t const budget)
+  {
+    size_t max_bytes = 0;
+    for (auto const &d : m_days) {
+      int fd = open(d.file.c_str(), O_RDONLY);
+      if (fd < 0) continue;
+      max_bytes = std::max(max_bytes, size_t(lseek(fd, 0, SEEK_END)));
+      close(fd);
+    }
+    m_max_oid = max_bytes / 37 + 1;
+    m_engine_bytes = engine_bytes<T>(m_max_oid);
+    size_t const cores = std::max(1u, std::thread::hardware_concurrency());
+    m_engines = std::min({budget / m_engine_bytes, cores, m_days.size()});
+    if (!m_engines) {
+      fprintf(stderr, "Budget of %lu MB is below one engine (%lu MB), running one day at a time\n",
+              budget >> 20, m_engine_bytes >> 20);
+      m_engines = 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    std::vector<io_stats_t> stats(m_engines);
+    for (size_t i = 0; i < m_engines; i++) {
+      workers.emplace_back([this, &stats, i]() { stats[i] = work(); });
+    }
+    for (auto &w : workers) w.join();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    for (auto const &st : stats) {
+      m_reset_nanos += st.reset_nanos;
+      m_majflt += st.majflt;
+      m_stall_nanos += st.stall_nanos;
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  }
+
+ private:
+  std::atomic<size_t> m_next{0};
+  size_t m_max_oid = 0;
+  size_t const m_readahead;
+
+  struct io_stats_t {
+    size_t reset_nanos = 0;
+    long majflt = 0;
+    size_t stall_nanos = 0;
+  };
+
+  // one pool thread: its own engine, days from the shared counter
+  io_stats_t work()
+  {
+    // built on the thread that uses it, so its pages are local to it
+    auto eng = std::make_unique<engine<T>>();
+    eng->oid_map.reserve(order_id_t(m_max_oid));
+    io_stats_t st;
+    for (size_t i = m_next++; i < m_days.size(); i = m_next++) {
+      batch_day_t &day = m_days[i];
+      int fd = open(day.file.c_str(), O_RDONLY);
+      if (fd < 0) {
+        fprintf(stderr, "Could not open file %s\n", day.file.c_str());
+        continue;
+      }
+      {
+        buf_t buf(fd);
+        std::unique_ptr<readahead_t> ra;
+        if (m_readahead) {
+          ra = std::make_unique<readahead_t>(buf, m_readahead);
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t npkts = 0;
+        while (is_ok(buf.ensure(3))) {
+          process_message(*eng, buf);
+          ++npkts;
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        day.npkts = npkts;
+        day.nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        day.ok = true;
+        if (ra) {
+          ra->stop();
+          st.majflt += ra->m_majflt;
+          st.stall_nanos += ra->m_stall_nanos;
+        }
+      }
+      close(fd);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      eng->reset();
+      st.reset_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+    }
+    return st;
+  }
+};
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Generates the fixed synthetic scenarios (once) and runs every --isa on
+# each of them, printing ns/packet. Compare the output across commits to
+# catch regressions. Usage: ./bench.sh [scenario ...]
+# A scenario of the form depth:N is the deep scenario with a mean distance
+# of N ticks from the mid, e.g. ./bench.sh depth:4 depth:64 depth:1024
+# compares the implementations by depth bucket.
+# PERF=1 also prints hardware counters per packet for each run (--perf).
+# PUBLISH=1 runs each replay with --publish-books and a book_reader
+# sweeping the region at the same time, and prints the slot writes per
+# packet and the reader's retry rate (compare ns/packet to a plain run
+# for the writer's overhead; on a single core the reader takes half of it).
+# To see what the inline level storage of scalar, soa and soa_price
+# saves, run it again (with PERF=1 for the cache misses) on an a.out built
+# with -DINLINE_LEVELS=0, which gives them std::vectors.
+# Likewise -DPACK_BOOKS=1 packs the books by activity (see engine::slot);
+# compare on the skewed scenario, also with EXTRA="--repack-after 1000000".
+# ISAS=matrix ranks the policy-built books (see order_book_basic.h) on
+# each scenario instead.
+# EVENTS=1 converts each scenario once into an event file (--convert) and
+# replays that instead, which leaves out the ITCH decoding.
+# CHECK=1 checks each replay's final --digest line against the one
+# itch_gen computes from its own model of the books, printing ok or
+# mismatch, and exits non-zero on a mismatch; ./bench.sh stubs checks the
+# books whose first quotes are far from their inside.
+DIR=${BENCH_DIR:-bench_data}
+SCENARIOS=${*:-"inside deep far churn hot mixed many skewed"}
+ISAS=${ISAS:-"scalar soa soa_price avx2 btree gap adaptive"}
+mkdir -p $DIR
+status=0
+for s in $SCENARIOS
+do
+  f=$DIR/$(echo $s | tr : _).itch
+  d=${f%.itch}.digest
+  if [ ! -f $f ] || [ -n "$CHECK" -a ! -f $d ]; then
+    case $s in
+      depth:*) ./itch_gen --scenario deep --depth ${s#depth:} --seed 1 --digest $d --out $f || exit 1 ;;
+      *) ./itch_gen --scenario $s --seed 1 --digest $d --out $f || exit 1 ;;
+    esac
+  fi
+  if [ -n "$EVENTS" ]; then
+    e=${f%.itch}.events
+    [ -f $e ] || ./a.out --convert $e $f > /dev/null || exit 1
+    f=$e
+  fi
+  for isa in $ISAS
+  do
+    printf "%-10s %-10s " $s $isa
+    if [ -n "$CHECK" ]; then
+      ./a.out $EXTRA --digest $DIR/check.digest --isa $isa $f > /dev/null
+      if [ "$(tail -1 $DIR/check.digest)" = "$(cat $d)" ]; then
+        echo ok
+      else
+        echo mismatch: $(tail -1 $DIR/check.digest), expected $(cat $d)
+        status=1
+      fi
+    elif [ -n "$PUBLISH" ]; then
+      ./book_reader --wait /itch_bench_books > $DIR/reader.out &
+      ./a.out $EXTRA --publish-books /itch_bench_books --isa $isa $f | tail -2 | tr '\n' ' '
+      wait
+      cat $DIR/reader.out
+    elif [ "$isa" = matrix ]; then
+      echo
+      ./a.out $EXTRA --isa matrix $f | sed -n '/^rank/,$p'
+    elif [ -n "$PERF" ]; then
+      ./a.out $EXTRA --perf --isa $isa $f | tail -2 | tr '\n' ' '
+      echo
+    else
+      ./a.out $EXTRA --isa $isa $f | tail -1
+    fi
+  done
+done
+exit $status
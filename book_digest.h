@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "itch.h"
+
+/* A digest of the levels of every book, so that two --isa runs over the
+ * same file can be compared by diffing a few lines instead of running a
+ * reference book next to the one being measured (CROSS_CHECK).
+ *
+ * Each level contributes a 64-bit hash of (locate, side, wire price,
+ * quantity); a book's digest is the sum of its levels' hashes and the
+ * engine's is the sum over books, so the digest depends only on which
+ * levels exist and not on how a book stores or orders them.
+ *
+ * The hashes have to come from the book's own levels: a digest kept up
+ * to date from the arguments of each operation would be the same for
+ * every implementation, right or wrong. So the engine only marks a book
+ * as touched, which is a flag test per operation, and update() walks
+ * the books touched since the last update (with engine::top) and swaps
+ * their old digests for new ones. Called every few hundred thousand
+ * messages, that walk costs a small fraction of the replay.
+ */
+class book_digest
+{
+ public:
+  explicit book_digest(size_t const max_books) : m_books(max_books, 0), m_dirty(max_books, 0)
+  {
+    m_touched.reserve(max_books);
+  }
+
+  __attribute__((__always_inline__)) void touch(uint16_t const book_idx)
+  {
+    if (!m_dirty[book_idx]) {
+      m_dirty[book_idx] = 1;
+      m_touched.push_back(book_idx);
+    }
+  }
+
+  // rehashes the touched books of eng and returns the engine's digest
+  template<class E>
+  uint64_t update(E &eng)
+  {
+    for (uint16_t const book_idx : m_touched) {
+      uint64_t const h = hash_book(eng, book_idx);
+      m_total += h - m_books[book_idx];
+      m_books[book_idx] = h;
+      m_dirty[book_idx] = 0;
+    }
+    m_touched.clear();
+    return m_total;
+  }
+
+  uint64_t value() const { return m_total; }
+
+  // what one level adds to the digest; itch_gen digests its own model
+  // of the books with it, to check the engine against
+  static uint64_t hash_level(uint16_t const book_idx, bool const bid, price_t const price, qty_t const qty)
+  {
+    uint64_t const where = uint64_t(book_idx) << 33 | uint64_t(bid) << 32 | price;
+    return mix(mix(where) ^ qty);
+  }
+
+ private:
+  static uint64_t mix(uint64_t x)
+  {
+    // splitmix64's finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x;
+  }
+
+  template<class E>
+  uint64_t hash_book(E &eng, uint16_t const book_idx)
+  {
+    uint64_t h = 0;
+    for (bool const bid : {true, false}) {
+      // top fills the last n of k slots; a full buffer may have missed
+      // levels, so grow it and ask again
+      size_t n;
+      while ((n = eng.top(book_idx, bid, m_prices.size(), m_prices.data(), m_qtys.data())) ==
+             m_prices.size()) {
+        m_prices.resize(2 * m_prices.size());
+        m_qtys.resize(m_prices.size());
+      }
+      for (size_t i = m_prices.size() - n; i < m_prices.size(); i++) {
+        h += hash_level(book_idx, bid, m_prices[i], m_qtys[i]);
+      }
+    }
+    return h;
+  }
+
+  std::vector<uint64_t> m_books;  // digest per book as of the last update
+  std::vector<uint8_t> m_dirty;
+  std::vector<uint16_t> m_touched;
+  uint64_t m_total = 0;
+  std::vector<price_t> m_prices = std::vector<price_t>(256);
+  std::vector<qty_t> m_qtys = std::vector<qty_t>(256);
+};
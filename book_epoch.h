@@ -0,0 +1,248 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* Books published to reader threads in the same process, as book_shm
+ * publishes them to other processes, except that a reader can take a
+ * snapshot of several books at once that is consistent across them: all
+ * as of the same message.
+ *
+ * Every time a side's window (features.h) changes, the replay writes a
+ * new version of that book: both sides' DEPTH best levels, best first,
+ * with unsigned prices as on the wire, the message sequence number it
+ * became current at and a pointer to the version it replaces. It makes
+ * the version the book's head with a release store and then bumps
+ * m_published. Versions are never changed once published.
+ *
+ * A reader reads m_published once, as S, and for each book walks from
+ * the head back to the newest version no later than S. That is what the
+ * book looked like after message S, for every book at once, while the
+ * replay keeps going; the walk is usually zero or one step.
+ *
+ * What the replay has replaced it cannot reuse while a reader may still
+ * walk to it, which is what the epoch is for (epoch-based reclamation).
+ * A reader announces the global epoch in its own slot before it reads S
+ * and clears it after its last copy. The replay files each replaced
+ * version under the current epoch, and every RECLAIM_EVERY publishes it
+ * advances the epoch if every active reader has announced the current
+ * one. Versions filed two epochs back are then unreachable by anyone and
+ * go back on the free list. A reader that stalls holds the epoch and so
+ * the memory, never the replay.
+ */
+
+namespace book_epoch {
+
+static constexpr size_t DEPTH = 8;  // FEATURE_DEPTH
+static constexpr size_t MAX_BOOKS = 1 << 14;  // order_book::MAX_BOOKS
+static constexpr size_t MAX_READERS = 64;
+static constexpr size_t RECLAIM_EVERY = 256;
+
+struct alignas(64) version_t {
+  uint64_t seq;  // the message it became current at
+  version_t const *prev;
+  uint32_t levels[2];  // bid, ask
+  uint32_t prices[2][DEPTH];  // best first
+  uint32_t qtys[2][DEPTH];
+};
+
+// a reader's copy of one book
+struct book_t {
+  uint32_t levels[2];
+  uint32_t prices[2][DEPTH];
+  uint32_t qtys[2][DEPTH];
+};
+
+class domain
+{
+  static constexpr uint64_t IDLE = ~uint64_t(0);
+  static constexpr size_t CHUNK = 4096;  // versions allocated at a time
+
+  struct alignas(64) slot_t {
+    std::atomic<bool> taken{false};
+    std::atomic<uint64_t> epoch;  // IDLE outside a snapshot
+  };
+
+ public:
+  domain()
+  {
+    for (auto &h : m_heads) h.store(nullptr, std::memory_order_relaxed);
+    for (auto &r : m_readers) r.epoch.store(IDLE, std::memory_order_relaxed);
+  }
+  domain(domain const &) = delete;
+  domain &operator=(domain const &) = delete;
+
+  size_t m_writes = 0;
+  size_t m_advances = 0;  // epochs the replay got to advance
+  size_t m_blocked = 0;   // advances held up by a reader in an older epoch
+
+  size_t versions() const { return m_chunks.size() * CHUNK; }
+  // the locates published so far, in the order they first were
+  uint32_t books() const { return m_books.load(std::memory_order_acquire); }
+  uint16_t book(uint32_t const i) const { return m_book_list[i]; }
+  std::atomic<uint32_t> m_done{0};  // set once the replay has ended
+
+  /* Publishes one side of a book from its window: k levels at wire
+   * prices, best last, as engine::top leaves them. The other side is
+   * copied from the current version. */
+  void publish(uint16_t const locate, bool const bid, uint32_t const *prices,
+               uint32_t const *qtys, size_t const k)
+  {
+    version_t const *old = m_heads[locate].load(std::memory_order_relaxed);
+    version_t *v = alloc();
+    uint64_t const seq = ++m_seq;
+    size_t const side = bid ? 0 : 1;
+    v->seq = seq;
+    v->prev = old;
+    size_t n = 0;
+    for (size_t i = k; i-- > 0 && qtys[i];) {
+      v->prices[side][n] = prices[i];
+      v->qtys[side][n] = qtys[i];
+      ++n;
+    }
+    for (size_t i = n; i < DEPTH; i++) {
+      v->prices[side][i] = 0;
+      v->qtys[side][i] = 0;
+    }
+    v->levels[side] = uint32_t(n);
+    size_t const other = 1 - side;
+    if (old) {
+      v->levels[other] = old->levels[other];
+      std::copy(old->prices[other], old->prices[other] + DEPTH, v->prices[other]);
+      std::copy(old->qtys[other], old->qtys[other] + DEPTH, v->qtys[other]);
+    } else {
+      v->levels[other] = 0;
+      std::fill(v->prices[other], v->prices[other] + DEPTH, 0);
+      std::fill(v->qtys[other], v->qtys[other] + DEPTH, 0);
+    }
+    m_heads[locate].store(v, std::memory_order_release);
+    m_published.store(seq, std::memory_order_release);
+    if (!old) {
+      uint32_t const n_books = m_books.load(std::memory_order_relaxed);
+      m_book_list[n_books] = locate;
+      m_books.store(n_books + 1, std::memory_order_release);
+    }
+    if (old) m_retired[m_epoch % 3].push_back(const_cast<version_t *>(old));
+    ++m_writes;
+    if (0 == m_writes % RECLAIM_EVERY) reclaim();
+  }
+
+  /* A reader thread's handle: a slot of its own to announce its epoch
+   * in. Made and dropped on the thread that reads; at most MAX_READERS
+   * at a time. */
+  class reader
+  {
+   public:
+    explicit reader(domain &d) : m_domain(d)
+    {
+      for (size_t i = 0; i < MAX_READERS; i++) {
+        bool expected = false;
+        if (d.m_readers[i].taken.compare_exchange_strong(expected, true)) {
+          m_slot = &d.m_readers[i];
+          return;
+        }
+      }
+    }
+    ~reader()
+    {
+      if (m_slot) m_slot->taken.store(false, std::memory_order_release);
+    }
+    reader(reader const &) = delete;
+    reader &operator=(reader const &) = delete;
+
+    bool ok() const { return nullptr != m_slot; }
+
+    /* Copies n books, all as of the same message, into out. Returns the
+     * message; an empty book, or one never published, comes back with
+     * no levels. m_walked counts the versions skipped to get there. */
+    uint64_t snapshot(uint16_t const *locates, size_t const n, book_t *out)
+    {
+      pin();
+      uint64_t const s = m_domain.m_published.load(std::memory_order_acquire);
+      for (size_t i = 0; i < n; i++) {
+        version_t const *v = m_domain.m_heads[locates[i]].load(std::memory_order_acquire);
+        while (v && v->seq > s) {
+          v = v->prev;
+          ++m_walked;
+        }
+        if (v) {
+          for (size_t side = 0; side < 2; side++) {
+            out[i].levels[side] = v->levels[side];
+            std::copy(v->prices[side], v->prices[side] + DEPTH, out[i].prices[side]);
+            std::copy(v->qtys[side], v->qtys[side] + DEPTH, out[i].qtys[side]);
+          }
+        } else {
+          out[i] = book_t{};
+        }
+      }
+      m_slot->epoch.store(IDLE, std::memory_order_release);
+      return s;
+    }
+    size_t m_walked = 0;
+
+   private:
+    // announces the current epoch, again if it moved meanwhile
+    void pin()
+    {
+      uint64_t e = m_domain.m_global.load(std::memory_order_seq_cst);
+      for (;;) {
+        m_slot->epoch.store(e, std::memory_order_seq_cst);
+        uint64_t const now = m_domain.m_global.load(std::memory_order_seq_cst);
+        if (now == e) return;
+        e = now;
+      }
+    }
+    domain &m_domain;
+    slot_t *m_slot = nullptr;
+  };
+
+ private:
+  version_t *alloc()
+  {
+    if (m_free.empty()) {
+      m_chunks.push_back(std::make_unique<version_t[]>(CHUNK));
+      for (size_t i = CHUNK; i-- > 0;) m_free.push_back(&m_chunks.back()[i]);
+    }
+    version_t *v = m_free.back();
+    m_free.pop_back();
+    return v;
+  }
+
+  // advances the epoch if no reader is behind it, freeing what was filed
+  // two epochs back
+  void reclaim()
+  {
+    for (slot_t const &r : m_readers) {
+      uint64_t const e = r.epoch.load(std::memory_order_seq_cst);
+      if (IDLE != e && e != m_epoch) {
+        ++m_blocked;
+        return;
+      }
+    }
+    ++m_epoch;
+    m_global.store(m_epoch, std::memory_order_seq_cst);
+    ++m_advances;
+    // filed at m_epoch - 2, which is also where the next epoch files
+    std::vector<version_t *> &old = m_retired[(m_epoch + 1) % 3];
+    m_free.insert(m_free.end(), old.begin(), old.end());
+    old.clear();
+  }
+
+  std::atomic<version_t const *> m_heads[MAX_BOOKS];
+  uint16_t m_book_list[MAX_BOOKS];
+  alignas(64) std::atomic<uint32_t> m_books{0};
+  alignas(64) std::atomic<uint64_t> m_published{0};
+  alignas(64) std::atomic<uint64_t> m_global{0};  // the epoch, for readers
+  slot_t m_readers[MAX_READERS];
+
+  // the replay's own
+  alignas(64) uint64_t m_seq = 0;
+  uint64_t m_epoch = 0;
+  std::vector<version_t *> m_retired[3];  // by the epoch they were filed in
+  std::vector<version_t *> m_free;
+  std::vector<std::unique_ptr<version_t[]>> m_chunks;
+};
+
+}  // namespace book_epoch
@@ -0,0 +1,139 @@
+/*
+ * book_reader.cpp
+ *
+ * A reader of the books a replay publishes with
+ * `a.out --publish-books <name>` (see book_shm.h), as a strategy process
+ * would run it.
+ *
+ * By default it is the reader half of the publication benchmark: it
+ * sweeps every locate with a snapshot read, over and over, until the
+ * replay ends, and reports reads per second, how often a read had to be
+ * retried because it raced the writer, and any snapshot that is not a
+ * valid book (which would mean a torn read got through). --wait starts
+ * it before the replay and waits for the region to appear.
+ *
+ * With --show <locate> it prints that book once and exits.
+ *
+ *   ./book_reader [--wait] [--show <locate>] [name]   name defaults to /itch_books
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include "book_shm.h"
+
+using namespace book_shm;
+
+// levels best first, bids falling and asks rising, nothing after them
+static bool valid(snapshot_t const &s)
+{
+  for (size_t side = 0; side < 2; side++) {
+    size_t const n = s.levels[side];
+    if (n > DEPTH) return false;
+    for (size_t i = 0; i < DEPTH; i++) {
+      if ((i < n) != (0 != s.qtys[side][i])) return false;
+      if (i >= n && s.prices[side][i]) return false;
+      if (i && i < n && (0 == side ? s.prices[side][i] >= s.prices[side][i - 1]
+                                   : s.prices[side][i] <= s.prices[side][i - 1])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void show(reader const &r, uint16_t const locate)
+{
+  snapshot_t s;
+  size_t const retries = r.read(locate, &s);
+  printf("locate %u, seq %u, %lu retries\n", locate, s.seq, retries);
+  printf("%12s %10s | %10s %12s\n", "bid", "qty", "qty", "ask");
+  for (size_t i = 0; i < DEPTH; i++) {
+    if (i >= s.levels[0] && i >= s.levels[1]) break;
+    if (i < s.levels[0]) {
+      printf("%12.4f %10u | ", s.prices[0][i] / 10000.0, s.qtys[0][i]);
+    } else {
+      printf("%12s %10s | ", "", "");
+    }
+    if (i < s.levels[1]) {
+      printf("%10u %12.4f\n", s.qtys[1][i], s.prices[1][i] / 10000.0);
+    } else {
+      printf("\n");
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  std::string name = "/itch_books";
+  bool wait = false;
+  long locate = -1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--wait") {
+      wait = true;
+    } else if (arg == "--show") {
+      if (i + 1 < argc) {
+        locate = std::stol(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --show requires an argument\n");
+        return 1;
+      }
+    } else if (arg[0] == '-') {
+      fprintf(stderr, "Usage: %s [--wait] [--show <locate>] [name]\n", argv[0]);
+      fprintf(stderr, "  name defaults to /itch_books, as given to a.out --publish-books\n");
+      return arg != "--help" && arg != "-h";
+    } else {
+      name = arg;
+    }
+  }
+
+  std::unique_ptr<reader> r;
+  for (;;) {
+    r = std::make_unique<reader>(name.c_str());
+    // a region left by an earlier run is done; wait for the next one
+    if (!wait || (r->ok() && !r->header().done.load(std::memory_order_acquire))) break;
+    r.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (!r->ok()) {
+    fprintf(stderr, "Could not open %s\n", name.c_str());
+    return 1;
+  }
+  if (locate >= 0) {
+    if (size_t(locate) >= MAX_BOOKS) {
+      fprintf(stderr, "Locate %ld is out of range\n", locate);
+      return 1;
+    }
+    show(*r, uint16_t(locate));
+    return 0;
+  }
+
+  pid_t const pid = r->header().pid;
+  size_t reads = 0, retries = 0, invalid = 0, sweeps = 0;
+  std::vector<uint32_t> seen(MAX_BOOKS, 0);
+  snapshot_t s;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while (!r->header().done.load(std::memory_order_acquire)) {
+    for (size_t i = 0; i < MAX_BOOKS; i++) {
+      // only books that changed since the last sweep are copied
+      if (r->seq(uint16_t(i)) == seen[i]) continue;
+      retries += r->read(uint16_t(i), &s);
+      ++reads;
+      seen[i] = s.seq;
+      invalid += !valid(s);
+    }
+    ++sweeps;
+    if (0 == sweeps % 1024 && kill(pid, 0)) break;  // the writer died
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  double const secs = std::chrono::duration<double>(end - start).count();
+  printf("reader: %lu sweeps, %lu reads (%.0f per second), %lu retries (%.4f%% of reads), "
+         "%lu invalid\n", sweeps, reads, reads / secs, retries,
+         reads ? 100.0 * retries / reads : 0.0, invalid);
+  return invalid ? 1 : 0;
+}
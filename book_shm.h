@@ -0,0 +1,225 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Books published to other processes on the same host, so strategies
+ * can read them out of shared memory instead of each running its own
+ * ITCH handler.
+ *
+ * The region (shm_open) holds a header and one slot per stock_locate,
+ * each with the DEPTH best levels of both sides, best first,
+ * with unsigned prices as on the wire. The replay is the only writer and
+ * writes a slot whenever one of its sides' windows (features.h) changes,
+ * which is independent of the book implementation, and skips messages
+ * below the window altogether.
+ *
+ * Each slot is guarded by its own sequence lock: the writer makes the
+ * sequence odd, stores the changed side and makes it even again, and
+ * never waits for anyone. A reader copies the slot between two loads of
+ * the sequence and retries if they differ or are odd, so it gets a
+ * consistent snapshot without a lock and without the writer knowing it
+ * is there. A reader that keeps finding the slot busy yields, since the
+ * writer may have been preempted inside it. Slots are cache-line aligned, so a reader of one book never
+ * shares a line with the writer of another. The levels are copied one
+ * word at a time with relaxed atomics, which is as cheap as memcpy on
+ * x86 and keeps the racing copy well defined.
+ *
+ * The layout is versioned by book_shm::VERSION.
+ */
+
+namespace book_shm {
+
+static constexpr uint64_t MAGIC = 0x6b6f6f6268637469;  // "itchbook"
+static constexpr uint32_t VERSION = 1;
+static constexpr size_t DEPTH = 8;  // FEATURE_DEPTH
+static constexpr size_t MAX_BOOKS = 1 << 14;  // order_book::MAX_BOOKS
+
+struct alignas(64) header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t depth;
+  uint32_t max_books;
+  int32_t pid;
+  std::atomic<uint32_t> done;  // set once the replay has ended
+};
+
+struct alignas(64) slot_t {
+  std::atomic<uint32_t> seq;  // odd while the writer is in the slot
+  uint32_t levels[2];         // bid, ask
+  uint32_t prices[2][DEPTH];  // best first
+  uint32_t qtys[2][DEPTH];
+};
+static_assert(sizeof(slot_t) % 64 == 0, "cache-line padded");
+
+struct region_t {
+  header_t header;
+  slot_t slots[MAX_BOOKS];
+};
+
+// a reader's copy of one slot
+struct snapshot_t {
+  uint32_t seq;
+  uint32_t levels[2];
+  uint32_t prices[2][DEPTH];
+  uint32_t qtys[2][DEPTH];
+};
+
+inline void store(uint32_t &dst, uint32_t const v) { __atomic_store_n(&dst, v, __ATOMIC_RELAXED); }
+inline uint32_t load(uint32_t const &src) { return __atomic_load_n(&src, __ATOMIC_RELAXED); }
+
+inline region_t *map(char const *name, bool const writer)
+{
+  // A writer starts from a new, zeroed region. Readers still mapping
+  // the one left by an earlier run keep it until they unmap it.
+  if (writer) shm_unlink(name);
+  int fd = shm_open(name, writer ? O_CREAT | O_EXCL | O_RDWR : O_RDONLY, 0644);
+  if (fd < 0) {
+    if (writer) perror("shm_open");
+    return nullptr;
+  }
+  if (writer && ftruncate(fd, sizeof(region_t))) {
+    perror("ftruncate");
+    close(fd);
+    return nullptr;
+  }
+  void *p = mmap(nullptr, sizeof(region_t), writer ? PROT_READ | PROT_WRITE : PROT_READ,
+                 MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == p) {
+    perror("mmap");
+    return nullptr;
+  }
+  return static_cast<region_t *>(p);
+}
+
+/* The replay's side. If the region cannot be created, ok() is false and
+ * the replay runs without it. */
+class writer
+{
+ public:
+  explicit writer(char const *name) : m_region(map(name, true))
+  {
+    if (!m_region) return;
+    header_t &h = m_region->header;
+    h.version = VERSION;
+    h.depth = DEPTH;
+    h.max_books = MAX_BOOKS;
+    h.pid = int32_t(getpid());
+    std::atomic_thread_fence(std::memory_order_release);
+    h.magic = MAGIC;
+  }
+  ~writer()
+  {
+    if (!m_region) return;
+    m_region->header.done.store(1, std::memory_order_release);
+    munmap(m_region, sizeof(region_t));
+  }
+  writer(writer const &) = delete;
+  writer &operator=(writer const &) = delete;
+
+  bool ok() const { return nullptr != m_region; }
+  size_t m_writes = 0;
+
+  /* Publishes one side of a book from its window: k levels at wire
+   * prices, best last, as engine::top leaves them. */
+  void publish(uint16_t const locate, bool const bid, uint32_t const *prices,
+               uint32_t const *qtys, size_t const k)
+  {
+    slot_t &slot = m_region->slots[locate];
+    size_t const side = bid ? 0 : 1;
+    uint32_t const seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    size_t n = 0;
+    for (size_t i = k; i-- > 0 && qtys[i];) {
+      store(slot.prices[side][n], prices[i]);
+      store(slot.qtys[side][n], qtys[i]);
+      ++n;
+    }
+    for (size_t i = n; i < DEPTH; i++) {
+      store(slot.prices[side][i], 0);
+      store(slot.qtys[side][i], 0);
+    }
+    store(slot.levels[side], uint32_t(n));
+    slot.seq.store(seq + 2, std::memory_order_release);
+    ++m_writes;
+  }
+
+ private:
+  region_t *m_region;
+};
+
+/* A strategy's side: maps the region read-only. ok() is false if there
+ * is no region (yet) under name. */
+class reader
+{
+ public:
+  explicit reader(char const *name) : m_region(map(name, false))
+  {
+    if (m_region && (MAGIC != m_region->header.magic || VERSION != m_region->header.version)) {
+      fprintf(stderr, "%s is not a book region of version %u\n", name, VERSION);
+      munmap(const_cast<region_t *>(m_region), sizeof(region_t));
+      m_region = nullptr;
+    }
+  }
+  ~reader()
+  {
+    if (m_region) munmap(const_cast<region_t *>(m_region), sizeof(region_t));
+  }
+  reader(reader const &) = delete;
+  reader &operator=(reader const &) = delete;
+
+  bool ok() const { return nullptr != m_region; }
+  header_t const &header() const { return m_region->header; }
+
+  // changes whenever the book does; cheap to poll before read()
+  uint32_t seq(uint16_t const locate) const
+  {
+    return m_region->slots[locate].seq.load(std::memory_order_acquire);
+  }
+
+  /* Copies a consistent snapshot of one book into out. Returns the
+   * number of retries it took, each one a copy that raced a write. */
+  size_t read(uint16_t const locate, snapshot_t *out) const
+  {
+    slot_t const &slot = m_region->slots[locate];
+    for (size_t retries = 0;; retries++) {
+      if (retries) backoff(retries);
+      uint32_t const seq = slot.seq.load(std::memory_order_acquire);
+      if (seq & 1) continue;
+      for (size_t side = 0; side < 2; side++) {
+        out->levels[side] = load(slot.levels[side]);
+        for (size_t i = 0; i < DEPTH; i++) {
+          out->prices[side][i] = load(slot.prices[side][i]);
+          out->qtys[side][i] = load(slot.qtys[side][i]);
+        }
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == seq) {
+        out->seq = seq;
+        return retries;
+      }
+    }
+  }
+
+ private:
+  region_t const *m_region;
+
+  // a writer that was preempted inside the slot needs the core back
+  static void backoff(size_t const retries)
+  {
+    if (retries < 64) {
+      __builtin_ia32_pause();
+    } else {
+      sched_yield();
+    }
+  }
+};
+
+}  // namespace book_shm
@@ -4,4 +4,8 @@
 #g++ -g -O0 -march=native -std=c++17 main.cpp
 
 #g++ -O3 -march=native -std=c++17 main.cpp
-g++ -DNDEBUG -O3 -march=native -std=c++17 main.cpp
+g++ -DNDEBUG -O3 -march=native -std=c++17 -pthread main.cpp -lrt
+g++ -DNDEBUG -O3 -march=native -std=c++17 itch_gen.cpp -o itch_gen
+g++ -DNDEBUG -O2 -std=c++17 itch_stat.cpp -o itch_stat -lrt
+g++ -DNDEBUG -O2 -std=c++17 book_reader.cpp -o book_reader -lrt
+g++ -DNDEBUG -O2 -std=c++17 trace_decode.cpp -o trace_decode
@@ -0,0 +1,225 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bufferedreader.h"
+#include "itch.h"
+
+/* An ITCH day reduced to what the books see, for replaying the same day
+ * over and over (parameter sweeps, benchmarks) without paying for the
+ * decoding each time.
+ *
+ * `a.out --convert <events> <itch file>` writes, once, one fixed-width
+ * little-endian record per book message: adds (with or without MPID),
+ * executes (with or without price), reduces, deletes and replaces, in
+ * feed order, with the oid, locate, price, side, quantity and timestamp
+ * already decoded. Every other message is dropped. Given such a file,
+ * a.out mmaps it and feeds the engine straight from the records, so
+ * what is left of a replay is the engine (see timeEvents in main.cpp).
+ *
+ * Records are 32 bytes, two to a cache line, and read strictly in
+ * order, which the hardware prefetcher keeps ahead of. Packets are
+ * counted as timeBacktest counts them, from the first add on. Each
+ * record keeps the number of the ITCH packet it came from, so that a
+ * replay of the events can do what timeBacktest does after packet n
+ * (--digest-interval, --repack-after) at the same point. The header
+ * keeps the number of packets, so ns per packet of the two replays are
+ * comparable. The layout is versioned by event_cache::VERSION.
+ */
+
+namespace event_cache {
+
+static constexpr uint64_t MAGIC = 0x746e766568637469;  // "itchevnt"
+static constexpr uint32_t VERSION = 2;
+
+enum class OP : uint8_t { ADD = 1, EXECUTE, REDUCE, DELETE, REPLACE };
+
+struct event_t {
+  uint64_t timestamp;  // ns since midnight, as on the wire
+  uint32_t oid;
+  uint32_t new_oid;  // REPLACE only
+  uint32_t price;    // ADD and REPLACE, the wire price
+  uint32_t qty;      // all but DELETE
+  uint16_t locate;
+  OP op;
+  uint8_t bid;       // ADD only
+  uint32_t packet;   // the ITCH packet it came from, 1 for the first add
+};
+static_assert(sizeof(event_t) == 32, "two records per cache line");
+
+struct alignas(64) header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t events;
+  uint64_t packets;  // ITCH packets from the first add on
+};
+
+// whether path starts with an event file header
+inline bool is_event_file(char const *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  uint64_t magic = 0;
+  bool const ok = sizeof(magic) == read(fd, &magic, sizeof(magic)) && MAGIC == magic;
+  close(fd);
+  return ok;
+}
+
+/* Writes the book events of the ITCH file itch_path to out_path. Returns
+ * false, having said why, if either file cannot be used. */
+inline bool convert(char const *itch_path, char const *out_path, header_t *out_header)
+{
+  int fd = open(itch_path, O_RDONLY);
+  if (fd < 0) {
+    perror(itch_path);
+    return false;
+  }
+  FILE *out = fopen(out_path, "w");
+  if (!out) {
+    perror(out_path);
+    close(fd);
+    return false;
+  }
+  static char wbuf[1 << 20];
+  setvbuf(out, wbuf, _IOFBF, sizeof(wbuf));
+  header_t h = {};
+  fwrite(&h, sizeof(h), 1, out);  // rewritten at the end
+
+  buf_t buf(fd);
+  while (is_ok(buf.ensure(3))) {
+    uint16_t const msglen = read_two(buf.get(0));
+    char const *msg = buf.get(2);
+    itch_t const type = itch_t(*msg);
+    if (h.packets) {
+      ++h.packets;
+    } else if (itch_t::ADD_ORDER == type) {
+      h.packets = 1;
+    }
+    event_t e = {};
+    e.packet = uint32_t(h.packets);
+    e.timestamp = read_timestamp(msg + 5);
+    e.locate = read_locate(msg + 1);
+    switch (type) {
+      case itch_t::ADD_ORDER:
+      case itch_t::ADD_ORDER_MPID: {
+        add_order_t const m = add_order_t::parse(msg);
+        e.op = OP::ADD;
+        e.oid = uint32_t(m.oid);
+        e.price = m.price;
+        e.qty = m.qty;
+        e.bid = BUY_SELL::BUY == m.buy;
+        break;
+      }
+      case itch_t::EXECUTE_ORDER:
+      case itch_t::EXECUTE_ORDER_WITH_PRICE: {
+        execute_order_t const m = execute_order_t::parse(msg);
+        e.op = OP::EXECUTE;
+        e.oid = uint32_t(m.oid);
+        e.qty = m.qty;
+        break;
+      }
+      case itch_t::REDUCE_ORDER: {
+        order_reduce_t const m = order_reduce_t::parse(msg);
+        e.op = OP::REDUCE;
+        e.oid = uint32_t(m.oid);
+        e.qty = m.qty;
+        break;
+      }
+      case itch_t::DELETE_ORDER: {
+        e.op = OP::DELETE;
+        e.oid = uint32_t(order_delete_t::parse(msg).oid);
+        break;
+      }
+      case itch_t::REPLACE_ORDER: {
+        order_replace_t const m = order_replace_t::parse(msg);
+        e.op = OP::REPLACE;
+        e.oid = uint32_t(m.oid);
+        e.new_oid = uint32_t(m.new_order_id);
+        e.price = m.new_price;
+        e.qty = m.new_qty;
+        break;
+      }
+      default:
+        break;
+    }
+    if (e.op != OP(0)) {
+      fwrite(&e, sizeof(e), 1, out);
+      ++h.events;
+    }
+    buf.advance(2 + msglen);
+  }
+  close(fd);
+
+  h.magic = MAGIC;
+  h.version = VERSION;
+  h.record_size = sizeof(event_t);
+  fseek(out, 0, SEEK_SET);
+  fwrite(&h, sizeof(h), 1, out);
+  bool const ok = 0 == ferror(out);
+  if (fclose(out) || !ok) {
+    perror(out_path);
+    return false;
+  }
+  *out_header = h;
+  return true;
+}
+
+/* An event file, mapped read-only. ok() is false, having said why, if
+ * the file is not one of this version. */
+class mapped
+{
+ public:
+  explicit mapped(char const *path)
+  {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      perror(path);
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+      perror(path);
+      close(fd);
+      return;
+    }
+    m_size = size_t(st.st_size);
+    void *p = m_size >= sizeof(header_t)
+                  ? mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)
+                  : MAP_FAILED;
+    close(fd);
+    if (MAP_FAILED == p) {
+      fprintf(stderr, "%s is not an event file\n", path);
+      return;
+    }
+    header_t const *h = static_cast<header_t const *>(p);
+    if (MAGIC != h->magic || VERSION != h->version || sizeof(event_t) != h->record_size ||
+        m_size < sizeof(header_t) + h->events * sizeof(event_t)) {
+      fprintf(stderr, "%s is not an event file of version %u\n", path, VERSION);
+      munmap(p, m_size);
+      return;
+    }
+    madvise(p, m_size, MADV_SEQUENTIAL);
+    m_header = h;
+  }
+  ~mapped()
+  {
+    if (m_header) munmap(const_cast<header_t *>(m_header), m_size);
+  }
+  mapped(mapped const &) = delete;
+  mapped &operator=(mapped const &) = delete;
+
+  bool ok() const { return nullptr != m_header; }
+  header_t const &header() const { return *m_header; }
+  event_t const *begin() const { return reinterpret_cast<event_t const *>(m_header + 1); }
+  event_t const *end() const { return begin() + m_header->events; }
+
+ private:
+  header_t const *m_header = nullptr;
+  size_t m_size = 0;
+};
+
+}  // namespace event_cache
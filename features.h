@@ -0,0 +1,304 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <immintrin.h>
+#include "feed.h"
+
+/* Book features (imbalance, microprice, depth-weighted mid) maintained
+ * as the feed is replayed, so strategies can read them per locate
+ * instead of recomputing them from the levels on every tick.
+ *
+ * Each side of each book keeps a copy of its FEATURE_DEPTH best levels,
+ * one AVX2 vector of prices and one of quantities. Every book message
+ * is applied to that window as well:
+ *  - a price deeper than the window is ignored, which is the common
+ *    case away from the inside;
+ *  - a quantity change at a level inside the window is a masked add or
+ *    subtract on the quantity vector;
+ *  - only when a level appears in or disappears from the window is it
+ *    copied out of the book again (for the SoA books these are the last
+ *    FEATURE_DEPTH elements of the sorted arrays).
+ * The window sums are then taken with AVX2 horizontal adds, and the
+ * features rewritten.
+ */
+
+static constexpr size_t FEATURE_DEPTH = 8;  // one AVX2 vector of levels
+
+/* What strategies read, one cache line per locate. Prices are unsigned
+ * and in the feed's units (1/10000 dollar). An empty side has price and
+ * quantity 0, and the features that need both sides are 0 until both
+ * are quoted. */
+struct alignas(64) book_features_t {
+  price_t bid_price;
+  price_t ask_price;
+  qty_t bid_qty;
+  qty_t ask_qty;
+  uint64_t bid_depth;  // quantity over the FEATURE_DEPTH best levels
+  uint64_t ask_depth;
+  float imbalance;        // (bid_qty - ask_qty) / (bid_qty + ask_qty)
+  float depth_imbalance;  // the same over bid_depth and ask_depth
+  // (bid_price * ask_qty + ask_price * bid_qty) / (bid_qty + ask_qty)
+  double microprice;
+  // mean of each side's quantity-weighted price over its best levels
+  double depth_mid;
+  uint32_t updates;  // bumped whenever the features are rewritten
+};
+static_assert(sizeof(book_features_t) == 64, "one cache line per book");
+
+enum class WINDOW { UNCHANGED, UPDATED, SHIFTED };
+
+/* The FEATURE_DEPTH best levels of one side at their wire prices, as
+ * returned by engine::top: best last, and unused lanes padded with empty
+ * levels, of quantity 0. Which price is better depends on the side, so
+ * add and remove are told which one the window is. */
+struct alignas(64) side_window_t {
+  price_t prices[FEATURE_DEPTH];
+  qty_t qtys[FEATURE_DEPTH];
+
+  side_window_t() { clear(); }
+  void clear()
+  {
+    std::fill(prices, prices + FEATURE_DEPTH, price_t(0));
+    std::fill(qtys, qtys + FEATURE_DEPTH, qty_t(0));
+  }
+  quote_t best() const { return quote_t{prices[FEATURE_DEPTH - 1], qtys[FEATURE_DEPTH - 1]}; }
+
+  static bool better(bool const bid, price_t const a, price_t const b)
+  {
+    return bid ? a > b : a < b;
+  }
+
+  WINDOW add(bool const bid, price_t const price, qty_t const qty)
+  {
+    int const mask = match(price);
+    if (!mask) {
+      // a new level, which only matters if it is better than the worst
+      // one in the window (or the window has room)
+      return qty_t(0) == qtys[0] || better(bid, price, prices[0]) ? WINDOW::SHIFTED
+                                                                  : WINDOW::UNCHANGED;
+    }
+    qtys[__builtin_ctz(mask)] += qty;
+    return WINDOW::UPDATED;
+  }
+  WINDOW remove([[maybe_unused]] bool const bid, price_t const price, qty_t const qty)
+  {
+    int const mask = match(price);
+    if (!mask) {
+      assert(qty_t(0) != qtys[0] && better(bid, prices[0], price));
+      return WINDOW::UNCHANGED;
+    }
+    qty_t &level_qty = qtys[__builtin_ctz(mask)];
+    assert(level_qty >= qty);
+    if (level_qty == qty) {
+      // the level goes away and the next one down moves in
+      return WINDOW::SHIFTED;
+    }
+    level_qty -= qty;
+    return WINDOW::UPDATED;
+  }
+
+  // total quantity, and sum of price * qty
+  void sums(uint64_t *depth, uint64_t *notional) const
+  {
+    __m256i const v_prices = _mm256_load_si256((__m256i const *)prices);
+    __m256i const v_qtys = _mm256_load_si256((__m256i const *)qtys);
+    // widen to 64 bits before summing, the quantities can overflow 32
+    __m256i const v_depth =
+        _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(v_qtys)),
+                         _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v_qtys, 1)));
+    // mul_epu32 multiplies the even lanes, so shift the odd lanes down.
+    // Empty lanes have a zero quantity and drop out.
+    __m256i const v_notional = _mm256_add_epi64(
+        _mm256_mul_epu32(v_prices, v_qtys),
+        _mm256_mul_epu32(_mm256_srli_epi64(v_prices, 32), _mm256_srli_epi64(v_qtys, 32)));
+    *depth = hsum_epi64(v_depth);
+    *notional = hsum_epi64(v_notional);
+  }
+
+ private:
+  // the lanes with a level at price; an empty lane's 0 is no price
+  int match(price_t const price) const
+  {
+    __m256i const v_prices = _mm256_load_si256((__m256i const *)prices);
+    __m256i const v_empty = _mm256_cmpeq_epi32(_mm256_load_si256((__m256i const *)qtys),
+                                               _mm256_setzero_si256());
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(
+        v_empty, _mm256_cmpeq_epi32(v_prices, _mm256_set1_epi32(int32_t(price))))));
+  }
+  static uint64_t hsum_epi64(__m256i const v)
+  {
+    __m128i const s = _mm_add_epi64(_mm256_castsi256_si128(v),
+                                    _mm256_extracti128_si256(v, 1));
+    return uint64_t(_mm_cvtsi128_si64(s)) + uint64_t(_mm_extract_epi64(s, 1));
+  }
+};
+
+/* The FEATURE_DEPTH best levels of both sides of every book, kept up to
+ * date as the feed is replayed (see above). After each step, m_changed
+ * says which side of which book, if any, has a different window; the
+ * feature stage and the shared memory book publisher (book_shm.h) only
+ * do their work for those. */
+template<typename T>
+class book_windows
+{
+ public:
+  static constexpr size_t MAX_BOOKS = engine<T>::MAX_BOOKS;
+
+  struct changed_t {
+    bool any;
+    bool bid;
+    uint16_t locate;
+  };
+
+  side_window_t const &window(uint16_t const locate, bool const bid) const
+  {
+    return m_windows[locate][bid ? 0 : 1];
+  }
+  changed_t m_changed = {};
+  size_t m_updates = 0;  // book messages that changed a window in place
+  size_t m_shifts = 0;   // book messages that moved a window
+  size_t m_skips = 0;    // book messages below the window
+
+  /* Applies one framed message, as process_message, and brings the
+   * window of the touched side up to date. */
+  template<typename L>
+  __attribute__((__always_inline__)) itch_t
+  step(engine<T> &eng, buf_t &buf, L &trades)
+  {
+    char const *msg = buf.get(2);
+    itch_t const msgtype = itch_t(*msg);
+    uint16_t const locate = read_locate(msg + 1);
+    m_changed.any = false;
+    // What the message removes has to be looked up before the order
+    // goes away. A replace stays on its side and is a remove and an add.
+    price_t price;
+    bool bid;
+    qty_t qty;
+    price_t new_price = 0;
+    qty_t new_qty = qty_t(0);
+    bool const adds = itch_t::ADD_ORDER == msgtype || itch_t::ADD_ORDER_MPID == msgtype;
+    switch (msgtype) {
+      case itch_t::ADD_ORDER:
+      case itch_t::ADD_ORDER_MPID:
+        price = read_price(msg + 32);
+        bid = BUY_SELL::BUY == BUY_SELL(msg[19]);
+        qty = read_qty(msg + 20);
+        break;
+      case itch_t::EXECUTE_ORDER:
+      case itch_t::EXECUTE_ORDER_WITH_PRICE:
+      case itch_t::REDUCE_ORDER:
+        price = eng.order_price(order_id_t(read_oid(msg + 11)));
+        bid = eng.order_is_bid(order_id_t(read_oid(msg + 11)));
+        qty = read_qty(msg + 19);
+        break;
+      case itch_t::DELETE_ORDER:
+        price = eng.order_price(order_id_t(read_oid(msg + 11)));
+        bid = eng.order_is_bid(order_id_t(read_oid(msg + 11)));
+        qty = eng.order_qty(order_id_t(read_oid(msg + 11)));
+        break;
+      case itch_t::REPLACE_ORDER:
+        price = eng.order_price(order_id_t(read_oid(msg + 11)));
+        bid = eng.order_is_bid(order_id_t(read_oid(msg + 11)));
+        qty = eng.order_qty(order_id_t(read_oid(msg + 11)));
+        new_price = read_price(msg + 31);
+        new_qty = read_qty(msg + 27);
+        break;
+      default:
+        return process_message(eng, buf, trades);
+    }
+    process_message(eng, buf, trades);
+
+    side_window_t &w = m_windows[locate][bid ? 0 : 1];
+    WINDOW r = adds ? w.add(bid, price, qty) : w.remove(bid, price, qty);
+    if (new_qty && WINDOW::SHIFTED != r) {
+      r = std::max(r, w.add(bid, new_price, new_qty));
+    }
+    if (WINDOW::SHIFTED == r) {
+      ++m_shifts;
+      w.clear();
+      eng.top(book_id_t(locate), bid, FEATURE_DEPTH, w.prices, w.qtys);
+    } else if (WINDOW::UPDATED == r) {
+      ++m_updates;
+    } else {
+      ++m_skips;
+    }
+#if CROSS_CHECK
+    side_window_t ref;
+    eng.top(book_id_t(locate), bid, FEATURE_DEPTH, ref.prices, ref.qtys);
+    assert(std::equal(ref.prices, ref.prices + FEATURE_DEPTH, w.prices));
+    assert(std::equal(ref.qtys, ref.qtys + FEATURE_DEPTH, w.qtys));
+#endif
+    if (WINDOW::UNCHANGED != r) m_changed = changed_t{true, bid, locate};
+    return msgtype;
+  }
+
+ private:
+  side_window_t m_windows[MAX_BOOKS][2];  // bid, ask
+};
+
+template<typename T>
+class feature_stage
+{
+ public:
+  static constexpr size_t MAX_BOOKS = engine<T>::MAX_BOOKS;
+
+  book_features_t const &features(uint16_t const locate) const
+  {
+    return m_features[locate];
+  }
+  book_features_t const *data() const { return m_features; }
+  book_windows<T> const &windows() const { return m_windows; }
+
+  /* Applies one framed message, as process_message, and brings the
+   * features of the touched book up to date. */
+  template<typename L>
+  __attribute__((__always_inline__)) itch_t
+  step(engine<T> &eng, buf_t &buf, L &trades)
+  {
+    itch_t const msgtype = m_windows.step(eng, buf, trades);
+    if (m_windows.m_changed.any) derive(m_windows.m_changed.locate);
+    return msgtype;
+  }
+
+ private:
+  book_features_t m_features[MAX_BOOKS] = {};
+  book_windows<T> m_windows;
+
+  void derive(uint16_t const locate)
+  {
+    side_window_t const &b = m_windows.window(locate, true);
+    side_window_t const &a = m_windows.window(locate, false);
+    uint64_t bid_notional, ask_notional;
+    book_features_t &f = m_features[locate];
+    b.sums(&f.bid_depth, &bid_notional);
+    a.sums(&f.ask_depth, &ask_notional);
+    quote_t const bid = b.best();
+    quote_t const ask = a.best();
+    f.bid_price = bid.price;
+    f.ask_price = ask.price;
+    f.bid_qty = bid.qty;
+    f.ask_qty = ask.qty;
+    if (f.bid_qty && f.ask_qty) {
+      double const bq = f.bid_qty;
+      double const aq = f.ask_qty;
+      double const bd = double(f.bid_depth);
+      double const ad = double(f.ask_depth);
+      // the four quotients in one division
+      __m256d const q = _mm256_div_pd(
+          _mm256_setr_pd(bq - aq, bd - ad, f.bid_price * aq + f.ask_price * bq,
+                         bid_notional * ad + ask_notional * bd),
+          _mm256_setr_pd(bq + aq, bd + ad, bq + aq, 2.0 * bd * ad));
+      alignas(32) double r[4];
+      _mm256_store_pd(r, q);
+      f.imbalance = float(r[0]);
+      f.depth_imbalance = float(r[1]);
+      f.microprice = r[2];
+      f.depth_mid = r[3];
+    } else {
+      f.imbalance = f.depth_imbalance = 0.0f;
+      f.microprice = f.depth_mid = 0.0;
+    }
+    ++f.updates;
+  }
+};
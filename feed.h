@@ -0,0 +1,128 @@
+#pragma once
+#include <cassert>
+#include <cstdio>
+#include <limits>
+#include "bufferedreader.h"
+#include "itch.h"
+#include "order_book.h"
+#include "trade_stats.h"
+
+/* Decoding of the framed ITCH stream and dispatch of the book messages
+ * into an engine. Shared by the single-feed backtest and the
+ * multi-venue driver in nbbo.h.
+ */
+
+template <itch_t __code>
+class PROCESS
+{
+ public:
+  static itch_message<__code> read_from(buf_t *__buf)
+  {
+    uint16_t const msglen = be16toh(*(uint16_t *)__buf->get(0));
+    __buf->advance(2);
+    assert(msglen == netlen<__code>);
+
+    __buf->ensure(netlen<__code>);
+    itch_message<__code> ret = itch_message<__code>::parse(__buf->get(0));
+    __buf->advance(netlen<__code>);
+    return ret;
+  }
+};
+
+#define DO_CASE(__itch_t)               \
+  case (__itch_t): {                    \
+    PROCESS<__itch_t>::read_from(&buf); \
+    break;                              \
+  }
+
+/* Consumes one framed message from buf and applies it to eng, and
+ * reports executions to trades (see trade_stats.h). Returns the message
+ * type. */
+template<typename T, typename L>
+__attribute__((__always_inline__)) inline itch_t
+process_message( engine<T>& eng, buf_t& buf, L& trades )
+{
+  itch_t const msgtype = itch_t(*buf.get(2));
+  switch (msgtype) {
+    DO_CASE(itch_t::SYSEVENT);
+    DO_CASE(itch_t::STOCK_DIRECTORY);
+    DO_CASE(itch_t::TRADING_ACTION);
+    DO_CASE(itch_t::REG_SHO_RESTRICT);
+    DO_CASE(itch_t::MPID_POSITION);
+    DO_CASE(itch_t::MWCB_DECLINE);
+    DO_CASE(itch_t::MWCB_STATUS);
+    DO_CASE(itch_t::IPO_QUOTE_UPDATE);
+    DO_CASE(itch_t::CROSS_TRADE);
+    DO_CASE(itch_t::BROKEN_TRADE);
+    DO_CASE(itch_t::NET_ORDER_IMBALANCE);
+    DO_CASE(itch_t::RETAIL_PRICE_IMPROVEMENT);
+    DO_CASE(itch_t::PROCESS_LULD_AUCTION_COLLAR_MESSAGE);
+
+    case (itch_t::ADD_ORDER): {
+      auto const pkt = PROCESS<itch_t::ADD_ORDER>::read_from(&buf);
+      assert(uint64_t(pkt.oid) <
+             uint64_t(std::numeric_limits<int32_t>::max()));
+      eng.add_order(order_id_t(pkt.oid), book_id_t(pkt.stock_locate), pkt.price,
+                    BUY_SELL::BUY == pkt.buy, pkt.qty);
+      break;
+    }
+    case (itch_t::ADD_ORDER_MPID): {
+      auto const pkt = PROCESS<itch_t::ADD_ORDER_MPID>::read_from(&buf);
+      eng.add_order(
+          order_id_t(pkt.add_msg.oid), book_id_t(pkt.add_msg.stock_locate),
+          pkt.add_msg.price, BUY_SELL::BUY == pkt.add_msg.buy, pkt.add_msg.qty);
+      break;
+    }
+    case (itch_t::EXECUTE_ORDER): {
+      auto const pkt = PROCESS<itch_t::EXECUTE_ORDER>::read_from(&buf);
+      price_t const price = eng.execute_order(order_id_t(pkt.oid), pkt.qty);
+      trades.on_execution(pkt.stock_locate, price, pkt.qty);
+      break;
+    }
+    case (itch_t::EXECUTE_ORDER_WITH_PRICE): {
+      auto const pkt =
+          PROCESS<itch_t::EXECUTE_ORDER_WITH_PRICE>::read_from(&buf);
+      eng.execute_order(order_id_t(pkt.exec.oid), pkt.exec.qty);
+      if (pkt.printable) {
+        trades.on_execution(pkt.exec.stock_locate, pkt.price, pkt.exec.qty);
+      }
+      break;
+    }
+    case (itch_t::TRADE): {
+      auto const pkt = PROCESS<itch_t::TRADE>::read_from(&buf);
+      trades.on_execution(pkt.stock_locate, pkt.price, pkt.qty);
+      break;
+    }
+    case (itch_t::REDUCE_ORDER): {
+      auto const pkt = PROCESS<itch_t::REDUCE_ORDER>::read_from(&buf);
+      eng.cancel_order(order_id_t(pkt.oid), pkt.qty);
+      break;
+    }
+    case (itch_t::DELETE_ORDER): {
+      auto const pkt = PROCESS<itch_t::DELETE_ORDER>::read_from(&buf);
+      eng.delete_order(order_id_t(pkt.oid));
+      break;
+    }
+    case (itch_t::REPLACE_ORDER): {
+      auto const pkt = PROCESS<itch_t::REPLACE_ORDER>::read_from(&buf);
+      eng.replace_order(order_id_t(pkt.oid),
+                        order_id_t(pkt.new_order_id), pkt.new_qty,
+                        pkt.new_price);
+      break;
+    }
+    default: {
+      printf("Uh oh bad code %d\n", char(msgtype));
+      assert(false);
+      break;
+    }
+  }
+  return msgtype;
+}
+
+template<typename T>
+__attribute__((__always_inline__)) inline itch_t
+process_message( engine<T>& eng, buf_t& buf )
+{
+  null_trade_listener none;
+  return process_message(eng, buf, none);
+}
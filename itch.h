@@ -224,11 +224,17 @@ struct itch_message<MSG::EXECUTE_ORDER> {
 using execute_with_price_t = itch_message<MSG::EXECUTE_ORDER_WITH_PRICE>;
 template <>
 struct itch_message<MSG::EXECUTE_ORDER_WITH_PRICE> {
-  itch_message(execute_order_t const __base) : exec(__base) {}
+  itch_message(execute_order_t const __base, bool __printable, price_t __price)
+      : exec(__base), printable(__printable), price(__price)
+  {
+  }
   execute_order_t const exec;
+  bool const printable;
+  price_t const price;
   static itch_message parse(char const *ptr)
   {
-    return itch_message(execute_order_t::parse(ptr));
+    return itch_message(execute_order_t::parse(ptr), *(ptr + 31) == 'Y',
+                        read_price(ptr + 32));
   }
 };
 using order_reduce_t = itch_message<MSG::REDUCE_ORDER>;
@@ -275,3 +281,29 @@ struct itch_message<MSG::REPLACE_ORDER> {
                         read_qty(ptr + 27), read_price(ptr + 31));
   }
 };
+using trade_t = itch_message<MSG::TRADE>;
+template <>
+struct itch_message<MSG::TRADE> {
+  itch_message(uint16_t __stock_locate, timestamp_t __timestamp, oid_t __oid,
+               BUY_SELL __buy, qty_t __qty, price_t __price)
+      : stock_locate(__stock_locate),
+        timestamp(__timestamp),
+        oid(__oid),
+        buy(__buy),
+        qty(__qty),
+        price(__price)
+  {
+  }
+  uint16_t const stock_locate;
+  timestamp_t const timestamp;
+  oid_t const oid;
+  BUY_SELL const buy;
+  qty_t const qty;
+  price_t const price;
+  static itch_message parse(char const *ptr)
+  {
+    return trade_t(read_locate(ptr + 1), read_timestamp(ptr + 5),
+                   read_oid(ptr + 11), BUY_SELL(*(ptr + 19)),
+                   read_qty(ptr + 20), read_price(ptr + 32));
+  }
+};
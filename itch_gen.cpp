@@ -0,0 +1,680 @@
+/*
+ * itch_gen.cpp
+ *
+ * Synthetic ITCH 5.0 feed generator. Writes a length-prefixed binary file
+ * (the same framing as the NASDAQ binary file spec) containing a stock
+ * directory followed by a deterministic stream of add, execute, reduce,
+ * delete and replace messages. The output replays through `a.out --isa ...`
+ * exactly like a real day, so every implementation can be exercised on
+ * fixed, reproducible scenarios without access to the NASDAQ FTP server.
+ *
+ * The generator keeps its own model of every live order so that the
+ * stream is always valid: executes and reduces never exceed the open
+ * quantity, deletes and replaces only refer to live orders, and bids are
+ * always placed below the per-symbol mid and asks above it.
+ *
+ * All randomness comes from a splitmix64 stream seeded by --seed and all
+ * distributions are implemented here, so a given command line produces a
+ * byte-identical file on every platform and standard library.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <endian.h>
+#include "itch.h"
+#include "book_digest.h"
+
+class rng
+{
+ public:
+  explicit rng(uint64_t seed) : m_state(seed) {}
+  uint64_t next()
+  {
+    uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+  // uniform in [0, 1)
+  double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+  // uniform in [lo, hi]
+  uint64_t range(uint64_t lo, uint64_t hi)
+  {
+    return lo + next() % (hi - lo + 1);
+  }
+  bool chance(double p) { return uniform() < p; }
+  // geometric on {1, 2, ...} with the given mean
+  uint32_t geometric(double mean)
+  {
+    if (mean <= 1.0) return 1;
+    double const p = 1.0 / mean;
+    return 1 + uint32_t(std::log(1.0 - uniform()) / std::log(1.0 - p));
+  }
+
+ private:
+  uint64_t m_state;
+};
+
+enum class DEPTH_DIST { GEOMETRIC, UNIFORM };
+
+struct gen_config {
+  uint64_t seed = 1;
+  uint64_t messages = 10000000;  // book messages, excluding the directory
+  uint32_t symbols = 1000;
+  uint32_t orders_per_symbol = 200;  // steady-state live orders per symbol
+  double depth = 4.0;                // mean distance from the mid, in ticks
+  DEPTH_DIST depth_dist = DEPTH_DIST::GEOMETRIC;
+  double far_fraction = 0.02;  // fraction of adds placed far from the inside
+  uint32_t far_depth = 2000;   // max distance in ticks of a far add
+  double hot_fraction = 0.0;   // fraction of messages sent to symbol 1
+  double skew = 0.0;           // Zipf exponent of adds over the symbols
+  uint32_t high_symbols = 0;   // symbols 1..n quoted above $214,748
+  uint32_t stub_symbols = 0;   // symbols 1..n opening with stub quotes
+  uint32_t deep_symbols = 0;   // symbols 1..n quoted as in the deep scenario
+  uint32_t deep_depth = 400;   // max distance in ticks of their adds
+  uint32_t oid_stride = 1;     // mean gap between consecutive oids
+  // relative weights of the non-add messages
+  double delete_ratio = 0.60;
+  double replace_ratio = 0.20;
+  double execute_ratio = 0.12;
+  double reduce_ratio = 0.08;
+  double execute_price_ratio = 0.1;  // fraction of executes sent as 'C'
+  double hidden_ratio = 0.1;  // fraction of executes followed by a hidden 'P'
+  double mid_drift = 0.01;  // probability per message that a mid moves a tick
+};
+
+struct live_order {
+  uint64_t oid;
+  uint16_t locate;
+  BUY_SELL side;
+  uint32_t price;
+  uint32_t qty;
+};
+
+/* Writes framed messages into a large stdio buffer. Fields are written
+ * big-endian, mirroring the read_* helpers in itch.h. */
+class itch_writer
+{
+ public:
+  explicit itch_writer(FILE *f) : m_file(f) {}
+
+  template <itch_t __code>
+  char *begin(uint16_t locate, timestamp_t timestamp)
+  {
+    uint16_t const len = htobe16(netlen<__code>);
+    memcpy(m_msg, &len, 2);
+    memset(m_msg + 2, 0, netlen<__code>);
+    char *p = m_msg + 2;
+    p[0] = char(__code);
+    write_two(p + 1, locate);
+    write_two(p + 3, 0);  // tracking number
+    write_six(p + 5, timestamp);
+    m_len = 2 + netlen<__code>;
+    ++m_count;
+    return p;
+  }
+  void end() { fwrite(m_msg, 1, m_len, m_file); }
+  uint64_t count() const { return m_count; }
+
+  static void write_two(char *dst, uint16_t v)
+  {
+    v = htobe16(v);
+    memcpy(dst, &v, 2);
+  }
+  static void write_four(char *dst, uint32_t v)
+  {
+    v = htobe32(v);
+    memcpy(dst, &v, 4);
+  }
+  static void write_six(char *dst, uint64_t v)
+  {
+    v = htobe64(v << 16);
+    memcpy(dst, &v, 6);
+  }
+  static void write_eight(char *dst, uint64_t v)
+  {
+    v = htobe64(v);
+    memcpy(dst, &v, 8);
+  }
+
+ private:
+  FILE *m_file;
+  char m_msg[64];
+  unsigned m_len = 0;
+  uint64_t m_count = 0;
+};
+
+class generator
+{
+ public:
+  generator(gen_config const &cfg, FILE *out)
+      : m_cfg(cfg), m_rng(cfg.seed), m_w(out), m_mid(cfg.symbols + 1)
+  {
+    m_live.reserve(size_t(cfg.symbols) * cfg.orders_per_symbol * 2);
+    if (cfg.skew > 0) {
+      // the symbol of rank r gets weight 1 / r^skew; ranks are shuffled
+      // over the locates, as activity is over alphabetical locates
+      m_by_rank.resize(cfg.symbols);
+      for (uint32_t i = 0; i < cfg.symbols; i++) m_by_rank[i] = uint16_t(i + 1);
+      for (uint32_t i = cfg.symbols; i > 1; i--) {
+        std::swap(m_by_rank[i - 1], m_by_rank[m_rng.range(0, i - 1)]);
+      }
+      double sum = 0;
+      for (uint32_t r = 1; r <= cfg.symbols; r++) {
+        sum += 1.0 / std::pow(double(r), cfg.skew);
+        m_rank_cdf.push_back(sum);
+      }
+    }
+  }
+
+  void run()
+  {
+    sysevent('O');
+    for (uint16_t locate = 1; locate <= m_cfg.symbols; locate++) {
+      directory(locate);
+    }
+    sysevent('Q');
+    m_opening = m_w.count();
+    for (uint16_t locate = 1; locate <= m_cfg.stub_symbols; locate++) {
+      stub_quotes(locate);
+    }
+    uint64_t const target = uint64_t(m_cfg.symbols) * m_cfg.orders_per_symbol;
+    double const removes = m_cfg.delete_ratio + m_cfg.replace_ratio +
+                           m_cfg.execute_ratio + m_cfg.reduce_ratio;
+    for (uint64_t i = 0; i < m_cfg.messages; i++) {
+      m_timestamp += m_rng.range(1, 2000);
+      // Fill towards the steady-state size, then hover around it with an
+      // even split between adds and the other messages.
+      double const fill = m_live.size() / double(target ? target : 1);
+      bool const add = m_live.empty() || fill < 0.9 ||
+                       (fill < 1.1 && m_rng.chance(0.5));
+      if (add) {
+        add_order(pick_locate());
+        continue;
+      }
+      size_t const idx = m_rng.range(0, m_live.size() - 1);
+      double x = m_rng.uniform() * removes;
+      if ((x -= m_cfg.delete_ratio) < 0) {
+        delete_order(idx);
+      } else if ((x -= m_cfg.replace_ratio) < 0) {
+        replace_order(idx);
+      } else if ((x -= m_cfg.execute_ratio) < 0) {
+        execute_order(idx);
+      } else {
+        reduce_order(idx);
+      }
+    }
+    sysevent('M');
+    sysevent('C');
+  }
+
+  uint64_t messages() const { return m_w.count(); }
+  // what a.out counts as packets: the messages from the first add on
+  uint64_t packets() const { return m_w.count() - m_opening; }
+  size_t live() const { return m_live.size() + m_stubs.size(); }
+  uint64_t max_oid() const { return m_oid; }
+
+  /* The digest that `a.out --digest` ends with on this file (see
+   * book_digest.h), taken from the generator's own model of the books
+   * rather than from any book implementation, so it checks them all. */
+  uint64_t digest() const
+  {
+    std::map<std::tuple<uint16_t, bool, uint32_t>, qty_t> levels;
+    for (std::vector<live_order> const *orders : {&m_live, &m_stubs}) {
+      for (live_order const &o : *orders) {
+        levels[std::make_tuple(o.locate, BUY_SELL::BUY == o.side, o.price)] += o.qty;
+      }
+    }
+    uint64_t h = 0;
+    for (auto const &l : levels) {
+      h += book_digest::hash_level(std::get<0>(l.first), std::get<1>(l.first),
+                                   std::get<2>(l.first), l.second);
+    }
+    return h;
+  }
+
+ private:
+  gen_config const m_cfg;
+  rng m_rng;
+  itch_writer m_w;
+  std::vector<uint32_t> m_mid;     // per-locate mid, in ticks
+  std::vector<live_order> m_live;  // dense, swap-removed
+  std::vector<live_order> m_stubs;  // never removed
+  uint64_t m_opening = 0;  // messages before the first add
+  std::vector<uint16_t> m_by_rank;  // with skew, the locate of each rank
+  std::vector<double> m_rank_cdf;   // and the cumulative weights
+  timestamp_t m_timestamp = 34200ULL * 1000000000ULL;  // 09:30
+  uint64_t m_oid = 0;
+  uint64_t m_match = 0;
+
+  static constexpr uint32_t TICK = 100;  // $0.01 at 4 implied decimals
+
+  void sysevent(char code)
+  {
+    char *p = m_w.begin<itch_t::SYSEVENT>(0, m_timestamp);
+    p[11] = code;
+    m_w.end();
+  }
+
+  void directory(uint16_t locate)
+  {
+    char *p = m_w.begin<itch_t::STOCK_DIRECTORY>(locate, m_timestamp);
+    char sym[9];
+    snprintf(sym, sizeof(sym), "S%-7u", unsigned(locate));
+    memcpy(p + 11, sym, 8);
+    p[19] = char(MARKET_CATEGORY::NASDAQ_GLOBAL_SELECT);
+    p[20] = 'N';
+    itch_writer::write_four(p + 21, 100);
+    p[25] = 'N';
+    p[26] = 'C';
+    memcpy(p + 27, "Z ", 2);
+    p[29] = 'P';
+    p[30] = 'N';
+    p[31] = 'N';
+    p[32] = '1';
+    p[33] = 'N';
+    p[38] = 'N';
+    m_w.end();
+    // mids between $5 and $500, or for the high priced symbols between
+    // $250,000 and $400,000, past a signed 32-bit price
+    if (locate <= m_cfg.high_symbols) {
+      m_mid[locate] = uint32_t(m_rng.range(25000000, 40000000));
+    } else {
+      m_mid[locate] = uint32_t(m_rng.range(500, 50000));
+    }
+  }
+
+  uint16_t pick_locate()
+  {
+    if (m_cfg.hot_fraction > 0 && m_rng.chance(m_cfg.hot_fraction)) return 1;
+    if (!m_rank_cdf.empty()) {
+      double const x = m_rng.uniform() * m_rank_cdf.back();
+      size_t const r = std::upper_bound(m_rank_cdf.begin(), m_rank_cdf.end(), x) - m_rank_cdf.begin();
+      return m_by_rank[std::min(r, m_by_rank.size() - 1)];
+    }
+    return uint16_t(m_rng.range(1, m_cfg.symbols));
+  }
+
+  uint32_t pick_distance(uint16_t locate)
+  {
+    // a few deep books among thin ones, as on a real day
+    if (locate <= m_cfg.deep_symbols) {
+      return uint32_t(m_rng.range(1, m_cfg.deep_depth));
+    }
+    if (m_cfg.far_fraction > 0 && m_rng.chance(m_cfg.far_fraction)) {
+      uint32_t const lo = uint32_t(m_cfg.depth) + 1;
+      return uint32_t(m_rng.range(lo, std::max(lo, m_cfg.far_depth)));
+    }
+    if (m_cfg.depth_dist == DEPTH_DIST::UNIFORM) {
+      return uint32_t(m_rng.range(1, std::max(1u, uint32_t(m_cfg.depth * 2))));
+    }
+    return m_rng.geometric(m_cfg.depth);
+  }
+
+  uint32_t pick_price(uint16_t locate, BUY_SELL side)
+  {
+    uint32_t &mid = m_mid[locate];
+    if (m_rng.chance(m_cfg.mid_drift)) {
+      mid += m_rng.chance(0.5) ? 1 : -1;
+      if (mid < 2) mid = 2;
+    }
+    uint32_t const dist = pick_distance(locate);
+    uint32_t ticks;
+    if (side == BUY_SELL::BUY) {
+      ticks = dist < mid ? mid - dist : 1;
+    } else {
+      ticks = mid + dist;
+    }
+    return ticks * TICK;
+  }
+
+  uint32_t pick_qty() { return 100 * uint32_t(m_rng.geometric(2.0)); }
+
+  uint64_t next_oid()
+  {
+    m_oid += m_cfg.oid_stride <= 1 ? 1 : m_rng.range(1, 2 * m_cfg.oid_stride - 1);
+    return m_oid;
+  }
+
+  void remove(size_t idx)
+  {
+    m_live[idx] = m_live.back();
+    m_live.pop_back();
+  }
+
+  void add_order(uint16_t locate)
+  {
+    BUY_SELL const side = m_rng.chance(0.5) ? BUY_SELL::BUY : BUY_SELL::SELL;
+    live_order const o{next_oid(), locate, side, pick_price(locate, side),
+                       pick_qty()};
+    write_add(o);
+    m_live.push_back(o);
+  }
+
+  /* A market maker's stub quotes: a bid at $0.01 and an ask at the
+   * highest price allowed, $199,999.99, or for the high priced symbols
+   * the top of the wire format, $429,496.72. They are the first orders in
+   * their book, odd locates' bid first and even ones' ask first, and stay
+   * all day, so the book's first price is about as far from its inside
+   * as a price can be. */
+  void stub_quotes(uint16_t locate)
+  {
+    for (bool const bid_first : {true, false}) {
+      BUY_SELL const side = bid_first == bool(locate & 1) ? BUY_SELL::BUY : BUY_SELL::SELL;
+      uint32_t const ask = locate <= m_cfg.high_symbols ? 4294967200u : 1999999900u;
+      live_order const o{next_oid(), locate, side, side == BUY_SELL::BUY ? 100 : ask, 100};
+      write_add(o);
+      m_stubs.push_back(o);
+    }
+  }
+
+  void write_add(live_order const &o)
+  {
+    char *p = m_w.begin<itch_t::ADD_ORDER>(o.locate, m_timestamp);
+    itch_writer::write_eight(p + 11, o.oid);
+    p[19] = char(o.side);
+    itch_writer::write_four(p + 20, o.qty);
+    char sym[9];
+    snprintf(sym, sizeof(sym), "S%-7u", unsigned(o.locate));
+    memcpy(p + 24, sym, 8);
+    itch_writer::write_four(p + 32, o.price);
+    m_w.end();
+  }
+
+  void delete_order(size_t idx)
+  {
+    live_order const &o = m_live[idx];
+    char *p = m_w.begin<itch_t::DELETE_ORDER>(o.locate, m_timestamp);
+    itch_writer::write_eight(p + 11, o.oid);
+    m_w.end();
+    remove(idx);
+  }
+
+  void replace_order(size_t idx)
+  {
+    live_order &o = m_live[idx];
+    uint64_t const new_oid = next_oid();
+    // Most replaces are small moves of price or size near the original.
+    uint32_t price = o.price;
+    if (m_rng.chance(0.7)) {
+      price = pick_price(o.locate, o.side);
+    }
+    uint32_t const qty = pick_qty();
+    char *p = m_w.begin<itch_t::REPLACE_ORDER>(o.locate, m_timestamp);
+    itch_writer::write_eight(p + 11, o.oid);
+    itch_writer::write_eight(p + 19, new_oid);
+    itch_writer::write_four(p + 27, qty);
+    itch_writer::write_four(p + 31, price);
+    m_w.end();
+    o.oid = new_oid;
+    o.price = price;
+    o.qty = qty;
+  }
+
+  void execute_order(size_t idx)
+  {
+    live_order &o = m_live[idx];
+    uint32_t const qty =
+        m_rng.chance(0.5) ? o.qty : uint32_t(m_rng.range(1, o.qty));
+    bool const with_price = m_rng.chance(m_cfg.execute_price_ratio);
+    char *p = with_price
+                  ? m_w.begin<itch_t::EXECUTE_ORDER_WITH_PRICE>(o.locate,
+                                                                m_timestamp)
+                  : m_w.begin<itch_t::EXECUTE_ORDER>(o.locate, m_timestamp);
+    itch_writer::write_eight(p + 11, o.oid);
+    itch_writer::write_four(p + 19, qty);
+    itch_writer::write_eight(p + 23, ++m_match);
+    if (with_price) {
+      p[31] = 'Y';
+      itch_writer::write_four(p + 32, o.price);
+    }
+    m_w.end();
+    if (m_rng.chance(m_cfg.hidden_ratio)) {
+      // a hidden order resting at the same price also traded
+      p = m_w.begin<itch_t::TRADE>(o.locate, m_timestamp);
+      itch_writer::write_eight(p + 11, 0);
+      p[19] = char(o.side);
+      itch_writer::write_four(p + 20, uint32_t(m_rng.range(1, 500)));
+      char sym[9];
+      snprintf(sym, sizeof(sym), "S%-7u", unsigned(o.locate));
+      memcpy(p + 24, sym, 8);
+      itch_writer::write_four(p + 32, o.price);
+      itch_writer::write_eight(p + 36, ++m_match);
+      m_w.end();
+    }
+    o.qty -= qty;
+    if (0 == o.qty) remove(idx);
+  }
+
+  void reduce_order(size_t idx)
+  {
+    live_order &o = m_live[idx];
+    if (o.qty < 2) {
+      delete_order(idx);
+      return;
+    }
+    uint32_t const qty = uint32_t(m_rng.range(1, o.qty - 1));
+    char *p = m_w.begin<itch_t::REDUCE_ORDER>(o.locate, m_timestamp);
+    itch_writer::write_eight(p + 11, o.oid);
+    itch_writer::write_four(p + 19, qty);
+    m_w.end();
+    o.qty -= qty;
+  }
+};
+
+/* Fixed scenarios for regression runs. Each one targets a different path
+ * in the books: the inside-heavy common case, deep books where the sorted
+ * arrays get long, adds far from the inside that walk the whole side,
+ * replace-heavy churn, a mix of 50 deep books among thin ones, 8000
+ * thin books, about a day's worth of active symbols, whose book objects
+ * no longer all fit in the cache, the same 8000 with activity as skewed
+ * as a real day's: a few hundred busy books scattered among the rest,
+ * and books whose first orders are stub quotes far from their inside,
+ * some of them priced past a signed 32-bit price, which is for checking
+ * books against --digest more than for timing them. */
+static bool apply_scenario(std::string const &name, gen_config *cfg)
+{
+  if (name == "inside") {
+    cfg->depth = 2.0;
+    cfg->far_fraction = 0.0;
+  } else if (name == "deep") {
+    cfg->symbols = 50;
+    cfg->orders_per_symbol = 4000;
+    cfg->depth = 200.0;
+    cfg->depth_dist = DEPTH_DIST::UNIFORM;
+    cfg->far_fraction = 0.05;
+  } else if (name == "far") {
+    cfg->depth = 4.0;
+    cfg->far_fraction = 0.25;
+    cfg->far_depth = 5000;
+  } else if (name == "churn") {
+    cfg->replace_ratio = 0.6;
+    cfg->delete_ratio = 0.3;
+    cfg->execute_ratio = 0.05;
+    cfg->reduce_ratio = 0.05;
+  } else if (name == "mixed") {
+    cfg->deep_symbols = 50;
+  } else if (name == "many") {
+    cfg->symbols = 8000;
+    cfg->orders_per_symbol = 30;
+  } else if (name == "skewed") {
+    cfg->symbols = 8000;
+    cfg->orders_per_symbol = 30;
+    cfg->skew = 1.0;
+  } else if (name == "stubs") {
+    cfg->stub_symbols = 100;
+    cfg->high_symbols = 20;
+  } else if (name == "hot") {
+    cfg->hot_fraction = 0.3;
+    cfg->depth = 8.0;
+  } else if (name != "default") {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  gen_config cfg;
+  std::string filename;
+  std::string digest_file;
+
+  auto print_usage = [argv]() -> void {
+    fprintf(stderr, "Usage: %s [options] --out <path>\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --out <path>, -o <path>     Output ITCH file\n");
+    fprintf(stderr, "  --scenario <name>           Preset applied before the other options\n");
+    fprintf(stderr, "                              (default, inside, deep, far, churn, hot,\n");
+    fprintf(stderr, "                              mixed, many, skewed, stubs)\n");
+    fprintf(stderr, "  --seed <n>                  Random seed (default 1)\n");
+    fprintf(stderr, "  --messages <n>              Number of book messages (default 10000000)\n");
+    fprintf(stderr, "  --symbols <n>               Number of symbols (default 1000)\n");
+    fprintf(stderr, "  --orders <n>                Steady-state live orders per symbol (default 200)\n");
+    fprintf(stderr, "  --depth <ticks>             Mean distance of adds from the mid (default 4)\n");
+    fprintf(stderr, "  --depth-dist <d>            geometric or uniform (default geometric)\n");
+    fprintf(stderr, "  --far <fraction>            Fraction of adds placed far from the inside\n");
+    fprintf(stderr, "  --far-depth <ticks>         Max distance of a far add (default 2000)\n");
+    fprintf(stderr, "  --hot <fraction>            Fraction of adds sent to a single symbol\n");
+    fprintf(stderr, "  --skew <s>                  Spread adds over the symbols by a Zipf law\n");
+    fprintf(stderr, "                              with exponent s, in random order (default 0,\n");
+    fprintf(stderr, "                              uniform)\n");
+    fprintf(stderr, "  --high <n>                  Quote symbols 1..n above $214,748 (default 0)\n");
+    fprintf(stderr, "  --stubs <n>                 Open symbols 1..n with stub quotes, a bid at\n");
+    fprintf(stderr, "                              $0.01 and an ask at the highest price (default 0)\n");
+    fprintf(stderr, "  --deep-symbols <n>          Spread the adds of symbols 1..n uniformly up to\n");
+    fprintf(stderr, "                              --deep-depth ticks from the mid (default 0)\n");
+    fprintf(stderr, "  --deep-depth <ticks>        (default 400)\n");
+    fprintf(stderr, "  --oid-stride <n>            Mean gap between consecutive oids (default 1)\n");
+    fprintf(stderr, "  --delete <w>                Relative weight of deletes (default 0.60)\n");
+    fprintf(stderr, "  --replace <w>               Relative weight of replaces (default 0.20)\n");
+    fprintf(stderr, "  --execute <w>               Relative weight of executes (default 0.12)\n");
+    fprintf(stderr, "  --reduce <w>                Relative weight of reduces (default 0.08)\n");
+    fprintf(stderr, "  --hidden <fraction>         Fraction of executes followed by a hidden\n");
+    fprintf(stderr, "                              trade ('P') at the same price (default 0.1)\n");
+    fprintf(stderr, "  --digest <path>             Also write the final line --digest should give\n");
+    fprintf(stderr, "  --help, -h                  Show this help message\n");
+  };
+
+  // scenarios are applied first so that explicit options override them
+  for (int i = 1; i + 1 < argc; i++) {
+    if (std::string(argv[i]) == "--scenario" &&
+        !apply_scenario(argv[i + 1], &cfg)) {
+      fprintf(stderr, "Error: Unknown scenario '%s'\n", argv[i + 1]);
+      return 1;
+    }
+  }
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      print_usage();
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "Error: %s requires an argument\n", arg.c_str());
+      print_usage();
+      return 1;
+    }
+    char const *val = argv[++i];
+    if (arg == "--out" || arg == "-o") {
+      filename = val;
+    } else if (arg == "--scenario") {
+      // already applied
+    } else if (arg == "--seed") {
+      cfg.seed = strtoull(val, nullptr, 0);
+    } else if (arg == "--messages") {
+      cfg.messages = strtoull(val, nullptr, 0);
+    } else if (arg == "--symbols") {
+      cfg.symbols = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--orders") {
+      cfg.orders_per_symbol = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--depth") {
+      cfg.depth = atof(val);
+    } else if (arg == "--depth-dist") {
+      if (std::string(val) == "uniform") {
+        cfg.depth_dist = DEPTH_DIST::UNIFORM;
+      } else if (std::string(val) == "geometric") {
+        cfg.depth_dist = DEPTH_DIST::GEOMETRIC;
+      } else {
+        fprintf(stderr, "Error: Unknown depth distribution '%s'\n", val);
+        return 1;
+      }
+    } else if (arg == "--far") {
+      cfg.far_fraction = atof(val);
+    } else if (arg == "--far-depth") {
+      cfg.far_depth = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--hot") {
+      cfg.hot_fraction = atof(val);
+    } else if (arg == "--skew") {
+      cfg.skew = atof(val);
+    } else if (arg == "--high") {
+      cfg.high_symbols = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--stubs") {
+      cfg.stub_symbols = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--digest") {
+      digest_file = val;
+    } else if (arg == "--deep-symbols") {
+      cfg.deep_symbols = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--deep-depth") {
+      cfg.deep_depth = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--oid-stride") {
+      cfg.oid_stride = uint32_t(strtoul(val, nullptr, 0));
+    } else if (arg == "--delete") {
+      cfg.delete_ratio = atof(val);
+    } else if (arg == "--replace") {
+      cfg.replace_ratio = atof(val);
+    } else if (arg == "--execute") {
+      cfg.execute_ratio = atof(val);
+    } else if (arg == "--reduce") {
+      cfg.reduce_ratio = atof(val);
+    } else if (arg == "--hidden") {
+      cfg.hidden_ratio = atof(val);
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+      print_usage();
+      return 1;
+    }
+  }
+
+  if (filename.empty()) {
+    fprintf(stderr, "Error: No output file specified\n");
+    print_usage();
+    return 1;
+  }
+  if (cfg.symbols == 0 || cfg.symbols >= (1 << 14)) {
+    fprintf(stderr, "Error: --symbols must be between 1 and %d\n", (1 << 14) - 1);
+    return 1;
+  }
+
+  FILE *out = fopen(filename.c_str(), "wb");
+  if (!out) {
+    fprintf(stderr, "Could not open file %s\n", filename.c_str());
+    return 1;
+  }
+  static char iobuf[1 << 20];
+  setvbuf(out, iobuf, _IOFBF, sizeof(iobuf));
+
+  generator gen(cfg, out);
+  gen.run();
+  fclose(out);
+
+  fprintf(stderr, "%lu messages, %lu live orders at close, max oid %lu\n",
+          gen.messages(), gen.live(), gen.max_oid());
+  if (!digest_file.empty()) {
+    FILE *f = fopen(digest_file.c_str(), "w");
+    if (!f) {
+      fprintf(stderr, "Could not open file %s\n", digest_file.c_str());
+      return 1;
+    }
+    fprintf(f, "%lu %016lx\n", gen.packets(), gen.digest());
+    fclose(f);
+  }
+  return 0;
+}
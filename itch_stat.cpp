@@ -0,0 +1,140 @@
+/*
+ * itch_stat.cpp
+ *
+ * Watches a replay started with `a.out --live-stats <name>`: maps the
+ * shared memory region read-only (see live_stats.h), polls it and prints
+ * one line per interval with the packet rate, the progress through the
+ * file, the live orders, the books with resting orders, the pool in use
+ * and the per-type message rates. Exits when the replay has published
+ * its last update.
+ *
+ *   ./itch_stat [--interval <ms>] [name]       name defaults to /itch_stats
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "live_stats.h"
+
+using namespace live_stats;
+
+struct snapshot_t {
+  uint64_t updates;
+  uint64_t monotonic_ns;
+  uint64_t packets;
+  uint64_t file_offset;
+  uint64_t file_size;
+  uint64_t done;
+  uint64_t live_orders;
+  uint64_t active_books;
+  uint64_t pool_in_use;
+  uint64_t count[NUM_TYPES];
+};
+
+static uint64_t load(counter_t const &c) { return c.load(std::memory_order_relaxed); }
+
+// retries if a publish finished while reading (see live_stats.h)
+static snapshot_t read_snapshot(region_t const &r)
+{
+  snapshot_t s;
+  do {
+    s.updates = r.progress.updates.load(std::memory_order_acquire);
+    s.monotonic_ns = load(r.progress.monotonic_ns);
+    s.packets = load(r.progress.packets);
+    s.file_offset = load(r.progress.file_offset);
+    s.file_size = load(r.progress.file_size);
+    s.done = load(r.progress.done);
+    s.live_orders = load(r.books.live_orders);
+    s.active_books = load(r.books.active_books);
+    s.pool_in_use = load(r.books.pool_in_use);
+    for (size_t t = 0; t < NUM_TYPES; t++) {
+      s.count[t] = load(r.types.count[t]);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while (s.updates != r.progress.updates.load(std::memory_order_relaxed));
+  return s;
+}
+
+static void print_line(snapshot_t const &prev, snapshot_t const &cur)
+{
+  // no rates until there are two publishes to take them between
+  double const secs = prev.monotonic_ns ? (cur.monotonic_ns - prev.monotonic_ns) / 1e9 : 0.0;
+  double const rate = secs > 0 ? (cur.packets - prev.packets) / secs : 0.0;
+  double const pct = cur.file_size ? 100.0 * cur.file_offset / cur.file_size : 0.0;
+  printf("%12lu pkts %10.0f pkts/s %6.2f%% %10lu orders %6lu books %9lu pool |",
+         cur.packets, rate, pct, cur.live_orders, cur.active_books, cur.pool_in_use);
+  for (size_t t = 0; t < NUM_TYPES; t++) {
+    if (cur.count[t] == prev.count[t]) continue;
+    if (secs > 0) {
+      printf(" %c %.0f/s", char(t), (cur.count[t] - prev.count[t]) / secs);
+    } else {
+      printf(" %c %lu", char(t), cur.count[t]);
+    }
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  std::string name = "/itch_stats";
+  long interval_ms = 1000;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--interval") {
+      if (i + 1 < argc) {
+        interval_ms = std::stol(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --interval requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--help" || arg == "-h" || arg[0] == '-') {
+      fprintf(stderr, "Usage: %s [--interval <ms>] [name]\n", argv[0]);
+      fprintf(stderr, "  name defaults to /itch_stats, as given to a.out --live-stats\n");
+      return arg[0] == '-' && arg != "--help" && arg != "-h";
+    } else {
+      name = arg;
+    }
+  }
+
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", name.c_str(), strerror(errno));
+    return 1;
+  }
+  void *p = mmap(nullptr, sizeof(region_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == p) {
+    perror("mmap");
+    return 1;
+  }
+  region_t const &region = *static_cast<region_t const *>(p);
+  if (MAGIC != region.header.magic || VERSION != region.header.version) {
+    fprintf(stderr, "%s is not a live stats region of version %u\n", name.c_str(), VERSION);
+    return 1;
+  }
+  printf("pid %d, isa %s, file %s\n", region.header.pid, region.header.isa, region.header.file);
+
+  snapshot_t prev = {};
+  for (;;) {
+    snapshot_t const cur = read_snapshot(region);
+    if (cur.updates != prev.updates) {
+      print_line(prev, cur);
+      prev = cur;
+    } else if (kill(region.header.pid, 0) && ESRCH == errno) {
+      fprintf(stderr, "pid %d exited without a final update\n", region.header.pid);
+      return 1;
+    }
+    if (cur.done) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+  }
+  munmap(p, sizeof(region_t));
+  return 0;
+}
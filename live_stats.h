@@ -0,0 +1,173 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "bufferedreader.h"
+
+/* Live statistics of a running replay, published into a small POSIX
+ * shared memory region (shm_open) so that external tools, such as
+ * itch_stat, can watch a long run without touching it.
+ *
+ * The replay is the only writer. Every message it bumps a count for the
+ * message type in its own memory; every `interval` messages it copies
+ * those counts, the book totals and the file offset into the region
+ * with relaxed atomic stores and then bumps `updates`. The region is
+ * never read by the replay, and between publishes the hot loop costs
+ * one increment and one decrement-and-branch per message.
+ *
+ * Each group of counters is its own cache-line-aligned struct, so a
+ * reader polling one group does not pull in lines the writer is about
+ * to store to in another. Counters are read one at a time, so a reader
+ * may see a publish half applied; compare `updates` before and after if
+ * that matters. The layout is versioned by live_stats::VERSION.
+ */
+
+namespace live_stats {
+
+static constexpr uint64_t MAGIC = 0x7461747368637469;  // "itchstat"
+static constexpr uint32_t VERSION = 1;
+static constexpr size_t NUM_TYPES = 128;  // indexed by message type char
+
+using counter_t = std::atomic<uint64_t>;
+static_assert(counter_t::is_always_lock_free, "counters are shared across processes");
+
+struct alignas(64) header_t {
+  uint64_t magic;
+  uint32_t version;
+  int32_t pid;
+  char isa[16];
+  char file[96];
+};
+
+struct alignas(64) progress_t {
+  counter_t updates;      // bumped after every publish
+  counter_t monotonic_ns; // CLOCK_MONOTONIC at the publish
+  counter_t packets;
+  counter_t file_offset;
+  counter_t file_size;
+  counter_t done;         // set once, after the last publish
+};
+
+struct alignas(64) books_t {
+  counter_t live_orders;
+  counter_t active_books;  // books with at least one resting order
+  counter_t pool_in_use;   // level (or node) pool entries, 0 if no pool
+};
+
+struct alignas(64) types_t {
+  counter_t count[NUM_TYPES];
+};
+
+struct region_t {
+  header_t header;
+  progress_t progress;
+  books_t books;
+  types_t types;
+};
+static_assert(sizeof(region_t) % 64 == 0, "cache-line padded");
+
+inline uint64_t monotonic_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+inline void store(counter_t &c, uint64_t const v) { c.store(v, std::memory_order_relaxed); }
+
+/* The replay's side, for an engine<T>. name is a shm_open name, e.g.
+ * "/itch_stats". If the region cannot be created, ok() is false and the
+ * replay runs without it. Readers only need the layout above. */
+template<typename Engine>
+class writer
+{
+ public:
+  writer(char const *name, char const *isa, char const *file, size_t const interval)
+      : m_interval(interval ? interval : 1), m_countdown(m_interval)
+  {
+    // Start from a new, zeroed region. A reader still mapping the one
+    // left by an earlier run keeps it until it unmaps it.
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+      perror("shm_open");
+      return;
+    }
+    if (ftruncate(fd, sizeof(region_t))) {
+      perror("ftruncate");
+      close(fd);
+      return;
+    }
+    void *p = mmap(nullptr, sizeof(region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == p) {
+      perror("mmap");
+      return;
+    }
+    m_region = static_cast<region_t *>(p);
+    header_t &h = m_region->header;
+    h.version = VERSION;
+    h.pid = int32_t(getpid());
+    strncpy(h.isa, isa, sizeof(h.isa) - 1);
+    // keep the end of a long path, it has the file name
+    size_t const len = strlen(file);
+    strncpy(h.file, file + (len < sizeof(h.file) ? 0 : len - sizeof(h.file) + 1), sizeof(h.file) - 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    h.magic = MAGIC;
+  }
+  ~writer()
+  {
+    if (m_region) munmap(m_region, sizeof(region_t));
+  }
+  writer(writer const &) = delete;
+  writer &operator=(writer const &) = delete;
+
+  bool ok() const { return nullptr != m_region; }
+
+  // once per message, after it was applied; type is the itch_t char
+  __attribute__((__always_inline__)) void tick(char const type, Engine &eng, buf_t const &buf)
+  {
+    ++m_counts[uint8_t(type) % NUM_TYPES];
+    ++m_packets;
+    if (--m_countdown) return;
+    m_countdown = m_interval;
+    publish(eng, buf);
+  }
+
+  __attribute__((__noinline__)) void publish(Engine &eng, buf_t const &buf, bool const done = false)
+  {
+    if (!m_region) return;
+    size_t active = 0;
+    for (size_t i = 0; i < Engine::MAX_BOOKS; i++) {
+      uint16_t const b = uint16_t(i);  // book_id_t
+      active += 0 != eng.best(b, true).qty || 0 != eng.best(b, false).qty;
+    }
+    store(m_region->books.live_orders, eng.m_live_orders);
+    store(m_region->books.active_books, active);
+    store(m_region->books.pool_in_use, eng.m_shared.in_use());
+    for (size_t t = 0; t < NUM_TYPES; t++) {
+      if (m_counts[t]) store(m_region->types.count[t], m_counts[t]);
+    }
+    progress_t &p = m_region->progress;
+    store(p.monotonic_ns, monotonic_ns());
+    store(p.packets, m_packets);
+    store(p.file_offset, buf.pos);
+    store(p.file_size, buf.limit);
+    if (done) store(p.done, 1);
+    p.updates.fetch_add(1, std::memory_order_release);
+  }
+
+ private:
+  region_t *m_region = nullptr;
+  size_t const m_interval;
+  size_t m_countdown;
+  uint64_t m_packets = 0;
+  uint64_t m_counts[NUM_TYPES] = {};
+};
+
+}  // namespace live_stats
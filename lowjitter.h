@@ -0,0 +1,143 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "bufferedreader.h"
+#include "feed.h"
+
+/* --lowjitter: takes the operating system out of the timed region as far
+ * as a process can, for runs whose tail latency is what is measured.
+ *
+ * Before the clock starts, the replay thread is pinned to the first
+ * configured CPU and each helper thread (the --epoch-readers) to the
+ * next ones in turn, so the scheduler cannot migrate them and take
+ * their caches with them. The day is replayed once, untimed, into the
+ * engine, which is then reset: reset keeps every book's and pool's
+ * capacity (see engine::reset), so the books start the timed replay
+ * grown to the depth they will reach, and the oid map and the input
+ * have been touched end to end. Then mlockall(MCL_CURRENT | MCL_FUTURE)
+ * maps and locks everything, including what is allocated later. Where
+ * that is not allowed (RLIMIT_MEMLOCK without CAP_IPC_LOCK), the input
+ * mapping, the engine and the oid map are populated instead, which only
+ * keeps them until the kernel needs the memory back.
+ *
+ * The faults and context switches the replay thread still takes in the
+ * timed region are read with getrusage and reported.
+ */
+
+namespace lowjitter {
+
+/* Parses a CPU list such as "2", "2,4" or "2-5,8" into out. Returns false
+ * if it is not one. */
+inline bool parse_cpus(std::string const &s, std::vector<int> *out)
+{
+  size_t i = 0;
+  while (i < s.size()) {
+    size_t len = 0;
+    int const first = std::stoi(s.substr(i), &len);
+    int last = first;
+    i += len;
+    if (i < s.size() && '-' == s[i]) {
+      last = std::stoi(s.substr(++i), &len);
+      i += len;
+    }
+    if (first < 0 || last < first) return false;
+    for (int cpu = first; cpu <= last; cpu++) out->push_back(cpu);
+    if (i < s.size() && ',' != s[i++]) return false;
+  }
+  return !out->empty();
+}
+
+// pins thread to cpu; says why not if it cannot
+inline bool pin(pthread_t const thread, int const cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int const err = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (err) fprintf(stderr, "lowjitter: cannot pin to cpu %d: %s\n", cpu, strerror(err));
+  return 0 == err;
+}
+
+// maps every page of [p, p + len), for writing if write
+inline void populate(void const *p, size_t const len, bool const write)
+{
+  uintptr_t const page = uintptr_t(sysconf(_SC_PAGESIZE));
+  uintptr_t const begin = uintptr_t(p) & ~(page - 1);
+  uintptr_t const end = uintptr_t(p) + len;
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+  if (0 == madvise((void *)begin, end - begin, write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ)) return;
+#endif
+  for (uintptr_t a = std::max(begin, uintptr_t(p)); a < end; a = (a + page) & ~(page - 1)) {
+    volatile char *c = (volatile char *)a;
+    if (write) {
+      *c = *c;
+    } else {
+      (void)*c;
+    }
+  }
+}
+
+// the calling thread's faults and context switches so far
+struct usage_t {
+  long minflt = 0;
+  long majflt = 0;
+  long nvcsw = 0;   // voluntary context switches
+  long nivcsw = 0;  // involuntary: preempted
+  static usage_t now()
+  {
+    rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    usage_t u;
+    u.minflt = ru.ru_minflt;
+    u.majflt = ru.ru_majflt;
+    u.nvcsw = ru.ru_nvcsw;
+    u.nivcsw = ru.ru_nivcsw;
+    return u;
+  }
+  usage_t operator-(usage_t const &o) const
+  {
+    usage_t u;
+    u.minflt = minflt - o.minflt;
+    u.majflt = majflt - o.majflt;
+    u.nvcsw = nvcsw - o.nvcsw;
+    u.nivcsw = nivcsw - o.nivcsw;
+    return u;
+  }
+};
+
+/* Replays the file behind fd into eng, untimed, and resets it, so that
+ * its books and pools have the capacity the day needs. */
+template<class T>
+void warm(engine<T> &eng, int const fd)
+{
+  buf_t buf(fd);
+  while (is_ok(buf.ensure(3))) process_message(eng, buf);
+  eng.reset();
+}
+
+struct region_t {
+  void const *p;
+  size_t len;
+  bool write;
+};
+
+/* Locks the process's memory, now and to come. If it is not allowed,
+ * populates the regions instead and returns false. */
+inline bool lock(std::initializer_list<region_t> const regions)
+{
+  if (0 == mlockall(MCL_CURRENT | MCL_FUTURE)) return true;
+  perror("lowjitter: mlockall");
+  for (region_t const &r : regions) populate(r.p, r.len, r.write);
+  return false;
+}
+
+}  // namespace lowjitter
@@ -1,47 +1,229 @@
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <limits>
 #include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <fcntl.h>
 #include <iostream>
 #include "bufferedreader.h"
 #include "itch.h"
 #include "order_book.h"
+#include "feed.h"
+#include "nbbo.h"
+#include "features.h"
+#include "batch.h"
+#include "readahead.h"
+#include "perf_counters.h"
+#include "live_stats.h"
+#include "book_shm.h"
+#include "book_epoch.h"
+#include "event_cache.h"
+#include "pacer.h"
+#include "lowjitter.h"
 
 std::vector<symbol_t> symbol_from_locate;
 
-template <itch_t __code>
-class PROCESS
+void print_readahead( const readahead_t& ra )
 {
- public:
-  static itch_message<__code> read_from(buf_t *__buf)
-  {
-    uint16_t const msglen = be16toh(*(uint16_t *)__buf->get(0));
-    __buf->advance(2);
-    assert(msglen == netlen<__code>);
+  printf("readahead: %lu MB read ahead, %lu MB dropped, %ld major faults in the replay thread, %.3f ms stalled on I/O\n",
+         ra.m_read_bytes >> 20, ra.m_dropped_bytes >> 20, ra.m_majflt, ra.m_stall_nanos / 1e6);
+}
 
-    __buf->ensure(netlen<__code>);
-    itch_message<__code> ret = itch_message<__code>::parse(__buf->get(0));
-    __buf->advance(netlen<__code>);
-    return ret;
+// how the adaptive books moved between layouts; nothing for the others
+template<typename T>
+void print_layouts( engine<T>& )
+{
+}
+template<TRACE trace>
+void print_layouts( engine<order_book_adaptive<trace>>& eng )
+{
+  size_t wide = 0;
+  for ( size_t i = 0; i < eng.SLOTS; i++ ) {
+    wide += eng.m_books[i].wide();
   }
+  printf("adaptive: %lu promotions, %lu demotions, %lu books wide at the end\n",
+         eng.m_shared.m_promotions, eng.m_shared.m_demotions, wide);
+}
+
+/* One in-process reader of --epoch-readers: snapshots k books picked at
+ * random from those published so far, back to back, until the replay
+ * ends. Every 16th snapshot is timed on its own for the percentiles. */
+struct epoch_reader_stats {
+  size_t snapshots = 0;
+  size_t books = 0;
+  size_t walked = 0;
+  size_t invalid = 0;
+  double seconds = 0;
+  std::vector<uint32_t> sampled_nanos;
 };
 
-static sprice_t mksigned(price_t price, BUY_SELL buy)
+// levels best first, bids falling and asks rising (see book_reader)
+static bool valid_epoch_book( const book_epoch::book_t& b )
 {
-  assert(price < std::numeric_limits<int32_t>::max());
-  return buy == BUY_SELL::BUY ? price : -price;
+  for ( size_t side = 0; side < 2; side++ ) {
+    if ( b.levels[side] > book_epoch::DEPTH ) return false;
+    for ( size_t i = 1; i < b.levels[side]; i++ ) {
+      if ( 0 == side ? b.prices[side][i] >= b.prices[side][i - 1]
+                     : b.prices[side][i] <= b.prices[side][i - 1] ) return false;
+    }
+  }
+  return true;
 }
 
-#define DO_CASE(__itch_t)               \
-  case (__itch_t): {                    \
-    PROCESS<__itch_t>::read_from(&buf); \
-    break;                              \
+static void epoch_reader( book_epoch::domain& d, size_t k, uint64_t seed, epoch_reader_stats *out )
+{
+  book_epoch::domain::reader r( d );
+  if ( !r.ok() ) return;
+  std::vector<uint16_t> locates( k );
+  std::vector<book_epoch::book_t> books( k );
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while ( !d.m_done.load( std::memory_order_acquire ) ) {
+    uint32_t const n = d.books();
+    if ( !n ) continue;
+    for ( size_t i = 0; i < k; i++ ) {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      locates[i] = d.book( uint32_t( seed % n ) );
+    }
+    if ( 0 == out->snapshots % 16 ) {
+      std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      r.snapshot( locates.data(), k, books.data() );
+      std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+      out->sampled_nanos.push_back( uint32_t(
+          std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count() ) );
+    } else {
+      r.snapshot( locates.data(), k, books.data() );
+    }
+    for ( size_t i = 0; i < k; i++ ) out->invalid += !valid_epoch_book( books[i] );
+    out->books += k;
+    ++out->snapshots;
   }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  out->seconds = std::chrono::duration<double>( end - start ).count();
+  out->walked = r.m_walked;
+}
+
+void print_epoch( const book_epoch::domain& d, std::vector<epoch_reader_stats>& stats )
+{
+  printf("epoch: %lu versions published, %lu epochs, %lu advances held up by a reader, "
+         "%lu versions allocated\n", d.m_writes, d.m_advances, d.m_blocked, d.versions());
+  for ( size_t i = 0; i < stats.size(); i++ ) {
+    epoch_reader_stats& s = stats[i];
+    std::sort( s.sampled_nanos.begin(), s.sampled_nanos.end() );
+    auto pct = [&]( double p ) -> uint32_t {
+      return s.sampled_nanos.empty() ? 0 : s.sampled_nanos[size_t( p * ( s.sampled_nanos.size() - 1 ) )];
+    };
+    printf("epoch reader %lu: %lu snapshots (%.0f per second), %u ns median, %u ns p99, "
+           "%.4f versions walked per book, %lu invalid\n", i, s.snapshots,
+           s.snapshots / s.seconds, pct( 0.5 ), pct( 0.99 ),
+           s.books ? s.walked / (double)s.books : 0.0, s.invalid);
+  }
+}
+
+// tickers by locate, trailing padding removed
+std::vector<std::string> symbol_names()
+{
+  std::vector<std::string> symbol_lookup(symbol_from_locate.size());
+  for ( size_t i = 0; i < symbol_from_locate.size(); i++ ) {
+    const char *s = string_from_locate( i );
+    if ( '\0'==s[0] ) continue;
+    size_t len = 0;
+    while ( len < 8 && ' '!=s[len] && '\0'!=s[len] ) len++;
+    symbol_lookup[i] = std::string( s, len );
+  }
+  return symbol_lookup;
+}
+
+template<typename T>
+void print_features( const feature_stage<T>& features, const std::vector<std::string>& names )
+{
+  printf("%-8s %12s %12s %9s %9s %12s %12s\n", "symbol", "bid", "ask",
+         "imbal", "imbal_k", "microprice", "depth_mid");
+  for ( size_t i = 0; i < names.size(); i++ ) {
+    const book_features_t& f = features.features( uint16_t(i) );
+    if ( !f.updates ) continue;
+    printf("%-8s %12.4f %12.4f %9.4f %9.4f %12.4f %12.4f\n", names[i].c_str(),
+           f.bid_price / 10000.0, f.ask_price / 10000.0, f.imbalance,
+           f.depth_imbalance, f.microprice / 10000.0, f.depth_mid / 10000.0);
+  }
+  printf("book messages: %lu updated a window, %lu moved one, %lu were below the top %lu levels\n",
+         features.windows().m_updates, features.windows().m_shifts,
+         features.windows().m_skips, FEATURE_DEPTH);
+}
+
+struct backtest_options_t {
+  size_t trades_interval = 0;
+  size_t readahead = 0;
+  bool perf = false;
+  std::string isa;
+  std::string live_stats;  // shm_open name, empty for none
+  size_t live_stats_interval = size_t(1) << 20;
+  std::string publish_books;  // shm_open name, empty for none
+  size_t epoch_readers = 0;
+  size_t epoch_books = 8;
+  std::string trace_file = "itch.trace";  // for a TRACE::ENABLED engine
+  size_t trace_events = size_t(1) << 22;
+  size_t trace_tsc_every = 1;
+  std::string digest_file;  // empty for none
+  size_t digest_interval = size_t(1) << 20;
+  double pace = 0;  // times the feed's speed, 0 for flat out
+  bool lowjitter = false;
+  std::vector<int> cpus;  // with lowjitter, the replay's then the helpers'
+  size_t repack_after = 0;  // packets before engine::repack, 0 for never
+};
 
 template<typename T>
+void repack( engine<T>& eng, [[maybe_unused]] size_t n )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  eng.repack();
+  size_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start ).count();
+#if PACK_BOOKS
+  printf("repack: %lu books by activity after %lu, in %.3f ms\n", eng.m_slots - 1, n, nanos / 1e6);
+#else
+  printf("repack: nothing to do, built with PACK_BOOKS=0 (%.3f ms)\n", nanos / 1e6);
+#endif
+}
+
+void print_lowjitter( const backtest_options_t& opts, bool locked, const lowjitter::usage_t& u )
+{
+  printf("lowjitter: pinned to cpu %d, memory %s; in the timed region %ld minor and %ld major faults, "
+         "%ld voluntary and %ld involuntary context switches\n",
+         opts.cpus[0], locked ? "locked" : "populated", u.minflt, u.majflt, u.nvcsw, u.nivcsw);
+}
+
+/* L is null_trade_listener or trade_stats. With trade_stats, the per
+ * symbol analytics are printed every trades_interval packets (if non
+ * zero) and at the end. With FEATURES, the book features of features.h
+ * are kept up to date and printed at the end. A non-zero readahead keeps
+ * that many bytes of the file ahead of the parser (see readahead.h).
+ * With perf, hardware counters are read over the same interval as the
+ * timer and printed per packet (see perf_counters.h). With a live_stats
+ * name, counters are published to that shared memory region every
+ * live_stats_interval packets (see live_stats.h). With a publish_books
+ * name, the best levels of every book are mirrored into that shared
+ * memory region as they change (see book_shm.h). With epoch_readers,
+ * they are also published to that many reader threads, each taking
+ * snapshots of epoch_books books at a time (see book_epoch.h). A TRACE::ENABLED engine
+ * records its operations into a ring of trace_events records in
+ * trace_file, reading the TSC every trace_tsc_every records (see
+ * trace_ring.h). With a digest_file, a digest of every book's levels is
+ * written there every digest_interval packets and at the end (see
+ * book_digest.h). A non-zero pace releases the messages from the first
+ * add on at pace times the speed of their timestamps and reports the
+ * lag against that schedule (see pacer.h). With lowjitter, the day is
+ * replayed once untimed and everything is locked in memory before the
+ * clock starts, and the epoch readers are pinned (see lowjitter.h). A
+ * non-zero repack_after re-packs the books by activity after that many
+ * packets, inside the timed region (see engine::repack). */
+template<typename T, typename L = null_trade_listener, bool FEATURES = false>
 double
-timeBacktest( const std::string filename )
+timeBacktest( const std::string filename, const backtest_options_t& opts )
 {
   int fd = open( filename.c_str(), O_RDONLY );
 
@@ -51,118 +233,508 @@ timeBacktest( const std::string filename )
   }
 
   buf_t buf(fd);
+  std::unique_ptr<readahead_t> ra;
+  if ( opts.readahead ) {
+    ra = std::make_unique<readahead_t>( buf, opts.readahead );
+  }
+  std::unique_ptr<perf_counters> counters;
+  if ( opts.perf ) {
+    counters = std::make_unique<perf_counters>();
+  }
   std::chrono::steady_clock::time_point start;
   size_t npkts = 0;
+  auto eng = std::make_unique<engine<T>>();
   // order_book::oid_map.max_load_factor(0.5);
-  T::oid_map.reserve(order_id_t(184118975 * 2));  // the first number
+  eng->oid_map.reserve(order_id_t(184118975 * 2));  // the first number
                                                   // is the empirically
                                                   // largest oid seen.
                                                   // multiply by 2 for
                                                   // good measure
+  if ( opts.lowjitter ) lowjitter::warm( *eng, fd );
+  std::unique_ptr<trace_ring::writer> tracer;
+  if constexpr (T::trace == TRACE::ENABLED) {
+    tracer = std::make_unique<trace_ring::writer>( opts.trace_file.c_str(), opts.trace_events,
+                                                     opts.trace_tsc_every );
+    if ( tracer->ok() ) {
+      eng->m_trace = tracer.get();
+    } else {
+      tracer.reset();
+    }
+  }
+  std::unique_ptr<book_digest> digest;
+  FILE *digest_out = nullptr;
+  size_t digest_lines = 0;
+  if ( !opts.digest_file.empty() ) {
+    digest_out = fopen( opts.digest_file.c_str(), "w" );
+    if ( digest_out ) {
+      digest = std::make_unique<book_digest>( T::MAX_BOOKS );
+      eng->m_digest = digest.get();
+    } else {
+      perror( opts.digest_file.c_str() );
+    }
+  }
+  auto trades = std::make_unique<L>();
+  constexpr bool has_trades = !std::is_same<L, null_trade_listener>::value;
+  std::unique_ptr<feature_stage<T>> features;
+  if constexpr (FEATURES) {
+    features = std::make_unique<feature_stage<T>>();
+  }
+  std::unique_ptr<live_stats::writer<engine<T>>> live;
+  if ( !opts.live_stats.empty() ) {
+    live = std::make_unique<live_stats::writer<engine<T>>>( opts.live_stats.c_str(), opts.isa.c_str(),
+                                                            filename.c_str(),
+                                                            opts.live_stats_interval );
+    if ( !live->ok() ) live.reset();
+  }
+  // publishing follows the windows of the feature stage, or its own
+  static_assert(book_shm::DEPTH == FEATURE_DEPTH && book_shm::MAX_BOOKS == T::MAX_BOOKS,
+                "book_shm slots are filled from book_windows");
+  static_assert(book_epoch::DEPTH == FEATURE_DEPTH && book_epoch::MAX_BOOKS == T::MAX_BOOKS,
+                "book_epoch versions are filled from book_windows");
+  std::unique_ptr<book_shm::writer> books;
+  std::unique_ptr<book_epoch::domain> epochs;
+  std::unique_ptr<book_windows<T>> own_windows;
+  const book_windows<T> *windows = nullptr;
+  if ( !opts.publish_books.empty() ) {
+    books = std::make_unique<book_shm::writer>( opts.publish_books.c_str() );
+    if ( !books->ok() ) books.reset();
+  }
+  if ( opts.epoch_readers ) {
+    epochs = std::make_unique<book_epoch::domain>();
+  }
+  if ( books || epochs ) {
+    if constexpr (FEATURES) {
+      windows = &features->windows();
+    } else {
+      own_windows = std::make_unique<book_windows<T>>();
+      windows = own_windows.get();
+    }
+  }
+  std::unique_ptr<pacer> pace;
+  if ( opts.pace > 0 ) {
+    pace = std::make_unique<pacer>( opts.pace );
+  }
+  std::vector<epoch_reader_stats> reader_stats( opts.epoch_readers );
+  std::vector<std::thread> readers;
+  for ( size_t i = 0; i < opts.epoch_readers; i++ ) {
+    readers.emplace_back( epoch_reader, std::ref( *epochs ), opts.epoch_books,
+                          0x9e3779b97f4a7c15 * ( i + 1 ), &reader_stats[i] );
+    if ( opts.lowjitter && opts.cpus.size() > 1 ) {
+      lowjitter::pin( readers.back().native_handle(), opts.cpus[1 + i % ( opts.cpus.size() - 1 )] );
+    }
+  }
+  bool locked = false;
+  lowjitter::usage_t usage;
+  if ( opts.lowjitter ) {
+    locked = lowjitter::lock( { { buf.ptr, buf.limit, false },
+                                { eng.get(), sizeof( *eng ), true },
+                                { eng->oid_map.m_data.data(),
+                                  eng->oid_map.m_data.size() * sizeof( eng->oid_map.m_data[0] ), true } } );
+  }
   printf("%lu\n", sizeof(T) * T::MAX_BOOKS);
-  while (is_ok(buf.ensure(3))) {
-    if (npkts) ++npkts;
-    itch_t const msgtype = itch_t(*buf.get(2));
-    switch (msgtype) {
-      DO_CASE(itch_t::SYSEVENT);
-      DO_CASE(itch_t::STOCK_DIRECTORY);
-      DO_CASE(itch_t::TRADING_ACTION);
-      DO_CASE(itch_t::REG_SHO_RESTRICT);
-      DO_CASE(itch_t::MPID_POSITION);
-      DO_CASE(itch_t::MWCB_DECLINE);
-      DO_CASE(itch_t::MWCB_STATUS);
-      DO_CASE(itch_t::IPO_QUOTE_UPDATE);
-      DO_CASE(itch_t::TRADE);
-      DO_CASE(itch_t::CROSS_TRADE);
-      DO_CASE(itch_t::BROKEN_TRADE);
-      DO_CASE(itch_t::NET_ORDER_IMBALANCE);
-      DO_CASE(itch_t::RETAIL_PRICE_IMPROVEMENT);
-      DO_CASE(itch_t::PROCESS_LULD_AUCTION_COLLAR_MESSAGE);
-
-      case (itch_t::ADD_ORDER): {
-        auto const pkt = PROCESS<itch_t::ADD_ORDER>::read_from(&buf);
-
-        if (!npkts) {
-          start = std::chrono::steady_clock::now();
-          ++npkts;
-        }
-
-        assert(uint64_t(pkt.oid) <
-               uint64_t(std::numeric_limits<int32_t>::max()));
-        T::add_order(order_id_t(pkt.oid), book_id_t(pkt.stock_locate),
-                              mksigned(pkt.price, pkt.buy), pkt.qty);
-        break;
-      }
-      case (itch_t::ADD_ORDER_MPID): {
-        auto const pkt = PROCESS<itch_t::ADD_ORDER_MPID>::read_from(&buf);
-        T::add_order(
-            order_id_t(pkt.add_msg.oid), book_id_t(pkt.add_msg.stock_locate),
-            mksigned(pkt.add_msg.price, pkt.add_msg.buy), pkt.add_msg.qty);
-        break;
+  // the hooks are compiled out of the flat-out loop when none of them is on
+  auto replay = [&]( auto hooks ) {
+    constexpr bool HOOKS = decltype(hooks)::value;
+    while (is_ok(buf.ensure(3))) {
+      if (npkts) {
+        ++npkts;
+      } else if (itch_t(*buf.get(2)) == itch_t::ADD_ORDER) {
+        if ( counters ) counters->start();
+        if ( opts.lowjitter ) usage = lowjitter::usage_t::now();
+        start = std::chrono::steady_clock::now();
+        ++npkts;
       }
-      case (itch_t::EXECUTE_ORDER): {
-        auto const pkt = PROCESS<itch_t::EXECUTE_ORDER>::read_from(&buf);
-        T::execute_order(order_id_t(pkt.oid), pkt.qty);
-        break;
-      }
-      case (itch_t::EXECUTE_ORDER_WITH_PRICE): {
-        auto const pkt =
-            PROCESS<itch_t::EXECUTE_ORDER_WITH_PRICE>::read_from(&buf);
-        T::execute_order(order_id_t(pkt.exec.oid), pkt.exec.qty);
-        break;
+      if constexpr (!HOOKS) {
+        if constexpr (FEATURES) {
+          features->step(*eng, buf, *trades);
+        } else {
+          process_message(*eng, buf, *trades);
+        }
+        continue;
       }
-      case (itch_t::REDUCE_ORDER): {
-        auto const pkt = PROCESS<itch_t::REDUCE_ORDER>::read_from(&buf);
-        T::cancel_order(order_id_t(pkt.oid), pkt.qty);
-        break;
+      if ( pace && npkts ) pace->release( read_timestamp( buf.get( 2 + 5 ) ) );
+      itch_t msgtype;
+      if constexpr (FEATURES) {
+        msgtype = features->step(*eng, buf, *trades);
+      } else if ( own_windows ) {
+        msgtype = own_windows->step(*eng, buf, *trades);
+      } else {
+        msgtype = process_message(*eng, buf, *trades);
       }
-      case (itch_t::DELETE_ORDER): {
-        auto const pkt = PROCESS<itch_t::DELETE_ORDER>::read_from(&buf);
-        T::delete_order(order_id_t(pkt.oid));
-        break;
+      if ( windows && windows->m_changed.any ) {
+        const auto changed = windows->m_changed;
+        const side_window_t& w = windows->window( changed.locate, changed.bid );
+        if ( books ) {
+          books->publish( changed.locate, changed.bid, w.prices, w.qtys, FEATURE_DEPTH );
+        }
+        if ( epochs ) {
+          epochs->publish( changed.locate, changed.bid, w.prices, w.qtys, FEATURE_DEPTH );
+        }
       }
-      case (itch_t::REPLACE_ORDER): {
-        auto const pkt = PROCESS<itch_t::REPLACE_ORDER>::read_from(&buf);
-        T::replace_order(order_id_t(pkt.oid),
-                                  order_id_t(pkt.new_order_id), pkt.new_qty,
-                                  mksigned(pkt.new_price, BUY_SELL::BUY));
-        // actually it will get re-signed inside. code smell
-        break;
+      if ( live ) live->tick( char(msgtype), *eng, buf );
+      if ( npkts == opts.repack_after && npkts ) repack( *eng, npkts );
+      if ( digest && npkts && 0 == npkts % opts.digest_interval ) {
+        fprintf( digest_out, "%lu %016lx\n", npkts, digest->update( *eng ) );
+        ++digest_lines;
       }
-      default: {
-        printf("Uh oh bad code %d\n", char(msgtype));
-        assert(false);
-        break;
+      if constexpr (has_trades) {
+        if (opts.trades_interval && npkts && 0 == npkts % opts.trades_interval) {
+          printf("trades after %lu packets\n", npkts);
+          trades->dump(stdout, symbol_names());
+        }
       }
     }
+  };
+  if ( pace || windows || live || opts.repack_after || digest ||
+       ( has_trades && opts.trades_interval ) ) {
+    replay( std::true_type() );
+  } else {
+    replay( std::false_type() );
   }
 
-  std::vector<std::string> symbol_lookup(symbol_from_locate.size());
-  for ( size_t i = 0; i < symbol_from_locate.size(); i++ ) {
-    char *s = string_from_locate( i );
-    if ( '\0'==s[0] ) continue;
-    for ( size_t j = 0; j < 8; j++ ) {
-        if ( ' '==s[j] ) {
-            s[j] = '\0';
-            break;
-        }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  if ( counters ) counters->stop();
+  if ( opts.lowjitter ) usage = lowjitter::usage_t::now() - usage;
+  if ( pace ) pace->finish();
+  if ( epochs ) {
+    epochs->m_done.store( 1, std::memory_order_release );
+    for ( auto& t : readers ) t.join();
+  }
+  if ( live ) live->publish( *eng, buf, true );
+  if ( digest ) {
+    fprintf( digest_out, "%lu %016lx\n", npkts, digest->update( *eng ) );
+    fclose( digest_out );
+    ++digest_lines;
+  }
+  size_t nanos =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  if ( ra ) {
+    ra->stop();
+    print_readahead( *ra );
+  }
+
+  if constexpr (has_trades) {
+    trades->dump(stdout, symbol_names());
+  }
+  if constexpr (FEATURES) {
+    print_features(*features, symbol_names());
+  }
+  if ( counters ) {
+    counters->print( stdout, npkts );
+  }
+  if ( pace ) pace->print( stdout );
+  if ( opts.lowjitter ) print_lowjitter( opts, locked, usage );
+  print_layouts( *eng );
+  if ( tracer ) {
+    printf("trace: %lu operations, the last %lu kept in %s\n", tracer->written(),
+           std::min( tracer->written(), tracer->capacity() ), opts.trace_file.c_str());
+  }
+  if ( digest ) {
+    printf("digest: %016lx, %lu lines in %s\n", digest->value(), digest_lines,
+           opts.digest_file.c_str());
+  }
+  if ( eng->m_wide_adds ) {
+    printf("%lu adds were outside their book's 32-bit range and kept on the 64-bit path"
+           " (see engine::book_price)\n", eng->m_wide_adds);
+  }
+  if ( epochs ) {
+    print_epoch( *epochs, reader_stats );
+  }
+  if ( books ) {
+    printf("books: %lu slot writes, %.3f per packet\n", books->m_writes,
+           books->m_writes / (double)npkts);
+  }
+  printf("%lu packets in %lu nanos , %.2f nanos per packet \n", npkts, nanos,
+         nanos / (double)npkts);
+  return nanos / (double)npkts;
+}
+
+template<typename T>
+void apply_event( engine<T>& eng, const event_cache::event_t& e )
+{
+  switch ( e.op ) {
+    case event_cache::OP::ADD:
+      eng.add_order( order_id_t(e.oid), book_id_t(e.locate), price_t(e.price), e.bid, e.qty );
+      break;
+    case event_cache::OP::EXECUTE:
+      eng.execute_order( order_id_t(e.oid), e.qty );
+      break;
+    case event_cache::OP::REDUCE:
+      eng.cancel_order( order_id_t(e.oid), e.qty );
+      break;
+    case event_cache::OP::DELETE:
+      eng.delete_order( order_id_t(e.oid) );
+      break;
+    case event_cache::OP::REPLACE:
+      eng.replace_order( order_id_t(e.oid), order_id_t(e.new_oid), e.qty, price_t(e.price) );
+      break;
+  }
+}
+
+/* Replays an event file (see event_cache.h) into a fresh engine: no
+ * framing, no byte swapping and no skipped messages, just the engine,
+ * with the slot of the order PREFETCH_EVENTS ahead already on its way. Of
+ * the backtest options, trace, digest, perf, pace (on the events'
+ * timestamps), lowjitter and repack_after apply; the others need the
+ * ITCH messages. Digest intervals and repack_after count ITCH packets of
+ * the source file, from each record's packet number, and the last line
+ * is per packet, as timeBacktest's are. */
+template<typename T>
+double
+timeEvents( const std::string filename, const backtest_options_t& opts )
+{
+  event_cache::mapped events( filename.c_str() );
+  if ( !events.ok() ) return 0.0;
+  std::unique_ptr<perf_counters> counters;
+  if ( opts.perf ) {
+    counters = std::make_unique<perf_counters>();
+  }
+  auto eng = std::make_unique<engine<T>>();
+  eng->oid_map.reserve(order_id_t(184118975 * 2));  // as in timeBacktest
+  if ( opts.lowjitter ) {
+    for ( const event_cache::event_t& e : events ) apply_event( *eng, e );
+    eng->reset();
+  }
+  std::unique_ptr<trace_ring::writer> tracer;
+  if constexpr (T::trace == TRACE::ENABLED) {
+    tracer = std::make_unique<trace_ring::writer>( opts.trace_file.c_str(), opts.trace_events,
+                                                     opts.trace_tsc_every );
+    if ( tracer->ok() ) {
+      eng->m_trace = tracer.get();
+    } else {
+      tracer.reset();
+    }
+  }
+  std::unique_ptr<book_digest> digest;
+  FILE *digest_out = nullptr;
+  if ( !opts.digest_file.empty() ) {
+    digest_out = fopen( opts.digest_file.c_str(), "w" );
+    if ( digest_out ) {
+      digest = std::make_unique<book_digest>( T::MAX_BOOKS );
+      eng->m_digest = digest.get();
+    } else {
+      perror( opts.digest_file.c_str() );
     }
-    symbol_lookup[i] = s;
   }
+  std::unique_ptr<pacer> pace;
+  if ( opts.pace > 0 ) {
+    pace = std::make_unique<pacer>( opts.pace );
+  }
+  bool locked = false;
+  lowjitter::usage_t usage;
+  if ( opts.lowjitter ) {
+    locked = lowjitter::lock( { { events.begin(), events.header().events * sizeof( event_cache::event_t ), false },
+                                { eng.get(), sizeof( *eng ), true },
+                                { eng->oid_map.m_data.data(),
+                                  eng->oid_map.m_data.size() * sizeof( eng->oid_map.m_data[0] ), true } } );
+    usage = lowjitter::usage_t::now();
+  }
+  // What timeBacktest does after packet n, it does here once the events
+  // of packets up to n are applied, before the first of a later packet;
+  // a packet that left no event is caught up with at the next one.
+  size_t digest_lines = 0;
+  size_t next_digest = digest ? opts.digest_interval : std::numeric_limits<size_t>::max();
+  bool repacked = 0 == opts.repack_after;
+  auto after_packets = [&]( size_t const done ) {
+    if ( !repacked && done >= opts.repack_after ) {
+      repack( *eng, opts.repack_after );
+      repacked = true;
+    }
+    while ( done >= next_digest ) {
+      fprintf( digest_out, "%lu %016lx\n", next_digest, digest->update( *eng ) );
+      ++digest_lines;
+      next_digest += opts.digest_interval;
+    }
+  };
 
+  if ( counters ) counters->start();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  // how far ahead the oid map is prefetched: the orders' slots are the
+  // one miss the decoded stream lets the replay see coming
+  constexpr size_t PREFETCH_EVENTS = 16;
+  size_t nevents = 0;
+  const event_cache::event_t *const last = events.end();
+  for ( const event_cache::event_t *ep = events.begin(); ep != last; ++ep ) {
+    const event_cache::event_t& e = *ep;
+    if ( pace ) pace->release( e.timestamp );
+    if ( size_t( last - ep ) > PREFETCH_EVENTS ) eng->prefetch( order_id_t(ep[PREFETCH_EVENTS].oid) );
+    after_packets( e.packet - 1 );
+    apply_event( *eng, e );
+    ++nevents;
+  }
+  size_t const npkts = events.header().packets;
+  after_packets( npkts );
   std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  if ( counters ) counters->stop();
+  if ( opts.lowjitter ) usage = lowjitter::usage_t::now() - usage;
+  if ( pace ) pace->finish();
   size_t nanos =
       std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
 
+  if ( counters ) {
+    counters->print( stdout, nevents );
+  }
+  if ( pace ) pace->print( stdout );
+  if ( opts.lowjitter ) print_lowjitter( opts, locked, usage );
+  print_layouts( *eng );
+  if ( tracer ) {
+    printf("trace: %lu operations, the last %lu kept in %s\n", tracer->written(),
+           std::min( tracer->written(), tracer->capacity() ), opts.trace_file.c_str());
+  }
+  if ( digest ) {
+    fprintf( digest_out, "%lu %016lx\n", npkts, digest->update( *eng ) );
+    fclose( digest_out );
+    ++digest_lines;
+    printf("digest: %016lx, %lu lines in %s\n", digest->value(), digest_lines,
+           opts.digest_file.c_str());
+  }
+  if ( eng->m_wide_adds ) {
+    printf("%lu adds were outside their book's 32-bit range and kept on the 64-bit path"
+           " (see engine::book_price)\n", eng->m_wide_adds);
+  }
+  printf("%lu events in %lu nanos , %.2f nanos per event \n", nevents, nanos,
+         nanos / (double)nevents);
   printf("%lu packets in %lu nanos , %.2f nanos per packet \n", npkts, nanos,
          nanos / (double)npkts);
   return nanos / (double)npkts;
 }
 
+template<typename T>
+double
+timeConsolidated( const std::vector<std::string>& filenames )
+{
+  consolidated_feed<T> feed;
+  for ( const auto& filename : filenames ) {
+    if ( !feed.add_venue( filename ) ) return 0.0;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  size_t const npkts = feed.run( []( uint32_t, const nbbo_t& ) {} );
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  size_t nanos =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+  for ( size_t v = 0; v < feed.num_venues(); v++ ) {
+    printf("venue %lu: %s, %lu packets\n", v, filenames[v].c_str(), feed.venue(v).m_npkts);
+  }
+  printf("%lu symbols, %lu nbbo updates\n", feed.m_tickers.size(), feed.m_nbbo_updates);
+  printf("%lu packets in %lu nanos , %.2f nanos per packet \n", npkts, nanos,
+         nanos / (double)npkts);
+  return nanos / (double)npkts;
+}
+
+template<typename T>
+double
+timeBatch( const std::string& dir, size_t budget, size_t readahead )
+{
+  std::vector<std::string> const files = batch_files( dir );
+  if ( files.empty() ) {
+    fprintf( stderr, "No files in %s\n", dir.c_str() );
+    return 0.0;
+  }
+  batch_replay<T> batch( files, readahead );
+  size_t const nanos = batch.run( budget );
+
+  size_t npkts = 0;
+  for ( const auto& day : batch.m_days ) {
+    if ( !day.ok ) continue;
+    printf("%s: %lu packets, %.2f nanos per packet\n", day.file.c_str(), day.npkts,
+           day.nanos / (double)day.npkts);
+    npkts += day.npkts;
+  }
+  printf("%lu days on %lu engines of %lu MB, %.3f ms resetting\n", files.size(),
+         batch.m_engines, batch.m_engine_bytes >> 20, batch.m_reset_nanos / 1e6);
+  if ( readahead ) {
+    printf("readahead: %ld major faults in the replay threads, %.3f ms stalled on I/O\n",
+           batch.m_majflt, batch.m_stall_nanos / 1e6);
+  }
+  printf("%lu packets in %lu nanos , %.2f nanos per packet , %.0f packets per second \n",
+         npkts, nanos, nanos / (double)npkts, npkts * 1e9 / nanos);
+  return nanos / (double)npkts;
+}
+
+// a byte count with an optional K, M or G suffix
+size_t parse_size( const std::string& s )
+{
+  size_t idx = 0;
+  size_t n = std::stoul( s, &idx );
+  switch ( idx < s.size() ? s[idx] : '\0' ) {
+    case 'G': case 'g': n <<= 10; [[fallthrough]];
+    case 'M': case 'm': n <<= 10; [[fallthrough]];
+    case 'K': case 'k': n <<= 10; break;
+    default: break;
+  }
+  return n;
+}
+
+/* Replays one file, ITCH or events, on every basic_book (see
+ * order_book_basic.h), or only on the one named only, each on a fresh
+ * engine as a plain --isa run would, and ranks them by ns/packet. */
+double
+timeMatrix( const std::string filename, const backtest_options_t& opts, bool from_events,
+            const std::string& only )
+{
+  std::vector<std::pair<double, std::string>> results;
+  for_each_basic_book<TRACE::DISABLED>( [&]( auto *book ) {
+    using T = std::remove_pointer_t<decltype( book )>;
+    std::string const name = T::name();
+    if ( !only.empty() && only != name ) return;
+    printf( "== %s\n", name.c_str() );
+    double const ns = from_events ? timeEvents<T>( filename, opts ) : timeBacktest<T>( filename, opts );
+    results.emplace_back( ns, name );
+  } );
+  if ( results.size() > 1 ) {
+    std::sort( results.begin(), results.end() );
+    printf( "rank storage/search/orders  nanos per packet  vs best\n" );
+    for ( size_t i = 0; i < results.size(); i++ ) {
+      printf( "%4lu %-24s %16.2f  %6.2fx\n", i + 1, results[i].second.c_str(), results[i].first,
+              results[i].first / results[0].first );
+    }
+  }
+  return results.empty() ? 0.0 : results[0].first;
+}
+
+// whether name is one of the basic_books, e.g. soa/simd/level
+bool is_basic_book( const std::string& name )
+{
+  bool found = false;
+  for_each_basic_book<TRACE::DISABLED>( [&]( auto *book ) {
+    found = found || name == std::remove_pointer_t<decltype( book )>::name();
+  } );
+  return found;
+}
+
+template<typename T>
+struct type_tag { using type = T; };
+
 int main(int argc, char *argv[])
 {
   std::string filename;
+  std::vector<std::string> venues;
+  std::string batch_dir;
+  // default budget: half of physical memory
+  size_t budget = size_t(sysconf(_SC_PHYS_PAGES)) * size_t(sysconf(_SC_PAGESIZE)) / 2;
   bool enable_trace = false;
+  std::string trace_file = "itch.trace";
+  size_t trace_events = size_t(1) << 22;
+  size_t trace_tsc_every = 1;
+  bool enable_trades = false;
+  bool enable_features = false;
+  size_t trades_interval = 0;
+  size_t readahead = 0;
+  bool enable_perf = false;
+  std::string live_stats_name;
+  std::string publish_books;
+  size_t epoch_readers = 0;
+  size_t epoch_books = 8;
+  size_t live_stats_interval = size_t(1) << 20;
+  std::string digest_file;
+  size_t digest_interval = size_t(1) << 20;
+  std::string convert_to;
+  double pace = 0;
+  bool lowjitter = false;
+  std::vector<int> cpus;
+  size_t repack_after = 0;
   std::string isa = "scalar";  // default to scalar implementation
 
   auto print_usage = [argv]() -> void {
@@ -170,9 +742,66 @@ int main(int argc, char *argv[])
       fprintf(stderr, "Options:\n");
       fprintf(stderr, "  --file <path>, -f <path>    Input ITCH file\n");
       fprintf(stderr, "  --isa <implementation>      Order book implementation\n");
-      fprintf(stderr, "                              (scalar, soa, soa_price, avx2)\n");
+      fprintf(stderr, "                              (scalar, soa, soa_price, avx2, btree,\n");
+      fprintf(stderr, "                              gap, adaptive)\n");
+      fprintf(stderr, "                              or a policy-built book, e.g. soa/simd/level\n");
+      fprintf(stderr, "                              (see order_book_basic.h); matrix runs and\n");
+      fprintf(stderr, "                              ranks all of those\n");
       fprintf(stderr, "                              Default: scalar\n");
-      fprintf(stderr, "  --trace                     Enable trace mode\n");
+      fprintf(stderr, "  --venue <path>              Add a venue to a consolidated (NBBO) run;\n");
+      fprintf(stderr, "                              repeat for each feed, replaces --file\n");
+      fprintf(stderr, "  --batch <dir>               Replay every file in dir (one day each) on a\n");
+      fprintf(stderr, "                              pool of engines, reused from day to day\n");
+      fprintf(stderr, "  --budget <size>             RAM for the --batch pool, e.g. 16G\n");
+      fprintf(stderr, "                              Default: half of physical memory\n");
+      fprintf(stderr, "  --readahead <size>          Keep size bytes (e.g. 64M) of the input read\n");
+      fprintf(stderr, "                              ahead of the parser on a helper thread and\n");
+      fprintf(stderr, "                              drop what was parsed, for cold files\n");
+      fprintf(stderr, "  --perf                      Count cycles, instructions, cache, dTLB and\n");
+      fprintf(stderr, "                              branch misses over the replay and print them\n");
+      fprintf(stderr, "                              per packet\n");
+      fprintf(stderr, "  --live-stats <name>         Publish packet, message type and book counts\n");
+      fprintf(stderr, "                              to shared memory <name> (e.g. /itch_stats)\n");
+      fprintf(stderr, "                              for itch_stat to watch\n");
+      fprintf(stderr, "  --live-stats-interval <n>   Publish every n packets. Default: 1048576\n");
+      fprintf(stderr, "  --publish-books <name>      Mirror the 8 best levels of every book into\n");
+      fprintf(stderr, "                              shared memory <name> (e.g. /itch_books), one\n");
+      fprintf(stderr, "                              seqlocked slot per locate, for book_reader\n");
+      fprintf(stderr, "  --digest <path>             Write a digest of every book's levels to path\n");
+      fprintf(stderr, "                              every --digest-interval packets and at the\n");
+      fprintf(stderr, "                              end; runs with different --isa should match\n");
+      fprintf(stderr, "  --digest-interval <n>       Default: 1048576\n");
+      fprintf(stderr, "  --epoch-readers <n>         Publish the 8 best levels of every book to n\n");
+      fprintf(stderr, "                              reader threads, each taking consistent\n");
+      fprintf(stderr, "                              snapshots of several books until the end\n");
+      fprintf(stderr, "  --epoch-books <k>           Books per snapshot. Default: 8\n");
+      fprintf(stderr, "  --trades                    Print per-symbol trade analytics (VWAP,\n");
+      fprintf(stderr, "                              volume, high/low) at the end\n");
+      fprintf(stderr, "  --trades-interval <n>       Also print them every n packets\n");
+      fprintf(stderr, "  --features                  Maintain book features (imbalance, microprice,\n");
+      fprintf(stderr, "                              depth-weighted mid) and print them at the end\n");
+      fprintf(stderr, "  --trace                     Record every book operation into a ring file\n");
+      fprintf(stderr, "                              (see trace_decode)\n");
+      fprintf(stderr, "  --trace-file <path>         Ring file for --trace (default itch.trace)\n");
+      fprintf(stderr, "  --trace-events <n>          Operations the ring keeps (default 4194304)\n");
+      fprintf(stderr, "  --trace-tsc-every <n>       Read the TSC for every nth operation only\n");
+      fprintf(stderr, "                              (default 1)\n");
+      fprintf(stderr, "  --convert <path>            Write the book events of the input file to\n");
+      fprintf(stderr, "                              path and exit; given such an event file as\n");
+      fprintf(stderr, "                              input, the replay runs straight from it\n");
+      fprintf(stderr, "  --pace <speed>              Release messages on the schedule of their\n");
+      fprintf(stderr, "                              timestamps, speed times as fast (1, 10,\n");
+      fprintf(stderr, "                              0.5, ...), and report the lag behind it;\n");
+      fprintf(stderr, "                              max (the default) runs flat out\n");
+      fprintf(stderr, "  --lowjitter                 Pin threads, replay the day once untimed and\n");
+      fprintf(stderr, "                              lock memory before timing; report the faults\n");
+      fprintf(stderr, "                              and context switches left in the timed region\n");
+      fprintf(stderr, "  --cpus <list>               CPUs for --lowjitter, e.g. 2,4-6: the replay\n");
+      fprintf(stderr, "                              on the first, helper threads on the others.\n");
+      fprintf(stderr, "                              Default: the CPU it starts on\n");
+      fprintf(stderr, "  --repack-after <n>          Re-pack the books by activity after n packets\n");
+      fprintf(stderr, "                              (events, from an event file), e.g. the\n");
+      fprintf(stderr, "                              opening's; see engine::repack\n");
       fprintf(stderr, "  --help, -h                  Show this help message\n");
   };
 
@@ -181,6 +810,42 @@ int main(int argc, char *argv[])
     std::string arg = argv[i];
     if (arg == "--trace") {
       enable_trace = true;
+    } else if (arg == "--trace-file") {
+      if (i + 1 < argc) {
+        trace_file = argv[++i];
+        enable_trace = true;
+      } else {
+        fprintf(stderr, "Error: --trace-file requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--trace-events") {
+      if (i + 1 < argc) {
+        trace_events = std::stoul(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --trace-events requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--trace-tsc-every") {
+      if (i + 1 < argc) {
+        trace_tsc_every = std::stoul(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --trace-tsc-every requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--perf") {
+      enable_perf = true;
+    } else if (arg == "--features") {
+      enable_features = true;
+    } else if (arg == "--trades") {
+      enable_trades = true;
+    } else if (arg == "--trades-interval") {
+      if (i + 1 < argc) {
+        trades_interval = std::stoul(argv[++i]);
+        enable_trades = true;
+      } else {
+        fprintf(stderr, "Error: --trades-interval requires an argument\n");
+        return 1;
+      }
     } else if (arg == "--file" || arg == "-f") {
       if (i + 1 < argc) {
         filename = argv[++i];
@@ -188,6 +853,121 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Error: --file requires an argument\n");
         return 1;
       }
+    } else if (arg == "--venue") {
+      if (i + 1 < argc) {
+        venues.push_back(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --venue requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--batch") {
+      if (i + 1 < argc) {
+        batch_dir = argv[++i];
+      } else {
+        fprintf(stderr, "Error: --batch requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--budget") {
+      if (i + 1 < argc) {
+        budget = parse_size(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --budget requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--readahead") {
+      if (i + 1 < argc) {
+        readahead = parse_size(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --readahead requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--live-stats") {
+      if (i + 1 < argc) {
+        live_stats_name = argv[++i];
+      } else {
+        fprintf(stderr, "Error: --live-stats requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--live-stats-interval") {
+      if (i + 1 < argc) {
+        live_stats_interval = std::stoul(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --live-stats-interval requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--publish-books") {
+      if (i + 1 < argc) {
+        publish_books = argv[++i];
+      } else {
+        fprintf(stderr, "Error: --publish-books requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--digest") {
+      if (i + 1 < argc) {
+        digest_file = argv[++i];
+      } else {
+        fprintf(stderr, "Error: --digest requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--digest-interval") {
+      if (i + 1 < argc) {
+        digest_interval = std::stoul(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --digest-interval requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--epoch-readers") {
+      if (i + 1 < argc) {
+        epoch_readers = std::stoul(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --epoch-readers requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--epoch-books") {
+      if (i + 1 < argc) {
+        epoch_books = std::stoul(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --epoch-books requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--convert") {
+      if (i + 1 < argc) {
+        convert_to = argv[++i];
+      } else {
+        fprintf(stderr, "Error: --convert requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--pace") {
+      if (i + 1 < argc) {
+        std::string const speed = argv[++i];
+        pace = speed == "max" ? 0 : std::stod(speed);
+        if (pace < 0) {
+          fprintf(stderr, "Error: --pace requires a positive speed or max\n");
+          return 1;
+        }
+      } else {
+        fprintf(stderr, "Error: --pace requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--lowjitter") {
+      lowjitter = true;
+    } else if (arg == "--cpus") {
+      if (i + 1 < argc) {
+        if (!lowjitter::parse_cpus(argv[++i], &cpus)) {
+          fprintf(stderr, "Error: --cpus requires a list of CPUs such as 2,4-6\n");
+          return 1;
+        }
+      } else {
+        fprintf(stderr, "Error: --cpus requires an argument\n");
+        return 1;
+      }
+    } else if (arg == "--repack-after") {
+      if (i + 1 < argc) {
+        repack_after = std::stoul(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --repack-after requires an argument\n");
+        return 1;
+      }
     } else if (arg == "--isa") {
       if (i + 1 < argc) {
         isa = argv[++i];
@@ -207,42 +987,130 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (filename.empty()) {
+  if (filename.empty() && venues.empty() && batch_dir.empty()) {
     fprintf(stderr, "Error: No input file specified\n");
     print_usage();
     return 1;
   }
 
+  if (!convert_to.empty()) {
+    event_cache::header_t h;
+    if (filename.empty() || !event_cache::convert(filename.c_str(), convert_to.c_str(), &h)) {
+      return 1;
+    }
+    printf("%lu book events from %lu packets written to %s\n", h.events, h.packets,
+           convert_to.c_str());
+    return 0;
+  }
+  bool const from_events = !filename.empty() && event_cache::is_event_file(filename.c_str());
+  if (from_events && (enable_features || enable_trades || !live_stats_name.empty() ||
+                      !publish_books.empty() || epoch_readers || readahead)) {
+    fprintf(stderr, "Note: %s is an event file; --features, --trades, --live-stats, "
+            "--publish-books, --epoch-readers and --readahead are ignored\n", filename.c_str());
+  }
+
+  if (lowjitter) {
+    if (cpus.empty()) cpus.push_back(sched_getcpu());
+    if (readahead) {
+      fprintf(stderr, "Note: --readahead is ignored with --lowjitter, which keeps the whole input in memory\n");
+      readahead = 0;
+    }
+    lowjitter::pin(pthread_self(), cpus[0]);
+  }
+
   // Run with appropriate ISA and trace setting
   TRACE trace_mode = enable_trace ? TRACE::ENABLED : TRACE::DISABLED;
+  backtest_options_t opts;
+  opts.trades_interval = enable_trades ? trades_interval : 0;
+  opts.readahead = readahead;
+  opts.perf = enable_perf;
+  opts.isa = isa;
+  opts.live_stats = live_stats_name;
+  opts.live_stats_interval = live_stats_interval;
+  opts.publish_books = publish_books;
+  opts.epoch_readers = epoch_readers;
+  opts.epoch_books = epoch_books;
+  opts.trace_file = trace_file;
+  opts.trace_events = trace_events;
+  opts.trace_tsc_every = trace_tsc_every;
+  opts.digest_file = digest_file;
+  opts.digest_interval = digest_interval;
+  opts.pace = pace;
+  opts.lowjitter = lowjitter;
+  opts.cpus = cpus;
+  opts.repack_after = repack_after;
+  auto run = [&]( auto tag ) {
+    using T = typename decltype(tag)::type;
+    if ( !batch_dir.empty() ) {
+      timeBatch<T>( batch_dir, budget, readahead );
+    } else if ( !venues.empty() ) {
+      timeConsolidated<T>( venues );
+    } else if ( from_events ) {
+      timeEvents<T>( filename, opts );
+    } else if ( enable_features && enable_trades ) {
+      timeBacktest<T, trade_stats, true>( filename, opts );
+    } else if ( enable_features ) {
+      timeBacktest<T, null_trade_listener, true>( filename, opts );
+    } else if ( enable_trades ) {
+      timeBacktest<T, trade_stats>( filename, opts );
+    } else {
+      timeBacktest<T>( filename, opts );
+    }
+  };
 
   if (isa == "scalar") {
     if (trace_mode == TRACE::ENABLED) {
-      timeBacktest<order_book_scalar<TRACE::ENABLED>>( filename );
+      run( type_tag<order_book_scalar<TRACE::ENABLED>>() );
     } else {
-      timeBacktest<order_book_scalar<TRACE::DISABLED>>( filename );
+      run( type_tag<order_book_scalar<TRACE::DISABLED>>() );
     }
   } else if (isa == "soa") {
     if (trace_mode == TRACE::ENABLED) {
-      timeBacktest<order_book_soa<TRACE::ENABLED>>( filename );
+      run( type_tag<order_book_soa<TRACE::ENABLED>>() );
     } else {
-      timeBacktest<order_book_soa<TRACE::DISABLED>>( filename );
+      run( type_tag<order_book_soa<TRACE::DISABLED>>() );
     }
   } else if (isa == "soa_price") {
     if (trace_mode == TRACE::ENABLED) {
-      timeBacktest<order_book_soa_price<TRACE::ENABLED>>( filename );
+      run( type_tag<order_book_soa_price<TRACE::ENABLED>>() );
     } else {
-      timeBacktest<order_book_soa_price<TRACE::DISABLED>>( filename );
+      run( type_tag<order_book_soa_price<TRACE::DISABLED>>() );
     }
   } else if (isa == "avx2") {
     if (trace_mode == TRACE::ENABLED) {
-      timeBacktest<order_book_soa_avx2<TRACE::ENABLED>>( filename );
+      run( type_tag<order_book_soa_avx2<TRACE::ENABLED>>() );
+    } else {
+      run( type_tag<order_book_soa_avx2<TRACE::DISABLED>>() );
+    }
+  } else if (isa == "btree") {
+    if (trace_mode == TRACE::ENABLED) {
+      run( type_tag<order_book_btree<TRACE::ENABLED>>() );
     } else {
-      timeBacktest<order_book_soa_avx2<TRACE::DISABLED>>( filename );
+      run( type_tag<order_book_btree<TRACE::DISABLED>>() );
+    }
+  } else if (isa == "gap") {
+    if (trace_mode == TRACE::ENABLED) {
+      run( type_tag<order_book_gap<TRACE::ENABLED>>() );
+    } else {
+      run( type_tag<order_book_gap<TRACE::DISABLED>>() );
+    }
+  } else if (isa == "adaptive") {
+    if (trace_mode == TRACE::ENABLED) {
+      run( type_tag<order_book_adaptive<TRACE::ENABLED>>() );
+    } else {
+      run( type_tag<order_book_adaptive<TRACE::DISABLED>>() );
+    }
+  } else if (isa == "matrix" || is_basic_book(isa)) {
+    if (!batch_dir.empty() || !venues.empty() || enable_features || enable_trades || enable_trace) {
+      fprintf(stderr, "Error: --isa %s replays one file, without --batch, --venue, --features, --trades or --trace\n",
+              isa.c_str());
+      return 1;
     }
+    timeMatrix( filename, opts, from_events, isa == "matrix" ? "" : isa );
   } else {
     fprintf(stderr, "Error: Unknown ISA '%s'\n", isa.c_str());
-    fprintf(stderr, "Valid options: scalar, soa, soa_price, avx2\n");
+    fprintf(stderr, "Valid options: scalar, soa, soa_price, avx2, btree, gap, adaptive,\n");
+    fprintf(stderr, "matrix, or a basic book <aos|soa>/<backward|forward|binary|simd>/<level|price>\n");
     return 1;
   }
 
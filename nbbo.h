@@ -0,0 +1,280 @@
+#pragma once
+#include <array>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include "feed.h"
+
+/* Consolidated best bid and offer across several ITCH 5.0 feeds (for
+ * instance NASDAQ, BX and PSX, which share the format).
+ *
+ * Each venue gets its own engine, and the message streams are merged
+ * by ITCH timestamp (see run), so books across venues
+ * evolve in the same order they did on the wire. Stock locates are
+ * assigned per venue, so symbols are consolidated by ticker as each
+ * venue's stock directory is read.
+ *
+ * After every book message the touched book's inside is read (O(1) in
+ * every implementation) and compared to the inside last seen for that
+ * venue. Only if it changed is the NBBO for the symbol recomputed, which
+ * is a scan over at most MAX_VENUES cached insides, at wire prices as
+ * the engines report them (see quote_t).
+ */
+
+static constexpr size_t MAX_VENUES = 8;
+
+struct inside_t {
+  quote_t bid;
+  quote_t ask;
+};
+
+inline bool same_quote(quote_t const &a, quote_t const &b)
+{
+  return a.price == b.price && a.qty == b.qty;
+}
+
+/* The consolidated inside of one symbol. Quantities are summed over the
+ * venues at the best price, which are also recorded as a bitmask. */
+struct nbbo_t {
+  quote_t bid;
+  quote_t ask;
+  uint8_t bid_venues = 0;
+  uint8_t ask_venues = 0;
+};
+
+template<typename T>
+class venue_feed
+{
+ public:
+  venue_feed(int fd) : m_buf(fd), m_engine(std::make_unique<engine<T>>())
+  {
+    // Oids are dense and every add or replace takes at least 37 bytes on
+    // the wire, so this bounds the oid map without a per-venue guess.
+    m_engine->oid_map.reserve(order_id_t(m_buf.limit / 37));
+    for (size_t i = 0; i < PREFETCH_MESSAGES; i++) prefetch_ahead();
+  }
+  buf_t m_buf;
+  std::unique_ptr<engine<T>> m_engine;
+  std::vector<uint32_t> m_symbol;  // per locate: consolidated symbol index
+  size_t m_npkts = 0;
+
+  bool done() const { return !m_buf.available(3); }
+  // timestamp of the next framed message
+  timestamp_t next_timestamp() const { return read_timestamp(m_buf.get(2 + 5)); }
+
+  /* How many of this venue's messages ahead of the one being processed
+   * the oid map is prefetched, as timeEvents does for event files: a
+   * slot prefetched just before its message would still be on its way
+   * when the engine needs it. */
+  static constexpr size_t PREFETCH_MESSAGES = 16;
+  uint64_t m_ahead = 0;  // offset of the first framed message not prefetched yet
+
+  // starts loading the order slot of the message at m_ahead, if it has one
+  void prefetch_ahead()
+  {
+    if (m_ahead + 2 + 19 > m_buf.limit) return;
+    char const *msg = m_buf.ptr + m_ahead + 2;
+    switch (itch_t(*msg)) {
+      case itch_t::ADD_ORDER:
+      case itch_t::ADD_ORDER_MPID:
+      case itch_t::EXECUTE_ORDER:
+      case itch_t::EXECUTE_ORDER_WITH_PRICE:
+      case itch_t::REDUCE_ORDER:
+      case itch_t::DELETE_ORDER:
+      case itch_t::REPLACE_ORDER:
+        m_engine->prefetch(order_id_t(read_oid(msg + 11)));
+        break;
+      default:
+        break;
+    }
+    m_ahead += 2 + read_two(m_buf.ptr + m_ahead);
+  }
+};
+
+template<typename T>
+class consolidated_feed
+{
+ public:
+  std::vector<symbol_t> m_tickers;  // per consolidated symbol
+  std::vector<nbbo_t> m_nbbo;
+  std::vector<std::array<inside_t, MAX_VENUES>> m_venue_inside;
+  size_t m_nbbo_updates = 0;
+
+  bool add_venue(std::string const &filename)
+  {
+    if (m_venues.size() == MAX_VENUES) {
+      fprintf(stderr, "At most %lu venues are supported\n", MAX_VENUES);
+      return false;
+    }
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Could not open file %s\n", filename.c_str());
+      return false;
+    }
+    m_venues.push_back(std::make_unique<venue_feed<T>>(fd));
+    return true;
+  }
+  size_t num_venues() const { return m_venues.size(); }
+  venue_feed<T> &venue(size_t v) { return *m_venues[v]; }
+
+  /* Replays all venues to the end. on_nbbo(symbol, nbbo) is called
+   * whenever a symbol's consolidated inside changes. Returns the total
+   * number of messages.
+   *
+   * Each venue's next message is keyed by (timestamp, venue), packed
+   * into one integer, and the smallest key goes next; ties go to the
+   * lower venue so the merge is deterministic. Busy venues' messages
+   * interleave about one by one, so the merge runs for almost every
+   * message, and a scan over at most MAX_VENUES keys does less than the
+   * sift of a heap. */
+  template<class F>
+  size_t run(F &&on_nbbo)
+  {
+    static_assert(MAX_VENUES <= 8, "the venue takes the low 3 bits of a key");
+    uint32_t const n = uint32_t(m_venues.size());
+    std::array<uint64_t, MAX_VENUES> key;
+    key.fill(DONE);
+    for (uint32_t v = 0; v < n; v++) {
+      key[v] = next_key(*m_venues[v], v);
+    }
+    size_t npkts = 0;
+    for (;;) {
+      uint32_t v = 0;
+      for (uint32_t i = 1; i < n; i++) {
+        v = key[i] < key[v] ? i : v;
+      }
+      if (DONE == key[v]) break;
+      uint64_t next = DONE;
+      for (uint32_t i = 0; i < n; i++) {
+        next = i != v && key[i] < next ? key[i] : next;
+      }
+      // Run the venue until it passes the next message of any other
+      // venue, so the keys are only scanned when the lead changes.
+      venue_feed<T> &f = *m_venues[v];
+      do {
+        step(f, v, on_nbbo);
+        ++npkts;
+        key[v] = next_key(f, v);
+      } while (key[v] < next);
+    }
+    return npkts;
+  }
+
+ private:
+  std::vector<std::unique_ptr<venue_feed<T>>> m_venues;
+  std::unordered_map<symbol_t, uint32_t> m_symbol_index;
+
+  void map_symbol(venue_feed<T> &f, uint16_t const locate, symbol_t const ticker)
+  {
+    auto it = m_symbol_index.find(ticker);
+    uint32_t sym;
+    if (it == m_symbol_index.end()) {
+      sym = uint32_t(m_tickers.size());
+      m_symbol_index.emplace(ticker, sym);
+      m_tickers.push_back(ticker);
+      m_nbbo.emplace_back();
+      m_venue_inside.emplace_back();
+    } else {
+      sym = it->second;
+    }
+    if (locate >= f.m_symbol.size()) {
+      f.m_symbol.resize(locate + 1, uint32_t(-1));
+    }
+    f.m_symbol[locate] = sym;
+  }
+
+  // the key of a venue with no messages left
+  static constexpr uint64_t DONE = std::numeric_limits<uint64_t>::max();
+
+  // timestamps take 48 bits, so the venue fits below them
+  static uint64_t next_key(venue_feed<T> const &f, uint32_t const v)
+  {
+    if (f.done()) return DONE;
+    return uint64_t(f.next_timestamp()) << 3 | v;
+  }
+
+  template<class F>
+  void step(venue_feed<T> &f, uint32_t const v, F &&on_nbbo)
+  {
+    char const *msg = f.m_buf.get(2);
+    itch_t const msgtype = itch_t(*msg);
+    uint16_t const locate = read_locate(msg + 1);
+    // Only the side the message touches can change. For messages that
+    // refer to a resting order, look the side up before the order goes
+    // away; the lookup brings in the line the engine is about to use.
+    bool book_msg = true;
+    bool bid = true;
+    switch (msgtype) {
+      case itch_t::ADD_ORDER:
+      case itch_t::ADD_ORDER_MPID:
+        bid = BUY_SELL(msg[19]) == BUY_SELL::BUY;
+        break;
+      case itch_t::EXECUTE_ORDER:
+      case itch_t::EXECUTE_ORDER_WITH_PRICE:
+      case itch_t::REDUCE_ORDER:
+      case itch_t::DELETE_ORDER:
+      case itch_t::REPLACE_ORDER:
+        bid = f.m_engine->order_is_bid(order_id_t(read_oid(msg + 11)));
+        break;
+      default:
+        book_msg = false;
+        break;
+    }
+    f.prefetch_ahead();
+    process_message(*f.m_engine, f.m_buf);
+    ++f.m_npkts;
+    if (book_msg) {
+      update_inside(f, v, locate, bid, on_nbbo);
+    } else if (itch_t::STOCK_DIRECTORY == msgtype) {
+      map_symbol(f, locate, read_symbol(msg + 11));
+    }
+  }
+
+  template<class F>
+  void update_inside(venue_feed<T> &f, uint32_t const v, uint16_t const locate,
+                     bool const bid, F &&on_nbbo)
+  {
+    if (locate >= f.m_symbol.size() || uint32_t(-1) == f.m_symbol[locate]) return;
+    uint32_t const sym = f.m_symbol[locate];
+    std::array<inside_t, MAX_VENUES> &insides = m_venue_inside[sym];
+    quote_t const inside = f.m_engine->best(locate, bid);
+    quote_t &cur = bid ? insides[v].bid : insides[v].ask;
+    if (same_quote(inside, cur)) {
+      // most messages are away from the inside
+      return;
+    }
+    cur = inside;
+
+    quote_t best;
+    uint8_t venues = 0;
+    for (uint32_t i = 0; i < m_venues.size(); i++) {
+      consolidate(&best, &venues, bid ? insides[i].bid : insides[i].ask, i, bid);
+    }
+    nbbo_t &nbbo = m_nbbo[sym];
+    quote_t &nbbo_side = bid ? nbbo.bid : nbbo.ask;
+    uint8_t &nbbo_venues = bid ? nbbo.bid_venues : nbbo.ask_venues;
+    if (same_quote(best, nbbo_side) && venues == nbbo_venues) {
+      return;
+    }
+    nbbo_side = best;
+    nbbo_venues = venues;
+    ++m_nbbo_updates;
+    on_nbbo(sym, nbbo);
+  }
+
+  static void consolidate(quote_t *best, uint8_t *venues, quote_t const &in, uint32_t const venue,
+                          bool const bid)
+  {
+    if (qty_t(0) == in.qty) return;
+    if (qty_t(0) == best->qty || (bid ? in.price > best->price : in.price < best->price)) {
+      *best = in;
+      *venues = uint8_t(1 << venue);
+    } else if (in.price == best->price) {
+      best->qty += in.qty;
+      *venues |= uint8_t(1 << venue);
+    }
+  }
+};
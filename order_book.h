@@ -1,13 +1,21 @@
 #pragma once
+#include <algorithm>
 #include <vector>
+#include <unordered_map>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <limits>
 #include "itch.h"
 #include "align.h"
+#include "trace_ring.h"
+#include "book_digest.h"
+#include "small_vector.h"
 #include <type_traits>
 #include <cassert>
+#include <memory>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /* This is an optimized order book implementation.
  * Conceptually an order book is two sets of levels, with each
@@ -52,16 +60,51 @@
  * far away from the inside of the book it could result in longer
  * processing for those messages.
  *
- * Lastly, since the orders and levels are stored in their own global
- * pools, they are likely to be local and there is very little pressure
- * on the allocator. In fact the only allocations are bulk allocations
- * from stl container resizing.
+ * Lastly, since the orders and levels are stored in their own pools
+ * (owned by the engine, shared by all of its books), they are likely
+ * to be local and there is very little pressure on the allocator. In
+ * fact the only allocations are bulk allocations from stl container
+ * resizing.
  */
 
-#define CROSS_CHECK 1
+/* With CROSS_CHECK every engine also drives a scalar reference engine
+ * and compares the touched side after every operation. That doubles the
+ * work being measured, so it is off unless built with -DCROSS_CHECK=1;
+ * --digest compares implementations at full speed (see book_digest.h). */
+#ifndef CROSS_CHECK
+#define CROSS_CHECK 0
+#endif
+
+/* The scalar, soa and soa_price books keep the first levels of each side
+ * inside the book (see small_vector.h); -DINLINE_LEVELS=0 gives them
+ * plain std::vectors again, to compare. */
+#ifndef INLINE_LEVELS
+#define INLINE_LEVELS 1
+#endif
+#if INLINE_LEVELS
+template<class T, size_t BYTES>
+using level_array = small_vector<T, BYTES>;
+#else
+template<class T, size_t BYTES>
+using level_array = std::vector<T>;
+#endif
+
+/* With -DPACK_BOOKS=1 the engine keeps its books packed by activity
+ * instead of indexed by locate (see engine::slot). Where a day's books
+ * fit in the L2 cache anyway, as on the 2 MB L2 this was measured on,
+ * the extra load per operation costs more than the packing saves, so it
+ * is off unless built with it. */
+#ifndef PACK_BOOKS
+#define PACK_BOOKS 0
+#endif
 
 using sprice_t = int32_t;
 bool constexpr is_bid(sprice_t const x) { return int32_t(x) >= 0; }
+/* The largest price a book keeps, one below the INT32_MAX that the avx2
+ * and btree books use as a sentinel. Books are given prices relative to
+ * a base of their own (see engine::book_price); with a base of 0 this is
+ * every wire price below 2^31 - 1, ITCH's $199,999.99 cap included. */
+static constexpr sprice_t MAX_BOOK_PRICE = std::numeric_limits<sprice_t>::max() - 1;
 // Helper to extract an integral underlying type for ptr_t while avoiding
 // hard errors when ptr_t is not an enum. If ptr_t is an enum, use
 // std::underlying_type<ptr_t>::type. Otherwise use ptr_t directly.
@@ -117,6 +160,13 @@ class pool
     }
   }
   void free(__ptr idx) { m_free.push_back(idx); }
+  size_t in_use() const { return m_allocated.size() - m_free.size(); }
+  // frees everything at once, keeping the capacity of both vectors
+  void clear()
+  {
+    m_allocated.clear();
+    m_free.clear();
+  }
 #undef ALLOC_INVARIANT
 };
 class level
@@ -128,6 +178,13 @@ class level
   level() {}
 };
 
+// a level at its wire price, as the engine reports it to the rest of
+// the program; an empty side has quantity 0
+struct quote_t {
+  price_t price = 0;
+  qty_t qty = qty_t(0);
+};
+
 using book_id_t = uint16_t;
 using level_id_t = uint32_t;
 using order_id_t = uint32_t;
@@ -148,7 +205,7 @@ typedef struct order_level {
 #if CROSS_CHECK
   order_id_t oid;
 #endif
-  void initialize(order_id_t __oid, book_id_t __book_idx, sprice_t __price, qty_t __qty) {
+  void initialize([[maybe_unused]] order_id_t __oid, book_id_t __book_idx, sprice_t __price, qty_t __qty) {
 #if CROSS_CHECK
     oid = __oid;
 #endif
@@ -164,7 +221,7 @@ typedef struct order_price {
 #if CROSS_CHECK
   order_id_t oid;
 #endif
-  void initialize(order_id_t __oid, book_id_t __book_idx, sprice_t __price, qty_t __qty) {
+  void initialize([[maybe_unused]] order_id_t __oid, book_id_t __book_idx, sprice_t __price, qty_t __qty) {
 #if CROSS_CHECK
     oid = __oid;
 #endif
@@ -208,6 +265,23 @@ class oidmap
     size_t const idx = size_t(oid);
     return &m_data[idx];
   }
+  /* Forgets every order, keeping the size. add_order writes a slot
+   * before anything reads it, so nothing has to be cleared; the pages
+   * are only marked MADV_FREE, which the kernel reclaims if memory gets
+   * short and otherwise leaves in place for the next day to write
+   * without faulting. Kernels without MADV_FREE get MADV_DONTNEED,
+   * which drops the pages at once. */
+  void reset()
+  {
+    uintptr_t const page = uintptr_t(sysconf(_SC_PAGESIZE));
+    uintptr_t const begin = (uintptr_t(m_data.data()) + page - 1) & ~(page - 1);
+    uintptr_t const end = uintptr_t(m_data.data() + m_data.size()) & ~(page - 1);
+    if (end <= begin) return;
+#ifdef MADV_FREE
+    if (0 == madvise((void *)begin, end - begin, MADV_FREE)) return;
+#endif
+    madvise((void *)begin, end - begin, MADV_DONTNEED);
+  }
 };
 
 struct order_id_hash {
@@ -216,72 +290,674 @@ struct order_id_hash {
 
 enum class LAYOUT { ARRAY_OF_STRUCTS, STRUCT_OF_ARRAYS };
 enum class TRACE { DISABLED, ENABLED };
+/* Which replaces engine::replace_order hands to the book's REPLACE_ORDER:
+ * all of them, only those that keep the price, or none. The others it
+ * applies as a DELETE_ORDER and an ADD_ORDER into the new order's slot.
+ * Books whose hook measured slower than that on moves opt out; a
+ * DELETE_ADD book has no REPLACE_ORDER at all. */
+enum class REPLACE_PATH { IN_BOOK, SAME_PRICE_IN_BOOK, DELETE_ADD };
 
-template<typename Derived, typename order_t, TRACE trace = TRACE::DISABLED>
+/* Common base of the book implementations. Each implementation is one
+ * book (both sides of one symbol); the state that all books of an
+ * implementation share, such as a level pool, is declared as `shared_t`
+ * and owned by the engine, which passes it into every operation.
+ */
+template<typename Derived, typename __order_t, TRACE __trace = TRACE::DISABLED>
 class order_book
 {
  public:
+  using order_t = __order_t;
+  static constexpr TRACE trace = __trace;
   static constexpr size_t MAX_BOOKS = 1 << 14;
   static constexpr size_t NUM_LEVELS = 1 << 20;
-  static inline Derived s_books[MAX_BOOKS];  // can we allocate this on the stack?
-  static inline oidmap<order_t> oid_map;
+  static constexpr bool IS_REFERENCE = false;
+  static constexpr REPLACE_PATH replace_path = REPLACE_PATH::IN_BOOK;
+  struct shared_t {
+    void clear() {}
+    size_t in_use() const { return 0; }  // no pool
+  };
+};
+
+/* Where a replace lands in an ascending array of n prices, read with
+ * price(i). Both prices are found in one walk down from the inside,
+ * where replaces are, so the book can then apply the replace without
+ * searching again. */
+struct replace_pos {
+  size_t from;  // index of the order's current price
+  size_t to;    // index of the new price, or if there is no level at it
+                // the number of prices below it
+  bool exists;  // whether there is a level at the new price
+};
+template<class F>
+replace_pos find_replace(F &&price, size_t const n, sprice_t const from, sprice_t const to)
+{
+  replace_pos r{0, 0, false};
+  bool found = false;
+  bool bounded = false;
+  for (size_t i = n; i-- > 0;) {
+    sprice_t const p = price(i);
+    if (p == from) {
+      r.from = i;
+      found = true;
+    }
+    if (!bounded && p <= to) {
+      r.exists = p == to;
+      r.to = r.exists ? i : i + 1;
+      bounded = true;
+    }
+    if (found && bounded) break;
+  }
+  assert(found);
+  return r;
+}
+
+/* When the order was alone at its level and there is no level at the new
+ * price, the level itself moves: it is repriced and the levels in
+ * between slide over by one, instead of an erase and an insert (two
+ * memmoves of everything above the two prices). For the common move to
+ * a neighbouring price nothing slides at all. Returns the level's new
+ * index. */
+inline size_t move_index(replace_pos const &r)
+{
+  return r.from < r.to ? r.to - 1 : r.to;
+}
+
+// Moves the element at from_idx to to_idx, sliding the ones in between
+// over by one (see move_index).
+template<class It>
+void slide(It const first, size_t const from_idx, size_t const to_idx)
+{
+  if (from_idx < to_idx) {
+    std::rotate(first + from_idx, first + from_idx + 1, first + to_idx + 1);
+  } else if (to_idx < from_idx) {
+    std::rotate(first + to_idx, first + from_idx, first + from_idx + 1);
+  }
+}
+
+#include "order_book_scalar.h"
+#include "order_book_soa.h"
+#include "order_book_soa_price.h"
+#include "order_book_soa_avx2.h"
+#include "order_book_btree.h"
+#include "order_book_gap.h"
+#include "order_book_adaptive.h"
+#include "order_book_basic.h"
+
+/* The 64-bit path: the levels of one book whose prices fall outside its
+ * 32-bit range (see engine::book_price), kept by the engine next to the
+ * book. Each side is sorted as a scalar book's, best last, by a signed
+ * 64-bit key, the wire price for a bid and its negation for an ask, so
+ * any two wire prices compare. It is a plain vector search: only books
+ * whose prices span more than a sprice_t holds ever get here. */
+class wide_book
+{
+ public:
+  using key_t = int64_t;
+  using level_t = std::pair<key_t, qty_t>;
+  std::vector<level_t> m_sides[2];  // bid, ask
+
+  static key_t key(price_t const price, bool const bid)
+  {
+    return bid ? key_t(price) : -key_t(price);
+  }
+  static price_t wire_price(key_t const key) { return price_t(key < 0 ? -key : key); }
+
+  void add(price_t const price, bool const bid, qty_t const qty)
+  {
+    std::vector<level_t> &side = m_sides[bid ? 0 : 1];
+    auto const it = find(side, key(price, bid));
+    if (it != side.end() && it->first == key(price, bid)) {
+      it->second += qty;
+    } else {
+      side.insert(it, level_t(key(price, bid), qty));
+    }
+  }
+  // takes qty off the level, and the level away with the last order in it
+  void remove(price_t const price, bool const bid, qty_t const qty, bool const last)
+  {
+    std::vector<level_t> &side = m_sides[bid ? 0 : 1];
+    auto const it = find(side, key(price, bid));
+    assert(it != side.end() && it->first == key(price, bid) && it->second >= qty);
+    it->second -= qty;
+    if (last && qty_t(0) == it->second) side.erase(it);
+  }
+  bool empty() const { return m_sides[0].empty() && m_sides[1].empty(); }
+
+ private:
+  static std::vector<level_t>::iterator find(std::vector<level_t> &side, key_t const k)
+  {
+    return std::lower_bound(side.begin(), side.end(), k,
+                            [](level_t const &l, key_t const x) { return l.first < x; });
+  }
+};
+
+/* All the state for one feed: the books, the order metadata and whatever
+ * the implementation shares between books. Engines are independent of
+ * each other, so several can run in one process (one per thread, feed or
+ * day). The books are an array member rather than a pointer, so an
+ * engine is large and should live on the heap, but reaching a book is
+ * just an offset from the engine and costs no more than the old static
+ * array did.
+ *
+ * With PACK_BOOKS the books are not indexed by locate. A day's locates
+ * run into the thousands with most of the activity in a few hundred of
+ * them, spread over the whole range, so a locate-indexed array puts
+ * every busy book on its own cache lines and pages, between idle ones.
+ * Instead each book gets a slot the first time it gets an order, slots
+ * are handed out in that order from 1, and m_slot maps a locate to its
+ * slot. Slot 0 is an empty book that stands for every locate without a
+ * slot yet. So the books in use sit together at the front, and so does
+ * the rest of their state (m_state), for one more load per operation
+ * from m_slot, a 32 KB table. repack() goes further and sorts the slots
+ * by the adds each book has had, busiest first, for when the opening is
+ * a good guide to the rest of the day. Without PACK_BOOKS a slot is the
+ * locate and repack() does nothing.
+ *
+ * The engine takes and reports wire prices; what a book keeps is a
+ * sprice_t relative to the book's base (see book_price). The few orders
+ * whose prices do not fit there go to a wide_book instead, and their
+ * slots in the oid map are marked with WIDE in book_idx, so an operation
+ * on one is told apart by a bit of a field it loads anyway.
+ *
+ * With CROSS_CHECK each engine also drives a scalar reference engine of
+ * its own and compares the touched side after every operation. With a
+ * book_digest attached it marks the book each operation touched.
+ */
+template<class Impl>
+class engine
+{
+ public:
+  using order_t = typename Impl::order_t;
+  using shared_t = typename Impl::shared_t;
+  static constexpr TRACE trace = Impl::trace;
+  static constexpr size_t MAX_BOOKS = Impl::MAX_BOOKS;
+  // slot 0 is the empty book of every locate without a slot
+  static constexpr size_t SLOTS = PACK_BOOKS ? MAX_BOOKS + 1 : MAX_BOOKS;
+  // in the book_idx of an order on the 64-bit path (see wide_book)
+  static constexpr book_id_t WIDE = book_id_t(1) << 15;
+  static_assert(MAX_BOOKS <= WIDE, "locates leave the WIDE bit free");
+
+  Impl m_books[SLOTS];  // by slot
+  oidmap<order_t> oid_map;
+  shared_t m_shared;
+  size_t m_live_orders = 0;  // resting orders over all books
+  // the rest of a book's state, by slot. The adds are counted where an
+  // add reads the base anyway, rather than on a line of their own
+  struct book_state_t {
+    price_t base = 0;   // what its prices are relative to (see book_price)
+    uint32_t adds = 0;  // what repack sorts by
+    uint32_t wide = 0;  // orders on the 64-bit path
+  };
+  book_state_t m_state[SLOTS];
+#if PACK_BOOKS
+  uint16_t m_slot[MAX_BOOKS] = {};  // by locate, 0 for none yet
+  uint16_t m_locate[SLOTS] = {};    // by slot
+  size_t m_slots = 1;               // handed out so far, with slot 0
+#endif
+  // the 64-bit path: levels by locate, and each order's price and side
+  struct wide_order_t {
+    price_t price;
+    bool bid;
+  };
+  std::unordered_map<book_id_t, wide_book> m_wide;
+  std::unordered_map<order_id_t, wide_order_t, order_id_hash> m_wide_orders;
+  size_t m_wide_adds = 0;  // orders that went there
+  // where a TRACE::ENABLED engine records its operations, if anywhere
+  trace_ring::writer *m_trace = nullptr;
+  // told which books each operation touches, if anyone is digesting them
+  book_digest *m_digest = nullptr;
+
+#if CROSS_CHECK
+  using reference_t = engine<order_book_scalar<TRACE::DISABLED>>;
+  static constexpr bool HAS_REFERENCE = !Impl::IS_REFERENCE;
+  std::unique_ptr<reference_t> m_reference;
+  engine()
+  {
+    if constexpr (HAS_REFERENCE) {
+      m_reference = std::make_unique<reference_t>();
+    }
+  }
+#else
+  engine() {}
+#endif
+  engine(engine const &) = delete;
+  engine &operator=(engine const &) = delete;
+
+  // where book_idx's book is in m_books
+  size_t slot(book_id_t const book_idx) const
+  {
+#if PACK_BOOKS
+    return m_slot[size_t(book_idx)];
+#else
+    return size_t(book_idx);
+#endif
+  }
+  Impl &book(book_id_t const book_idx) { return m_books[slot(book_idx)]; }
+  Impl const &book(book_id_t const book_idx) const { return m_books[slot(book_idx)]; }
+
+  /* Sorts the slots by the adds their books have had so far, busiest
+   * first, moving the books with Impl::swap, which exchanges what two
+   * books hold and leaves anything they have in the shared pool where it
+   * is. Orders keep their locates, so nothing else changes. */
+  void repack()
+  {
+#if PACK_BOOKS
+    std::vector<uint16_t> order(m_slots - 1);  // old slots, busiest first
+    for (size_t i = 0; i < order.size(); i++) order[i] = uint16_t(i + 1);
+    std::stable_sort(order.begin(), order.end(),
+                     [this](uint16_t const a, uint16_t const b) { return m_state[a].adds > m_state[b].adds; });
+    // where the book of each old slot is now, and whose book each slot holds
+    std::vector<uint16_t> where(m_slots), whose(m_slots);
+    for (size_t s = 0; s < m_slots; s++) where[s] = whose[s] = uint16_t(s);
+    for (size_t s = 1; s < m_slots; s++) {
+      size_t const from = where[order[s - 1]];
+      if (from == s) continue;
+      m_books[s].swap(m_books[from]);
+      std::swap(m_state[s], m_state[from]);
+      std::swap(m_locate[s], m_locate[from]);
+      std::swap(whose[s], whose[from]);
+      where[whose[s]] = uint16_t(s);
+      where[whose[from]] = uint16_t(from);
+    }
+    for (size_t s = 1; s < m_slots; s++) m_slot[m_locate[s]] = uint16_t(s);
+#endif
+  }
+
+  /* Empties the engine for another day without giving back memory:
+   * books and pools are cleared in place and keep their capacity, and
+   * the oid map keeps its size (see oidmap::reset). Impl::clear only
+   * empties the book itself; what it had in the shared pool goes when
+   * the pool is cleared, all at once. */
+  void reset()
+  {
+    for (size_t i = 0; i < SLOTS; i++) {
+      m_books[i].clear(m_shared);
+    }
+    m_shared.clear();
+    m_live_orders = 0;
+    std::fill(m_state, m_state + SLOTS, book_state_t());
+#if PACK_BOOKS
+    std::fill(m_slot, m_slot + MAX_BOOKS, uint16_t(0));
+    m_slots = 1;
+#endif
+    m_wide.clear();
+    m_wide_orders.clear();
+    m_wide_adds = 0;
+    oid_map.reset();
+#if CROSS_CHECK
+    if constexpr (HAS_REFERENCE) {
+      m_reference->reset();
+    }
+#endif
+  }
+
+  /* Books keep a price as a sprice_t relative to the book's base,
+   *   price - base for a bid and base - price for an ask,
+   * between 1 and MAX_BOOK_PRICE, so that the books' 8-wide 32-bit
+   * searches work for any wire price. The base is 0 for a book first
+   * quoted below 2^31 - 1, where the sprice is the wire price as it
+   * always was, and that is every price ITCH allows. A book first quoted
+   * above that gets a base which puts that price in the middle of its
+   * range. The base only changes while the book is empty; a price that
+   * does not fit the range of a book with orders in it goes, with its
+   * order, to the book's wide_book (see add_wide), where it stays until
+   * it is deleted. Whether a price fits depends only on the price, so
+   * each level is in one place or the other, never split. */
+  sprice_t book_price(book_id_t const book_idx, price_t const price, bool const bid) const
+  {
+    assert(in_range(book_idx, price));
+    price_t const rel = price - m_state[slot(book_idx)].base;
+    return bid ? sprice_t(rel) : -sprice_t(rel);
+  }
+  bool in_range(book_id_t const book_idx, price_t const price) const
+  {
+    return price - m_state[slot(book_idx)].base - 1 < price_t(MAX_BOOK_PRICE);
+  }
+  // the wire price of a price from one of book_idx's levels or orders
+  price_t wire_price(book_id_t const book_idx, sprice_t const price) const
+  {
+    return m_state[slot(book_idx)].base + price_t(price < 0 ? -price : price);
+  }
+
+  // the inside of one side of a book, or an empty quote
+  quote_t best(book_id_t const book_idx, bool const bid)
+  {
+    size_t const s = slot(book_idx);
+    if (__builtin_expect(0 != m_state[s].wide, 0)) {
+      quote_t q;
+      top(book_idx, bid, 1, &q.price, &q.qty);
+      return q;
+    }
+    level const l = m_books[s].best(m_shared, bid);
+    if (qty_t(0) == l.m_qty) return quote_t();
+    return quote_t{wire_price(book_idx, l.m_price), l.m_qty};
+  }
+
+  bool order_is_bid(order_id_t const oid)
+  {
+    order_t *order = oid_map.get(oid);
+    if (__builtin_expect(order->book_idx & WIDE, 0)) return m_wide_orders[oid].bid;
+    return book(order->book_idx).check_order_bid(m_shared, order);
+  }
+
+  // the wire price of a resting order
+  price_t order_price(order_id_t const oid)
+  {
+    order_t *order = oid_map.get(oid);
+    if (__builtin_expect(order->book_idx & WIDE, 0)) return m_wide_orders[oid].price;
+    return wire_price(order->book_idx, book(order->book_idx).order_price(m_shared, order));
+  }
 
-  static void add_order(order_id_t const oid, book_id_t const book_idx,
-                        sprice_t const price, qty_t const qty)
+  /* Starts loading an order's slot ahead of an operation on it, for a
+   * caller that knows the oids to come (see timeEvents and
+   * venue_feed::prefetch_ahead). A prefetch never faults, so the order
+   * need not exist yet. */
+  void prefetch(order_id_t const oid) const
+  {
+    __builtin_prefetch(oid_map.m_data.data() + size_t(oid), 1);
+  }
+
+  // the remaining quantity of a resting order
+  qty_t order_qty(order_id_t const oid) { return oid_map.get(oid)->m_qty; }
+
+  /* As Impl::top, at wire prices: copies the n = min(k, depth) best
+   * levels of one side into prices/qtys[k-n, k), best last, and returns
+   * n. The book's own prices are read into the same array and turned
+   * into wire prices there. */
+  size_t top(book_id_t const book_idx, bool const bid, size_t const k,
+             price_t *prices, qty_t *qtys)
+  {
+    size_t const s = slot(book_idx);
+    size_t const n = m_books[s].top(m_shared, bid, k, reinterpret_cast<sprice_t *>(prices), qtys);
+    for (size_t i = k - n; i < k; i++) {
+      prices[i] = wire_price(book_idx, sprice_t(prices[i]));
+    }
+    if (__builtin_expect(0 != m_state[s].wide, 0)) {
+      return merge_wide(book_idx, bid, k, n, prices, qtys);
+    }
+    return n;
+  }
+
+  void add_order(order_id_t const oid, book_id_t const book_idx,
+                 price_t const price, bool const bid, qty_t const qty)
+  {
+    if (__builtin_expect(!in_range(book_idx, price), 0) && !rebase(book_idx, price)) {
+      add_wide(oid, book_idx, price, bid, qty);
+      return;
+    }
+    add_order(oid, book_idx, book_price(book_idx, price, bid), qty);
+  }
+  // with the price as the book keeps it (see book_price)
+  void add_order(order_id_t const oid, book_id_t const book_idx,
+                 sprice_t const price, qty_t const qty)
   {
     if constexpr ( trace == TRACE::ENABLED ) {
-      printf("ADD %u, %u, %d, %u\n", oid, book_idx, price, qty);
+      if ( m_trace ) m_trace->record( trace_ring::OP::ADD, oid, 0, book_idx, price, qty );
     }
     oid_map.reserve(oid);
     order_t *order = oid_map.get(oid);
     order->initialize( oid, book_idx, price, qty );
-    static_cast<Derived *>(&s_books[size_t(order->book_idx)])->ADD_ORDER(order, price, qty);
+    size_t const s = take_slot(book_idx);
+#if PACK_BOOKS
+    ++m_state[s].adds;
+#endif
+    m_books[s].ADD_ORDER(m_shared, order, price, qty);
+    ++m_live_orders;
+    if ( m_digest ) m_digest->touch( book_idx );
+#if CROSS_CHECK
+    if constexpr (HAS_REFERENCE) {
+      m_reference->add_order(oid, book_idx, price, qty);
+      crosscheck(oid, book_idx, is_bid(price));
+    }
+#endif
   }
-  static void delete_order(order_id_t const oid)
+  void delete_order(order_id_t const oid)
   {
     if constexpr ( trace == TRACE::ENABLED ) {
-      printf("DELETE %u\n", oid);
+      if ( m_trace ) m_trace->record( trace_ring::OP::DELETE, oid, 0, 0, 0, 0 );
     }
     order_t *order = oid_map.get(oid);
-    static_cast<Derived *>(&s_books[size_t(order->book_idx)])->DELETE_ORDER(order);
+    if (__builtin_expect(order->book_idx & WIDE, 0)) {
+      remove_wide(oid, order, order->m_qty, true);
+      return;
+    }
+    Impl &book = this->book(order->book_idx);
+#if CROSS_CHECK
+    bool const bid = book.check_order_bid( m_shared, order );
+#endif
+    book.DELETE_ORDER(m_shared, order);
+    --m_live_orders;
+    if ( m_digest ) m_digest->touch( order->book_idx );
+#if CROSS_CHECK
+    if constexpr (HAS_REFERENCE) {
+      m_reference->delete_order(oid);
+      crosscheck(oid, order->book_idx, bid);
+    }
+#endif
   }
-  static void cancel_order(order_id_t const oid, qty_t const qty)
+  void cancel_order(order_id_t const oid, qty_t const qty)
   {
     if constexpr ( trace == TRACE::ENABLED ) {
-      printf("REDUCE %u, %u\n", oid, qty);
+      if ( m_trace ) m_trace->record( trace_ring::OP::REDUCE, oid, 0, 0, 0, qty );
     }
     order_t *order = oid_map.get(oid);
-    static_cast<Derived *>(&s_books[size_t(order->book_idx)])->REDUCE_ORDER(order, qty);
+    if (__builtin_expect(order->book_idx & WIDE, 0)) {
+      remove_wide(oid, order, qty, false);
+      return;
+    }
+    Impl &book = this->book(order->book_idx);
+    book.REDUCE_ORDER(m_shared, order, qty);
+    if ( m_digest ) m_digest->touch( order->book_idx );
+#if CROSS_CHECK
+    if constexpr (HAS_REFERENCE) {
+      m_reference->cancel_order(oid, qty);
+      crosscheck(oid, order->book_idx, book.check_order_bid( m_shared, order ));
+    }
+#endif
   }
-  static void execute_order(order_id_t const oid, qty_t const qty)
+  // returns the (wire) price of the executed resting order
+  price_t execute_order(order_id_t const oid, qty_t const qty)
   {
     if constexpr ( trace == TRACE::ENABLED ) {
-      printf("EXECUTE %lu %u\n", uint64_t(oid), qty);
+      if ( m_trace ) m_trace->record( trace_ring::OP::EXECUTE, oid, 0, 0, 0, qty );
     }
     order_t *order = oid_map.get(oid);
-    auto book = static_cast<Derived *>(&s_books[size_t(order->book_idx)]);
+    if (__builtin_expect(order->book_idx & WIDE, 0)) {
+      return remove_wide(oid, order, qty, qty == order->m_qty);
+    }
+    Impl &book = this->book(order->book_idx);
+    sprice_t const price = book.order_price( m_shared, order );
+#if CROSS_CHECK
+    bool const bid = book.check_order_bid( m_shared, order );
+#endif
 
     if (qty == order->m_qty) {
-      book->DELETE_ORDER(order);
+      book.DELETE_ORDER(m_shared, order);
+      --m_live_orders;
     } else {
-      book->REDUCE_ORDER(order, qty);
+      book.REDUCE_ORDER(m_shared, order, qty);
     }
+    if ( m_digest ) m_digest->touch( order->book_idx );
+#if CROSS_CHECK
+    if constexpr (HAS_REFERENCE) {
+      m_reference->execute_order(oid, qty);
+      crosscheck(oid, order->book_idx, bid);
+    }
+#endif
+    return wire_price(order->book_idx, price);
   }
-  static void replace_order(order_id_t const old_oid, order_id_t const new_oid,
-                              qty_t const new_qty, sprice_t new_price)
+  // new_price is unsigned, the order stays on its side
+  void replace_order(order_id_t const old_oid, order_id_t const new_oid,
+                     qty_t const new_qty, price_t const new_price)
   {
+    book_id_t const book_idx = oid_map.get(old_oid)->book_idx;
+    if (__builtin_expect((book_idx & WIDE) || !in_range(book_idx, new_price), 0)) {
+      // to or from the 64-bit path, as a delete and an add, which also
+      // lets the add rebase the book if the order was the last in it
+      bool const bid = order_is_bid(old_oid);
+      delete_order(old_oid);
+      add_order(new_oid, book_id_t(book_idx & ~WIDE), new_price, bid, new_qty);
+      return;
+    }
     if constexpr ( trace == TRACE::ENABLED ) {
-      printf("REPLACE %lu %lu %d %u\n", uint64_t(old_oid), uint64_t(new_oid), int32_t(new_price), uint32_t(new_qty));
+      if ( m_trace ) {
+        m_trace->record( trace_ring::OP::REPLACE, old_oid, new_oid, 0, int32_t(new_price), new_qty );
+      }
     }
+    // The book updates the order in place, and then it moves to its new
+    // slot with its book and level; or, for the replaces the book leaves
+    // to the engine (see REPLACE_PATH), it is deleted and added anew.
+    oid_map.reserve(new_oid);
     order_t *order = oid_map.get(old_oid);
-    auto book = static_cast<Derived *>(&s_books[size_t(order->book_idx)]);
-    bool const bid = book->check_order_bid( order );
-    book->DELETE_ORDER(order);
-    book->add_order(new_oid, order->book_idx, (bid) ? new_price : -new_price, new_qty);
+    Impl &book = this->book(order->book_idx);
+    bool const bid = book.check_order_bid( m_shared, order );
+    sprice_t const price = book_price(order->book_idx, new_price, bid);
+    bool in_book = false;
+    if constexpr (Impl::replace_path != REPLACE_PATH::DELETE_ADD) {
+      in_book = Impl::replace_path == REPLACE_PATH::IN_BOOK ||
+                book.order_price( m_shared, order ) == price;
+      if (in_book) {
+        book.REPLACE_ORDER(m_shared, order, price, new_qty);
+        *oid_map.get(new_oid) = *order;
+        order = oid_map.get(new_oid);
+      }
+    }
+    if (!in_book) {
+      book.DELETE_ORDER(m_shared, order);
+      order = oid_map.get(new_oid);
+      order->initialize( new_oid, book_idx, price, new_qty );
+      book.ADD_ORDER(m_shared, order, price, new_qty);
+    }
+    if ( m_digest ) m_digest->touch( order->book_idx );
+#if CROSS_CHECK
+    order->oid = new_oid;
+    if constexpr (HAS_REFERENCE) {
+      // the reference takes the plain delete and add
+      m_reference->delete_order(old_oid);
+      m_reference->add_order(new_oid, order->book_idx, price, new_qty);
+      crosscheck(new_oid, order->book_idx, bid);
+    }
+#endif
   }
-};
 
-#include "order_book_scalar.h"
-#include "order_book_soa.h"
-#include "order_book_soa_price.h"
-#include "order_book_soa_avx2.h"
+ private:
+  // book_idx's slot, the next one if it has none yet
+  size_t take_slot(book_id_t const book_idx)
+  {
+#if PACK_BOOKS
+    uint16_t &s = m_slot[size_t(book_idx)];
+    if (__builtin_expect(0 == s, 0)) {
+      s = uint16_t(m_slots);
+      m_locate[m_slots++] = uint16_t(book_idx);
+    }
+    return s;
+#else
+    return size_t(book_idx);
+#endif
+  }
+
+  // an add outside book_idx's range: a new base if the book is empty;
+  // returns whether the price fits now
+  __attribute__((__noinline__)) bool rebase(book_id_t const book_idx, price_t const price)
+  {
+    sprice_t p;
+    qty_t q;
+    size_t const s = slot(book_idx);
+    if (0 != m_state[s].wide || 0 != m_books[s].top(m_shared, true, 1, &p, &q) ||
+        0 != m_books[s].top(m_shared, false, 1, &p, &q)) {
+      return false;
+    }
+    // 0 wherever that fits, so the book keeps the wire price; past that
+    // the price goes in the middle of the range, as far as the range
+    // stays inside the wire format
+    price_t const half = price_t(MAX_BOOK_PRICE) / 2;
+    price_t const last = std::numeric_limits<price_t>::max() - price_t(MAX_BOOK_PRICE);
+    m_state[take_slot(book_idx)].base =
+        price <= price_t(MAX_BOOK_PRICE) ? 0 : std::min(price_t(price - half), last);
+    return in_range(book_idx, price);
+  }
+
+  /* An add that does not fit the range of a book with orders in it: the
+   * order goes to the book's wide_book. Its slot keeps the locate, marked
+   * WIDE, and the quantity; the price and side go in m_wide_orders. The
+   * reference engine of a CROSS_CHECK build never sees these orders, as
+   * the path is the engine's and not the book's. */
+  __attribute__((__noinline__)) void add_wide(order_id_t const oid, book_id_t const book_idx,
+                                              price_t const price, bool const bid, qty_t const qty)
+  {
+    if constexpr ( trace == TRACE::ENABLED ) {
+      if ( m_trace ) m_trace->record( trace_ring::OP::ADD, oid, 0, book_idx, int32_t(price), qty );
+    }
+    oid_map.reserve(oid);
+    order_t *order = oid_map.get(oid);
+    order->initialize( oid, book_id_t(book_idx | WIDE), 0, qty );
+    m_wide_orders[oid] = wide_order_t{price, bid};
+    m_wide[book_idx].add(price, bid, qty);
+    size_t const s = take_slot(book_idx);
+#if PACK_BOOKS
+    ++m_state[s].adds;
+#endif
+    ++m_state[s].wide;
+    ++m_live_orders;
+    ++m_wide_adds;
+    if ( m_digest ) m_digest->touch( book_idx );
+  }
+  // takes qty off an order on the 64-bit path, and with last the order
+  // itself; returns its wire price
+  __attribute__((__noinline__)) price_t remove_wide(order_id_t const oid, order_t *order,
+                                                    qty_t const qty, bool const last)
+  {
+    book_id_t const book_idx = book_id_t(order->book_idx & ~WIDE);
+    auto const it = m_wide_orders.find(oid);
+    wide_order_t const o = it->second;
+    m_wide[book_idx].remove(o.price, o.bid, qty, last);
+    order->m_qty -= qty;
+    if (last) {
+      m_wide_orders.erase(it);
+      if (0 == --m_state[slot(book_idx)].wide) m_wide.erase(book_idx);
+      --m_live_orders;
+    }
+    if ( m_digest ) m_digest->touch( book_idx );
+    return o.price;
+  }
+  /* The rest of top() for a book with orders on the 64-bit path: merges
+   * the n best levels of the book itself, now in prices/qtys[k-n, k) at
+   * wire prices, with its wide_book's side, best last. The book's levels
+   * are all inside its range and the wide_book's all outside, so this is
+   * a merge of two sorted runs from their best ends. */
+  __attribute__((__noinline__)) size_t merge_wide(book_id_t const book_idx, bool const bid,
+                                                  size_t const k, size_t const n,
+                                                  price_t *prices, qty_t *qtys)
+  {
+    std::vector<wide_book::level_t> const &side = m_wide[book_idx].m_sides[bid ? 0 : 1];
+    std::vector<price_t> merged_prices(k);
+    std::vector<qty_t> merged_qtys(k);
+    size_t i = k, j = side.size(), out = k;
+    while (out > 0 && (i > k - n || j > 0)) {
+      --out;
+      if (0 == j || (i > k - n && wide_book::key(prices[i - 1], bid) > side[j - 1].first)) {
+        --i;
+        merged_prices[out] = prices[i];
+        merged_qtys[out] = qtys[i];
+      } else {
+        --j;
+        merged_prices[out] = wide_book::wire_price(side[j].first);
+        merged_qtys[out] = side[j].second;
+      }
+    }
+    std::copy(merged_prices.begin() + out, merged_prices.end(), prices + out);
+    std::copy(merged_qtys.begin() + out, merged_qtys.end(), qtys + out);
+    return k - out;
+  }
+
+#if CROSS_CHECK
+  void crosscheck(order_id_t const oid, book_id_t const book_idx, bool const is_bid)
+  {
+    book(book_idx).crosscheck(m_shared, m_reference->book(book_idx), m_reference->m_shared, oid,
+                              is_bid);
+    level const ours = book(book_idx).best(m_shared, is_bid);
+    level const ref = m_reference->book(book_idx).best(m_reference->m_shared, is_bid);
+    assert(ours.m_price == ref.m_price && ours.m_qty == ref.m_qty);
+  }
+#endif
+};
@@ -0,0 +1,235 @@
+/*
+ *
+ * order_book_adaptive.h
+ *
+ * Limit order book that picks its layout per book, by depth.
+ *
+ * Copyright (c) 2025, Archaea Software, LLC.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * A single --isa is a compromise over 16k books: most symbols keep a
+ * handful of levels, where order_book_scalar is fastest because an
+ * order points straight at its level and only a new or emptied level
+ * touches the sorted side, while a few keep hundreds of levels, where
+ * every such change to a sorted array moves kilobytes and
+ * order_book_btree wins. Here every book starts scalar and is promoted
+ * to a B+-tree once its scalar layout gets expensive.
+ *
+ * The order is the scalar book's order_level_t in either layout, so a
+ * thin book costs what it does under --isa scalar: the order points at
+ * its level in the engine's pool, and a tree's leaves hold the level ids
+ * where order_book_btree keeps quantities (see tree_add). A reduce only
+ * touches the level and the order, whatever the layout. A promotion
+ * rebuilds both sides as trees, in order and so always at the tree's
+ * cached rightmost leaf, over the levels the book already has, so no
+ * order has to be found or changed. A tree goes back to the scalar
+ * layout once both of its sides are empty again: a book that got deep
+ * tends to stay deep for the day. The dispatch is one predictable branch
+ * on the book's tag, and the layout that is not in use stays empty.
+ *
+ * What a scalar book costs is not its depth as such but how far its adds
+ * and deletes walk in from the inside: a book with a long tail of far
+ * orders that are left alone is as cheap as a thin one. So each compact
+ * book keeps a moving average of the levels its adds and deletes walked
+ * past (see order_book_scalar::ADD_ORDER), and is promoted once that
+ * average goes past PROMOTE_WALK; the average can only get there in a
+ * book at least that deep. The moves are counted in the engine's
+ * shared_t.
+ */
+
+template<TRACE trace = TRACE::DISABLED>
+class order_book_adaptive : public order_book<order_book_adaptive<trace>, order_level_t, trace>
+{
+public:
+  using base = order_book<order_book_adaptive<trace>, order_level_t, trace>;
+  using compact_t = order_book_scalar<trace>;
+  using wide_t = order_book_btree<trace>;
+  // levels walked per add or delete, on average, past which a book
+  // becomes a tree
+  static constexpr uint32_t PROMOTE_WALK = 24;
+  // the average is over about 2^WALK_SHIFT operations
+  static constexpr uint32_t WALK_SHIFT = 5;
+
+  struct shared_t {
+    typename compact_t::shared_t m_levels;
+    typename wide_t::shared_t m_nodes;
+    size_t m_promotions = 0;
+    size_t m_demotions = 0;
+    void clear() {
+      m_levels.clear();
+      m_nodes.clear();
+      m_promotions = 0;
+      m_demotions = 0;
+    }
+    size_t in_use() const { return m_levels.in_use() + m_nodes.in_use(); }
+  };
+
+  compact_t m_compact;
+  wide_t m_wide;
+  bool m_is_wide = false;
+  uint32_t m_walk = 0;  // the average walk << WALK_SHIFT, while compact
+
+  bool wide() const { return m_is_wide; }
+  bool check_order_bid( shared_t& shared, const order_level_t *order ) const {
+    return is_bid( shared.m_levels[ order->level_idx ].m_price );
+  }
+  sprice_t order_price( shared_t& shared, const order_level_t *order ) const {
+    return shared.m_levels[ order->level_idx ].m_price;
+  }
+
+#if CROSS_CHECK
+  template<class ref_book_t, class ref_shared_t>
+  void crosscheck( shared_t& shared, const ref_book_t& book, ref_shared_t& ref_levels, order_id_t, bool is_bid ) {
+    const auto& ref_side = is_bid ? book.m_bids : book.m_asks;
+    std::vector<sprice_t> prices( ref_side.size() + 1 );
+    std::vector<qty_t> qtys( prices.size() );
+    size_t const n = top( shared, is_bid, prices.size(), prices.data(), qtys.data() );
+    assert( ref_side.size() == n );
+    for ( size_t i = 0; i < n; i++ ) {
+      assert( ref_side[i].m_price == prices[i + 1] );
+      assert( ref_levels[ref_side[i].m_ptr].m_qty == qtys[i + 1] );
+    }
+  }
+#endif
+  // a cleared book starts the next day compact
+  void clear( shared_t& shared ) {
+    m_compact.clear( shared.m_levels );
+    m_wide.clear( shared.m_nodes );
+    m_is_wide = false;
+    m_walk = 0;
+  }
+  void swap( order_book_adaptive& o ) {
+    m_compact.swap( o.m_compact );
+    m_wide.swap( o.m_wide );
+    std::swap( m_is_wide, o.m_is_wide );
+    std::swap( m_walk, o.m_walk );
+  }
+  level best( shared_t& shared, bool bid ) const {
+    if ( !m_is_wide ) return m_compact.best( shared.m_levels, bid );
+    const level_btree& side = bid ? m_wide.m_bids : m_wide.m_asks;
+    if ( side.empty() ) return level( 0, qty_t(0) );
+    return shared.m_levels[ side.best_qty( shared.m_nodes ) ];
+  }
+  size_t top( shared_t& shared, bool bid, size_t k, sprice_t *prices, qty_t *qtys ) const {
+    if ( !m_is_wide ) return m_compact.top( shared.m_levels, bid, k, prices, qtys );
+    // the tree's values are level ids
+    size_t const n = m_wide.top( shared.m_nodes, bid, k, prices, qtys );
+    for ( size_t i = k - n; i < k; i++ ) qtys[i] = shared.m_levels[ qtys[i] ].m_qty;
+    return n;
+  }
+  void ADD_ORDER(shared_t& shared, order_level_t *order, sprice_t const price, qty_t const qty)
+  {
+    if ( m_is_wide ) {
+      tree_add( shared, order, price, qty );
+    } else {
+      walked( shared, m_compact.ADD_ORDER( shared.m_levels, order, price, qty ) );
+    }
+  }
+  // In a tree, at the same price only the quantities change; otherwise
+  // the order leaves its level as a delete would and joins the new one.
+  void REPLACE_ORDER(shared_t& shared, order_level_t *order, sprice_t const price, qty_t const qty)
+  {
+    if ( m_is_wide ) {
+      level& l = shared.m_levels[ order->level_idx ];
+      if ( l.m_price == price ) {
+        l.m_qty = l.m_qty - order->m_qty + qty;
+      } else {
+        tree_remove( shared, order );
+        tree_add( shared, order, price, qty );
+      }
+      order->m_qty = qty;
+    } else {
+      m_compact.REPLACE_ORDER( shared.m_levels, order, price, qty );
+    }
+  }
+  // shared between cancel(aka partial cancel aka reduce) and execute.
+  // Only the level and the order change, in either layout
+  void REDUCE_ORDER(shared_t& shared, order_level_t *order, qty_t const qty)
+  {
+    m_compact.REDUCE_ORDER( shared.m_levels, order, qty );
+  }
+  // shared between delete and execute
+  void DELETE_ORDER(shared_t& shared, order_level_t *order)
+  {
+    if ( m_is_wide ) {
+      tree_remove( shared, order );
+      if ( m_wide.m_bids.empty() && m_wide.m_asks.empty() ) {
+        m_is_wide = false;
+        m_walk = 0;
+        ++shared.m_demotions;
+      }
+    } else {
+      walked( shared, m_compact.DELETE_ORDER( shared.m_levels, order ) );
+    }
+  }
+
+private:
+  // A tree's add and delete. The order's level is the one the tree has
+  // at its price, new if there was none, and goes with its last order
+  void tree_add( shared_t& shared, order_level_t *order, sprice_t const price, qty_t const qty ) {
+    btree_editor editor( shared.m_nodes, is_bid( price ) ? m_wide.m_bids : m_wide.m_asks );
+    order->level_idx = editor.find_or_insert( price, [&] {
+      level_id_t const id = shared.m_levels.alloc();
+      shared.m_levels[ id ] = level( price, qty_t(0) );
+      return id;
+    } );
+    shared.m_levels[ order->level_idx ].m_qty += qty;
+  }
+  void tree_remove( shared_t& shared, order_level_t *order ) {
+    level& l = shared.m_levels[ order->level_idx ];
+    assert( l.m_qty >= order->m_qty );
+    l.m_qty -= order->m_qty;
+    if ( qty_t(0) == l.m_qty ) {
+      btree_editor( shared.m_nodes, is_bid( l.m_price ) ? m_wide.m_bids : m_wide.m_asks ).erase( l.m_price );
+      shared.m_levels.free( order->level_idx );
+    }
+  }
+  void walked( shared_t& shared, size_t const levels ) {
+    m_walk += uint32_t( levels ) - ( m_walk >> WALK_SHIFT );
+    if ( __builtin_expect( m_walk > ( PROMOTE_WALK << WALK_SHIFT ), 0 ) ) promote( shared );
+  }
+  // the trees take over the scalar sides' levels, so the orders on them
+  // keep pointing at the right ones
+  __attribute__((__noinline__)) void promote( shared_t& shared ) {
+    for ( bool bid : { true, false } ) {
+      auto& side = bid ? m_compact.m_bids : m_compact.m_asks;
+      btree_editor editor( shared.m_nodes, bid ? m_wide.m_bids : m_wide.m_asks );
+      for ( const price_level_indirect& l : side ) {
+        editor.find_or_insert( l.m_price, [&] { return l.m_ptr; } );
+      }
+    }
+    m_compact.clear( shared.m_levels );
+    m_is_wide = true;
+    ++shared.m_promotions;
+  }
+};
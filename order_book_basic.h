@@ -0,0 +1,436 @@
+/*
+ *
+ * order_book_basic.h
+ *
+ * A limit order book assembled from storage, search and order policies.
+ *
+ * Copyright (c) 2025, Archaea Software, LLC.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string>
+#include <x86intrin.h>
+
+/*
+ * The array-based books are one algorithm with different choices: how a
+ * side stores its sorted levels, how it searches them for a price, and
+ * whether an order finds its quantity through a level in the engine's
+ * pool or by its price in the side. basic_book takes the three as
+ * policies, so that every combination can be built and measured against
+ * the others (see --isa matrix in main.cpp):
+ *
+ *   storage  aos       one array of {price, payload}, as scalar's
+ *                      price_level_indirect
+ *            soa       an array of prices and a parallel one of payloads
+ *   search   backward  linear, from the inside down
+ *            forward   linear, from the worst level up
+ *            binary    branchless binary search
+ *            simd      from the inside down, 8 prices to an AVX2 compare
+ *                      (4 over aos, whose prices are every other int)
+ *   orders   level     order_level_t; the payload is a level id and
+ *                      quantities are in the engine's level pool
+ *            price     order_price_t; the payload is the quantity
+ *
+ * scalar is aos/backward/level, soa is soa/backward/level, soa_price is
+ * soa/backward/price (with forward for reduce and delete) and avx2 is
+ * soa/simd/price. The hand-written books have shortcuts of their own,
+ * the repricing of a replace in place above all; basic_book applies a
+ * replace at a new price as a delete and an add, so that only the
+ * policies differ between its variants.
+ */
+
+/* Storage policies. side<payload_t> is one side of a book: ascending
+ * prices, each with a payload. prices() and STRIDE give the searches the
+ * prices as every STRIDE-th sprice_t from there. */
+struct aos_storage {
+  static constexpr const char *NAME = "aos";
+  template<class payload_t>
+  class side
+  {
+   public:
+    struct entry {
+      sprice_t m_price;
+      payload_t m_payload;
+    };
+    static_assert( sizeof( entry ) % sizeof( sprice_t ) == 0, "prices must be STRIDE apart" );
+    static constexpr size_t STRIDE = sizeof( entry ) / sizeof( sprice_t );
+    size_t size() const { return m_entries.size(); }
+    bool empty() const { return m_entries.empty(); }
+    const sprice_t *prices() const { return &m_entries.data()->m_price; }
+    sprice_t price( size_t const i ) const { return m_entries[i].m_price; }
+    payload_t& payload( size_t const i ) { return m_entries[i].m_payload; }
+    payload_t payload( size_t const i ) const { return m_entries[i].m_payload; }
+    void insert( size_t const i, sprice_t const price, payload_t const payload ) {
+      m_entries.insert( m_entries.begin() + i, entry{ price, payload } );
+    }
+    void erase( size_t const i ) { m_entries.erase( m_entries.begin() + i ); }
+    void clear() { m_entries.clear(); }
+    void swap( side& o ) { m_entries.swap( o.m_entries ); }
+   private:
+    level_array<entry, 64> m_entries;
+  };
+};
+
+struct soa_storage {
+  static constexpr const char *NAME = "soa";
+  template<class payload_t>
+  class side
+  {
+   public:
+    static constexpr size_t STRIDE = 1;
+    size_t size() const { return m_prices.size(); }
+    bool empty() const { return m_prices.empty(); }
+    const sprice_t *prices() const { return m_prices.data(); }
+    sprice_t price( size_t const i ) const { return m_prices[i]; }
+    payload_t& payload( size_t const i ) { return m_payloads[i]; }
+    payload_t payload( size_t const i ) const { return m_payloads[i]; }
+    void insert( size_t const i, sprice_t const price, payload_t const payload ) {
+      m_prices.insert( m_prices.begin() + i, price );
+      m_payloads.insert( m_payloads.begin() + i, payload );
+    }
+    void erase( size_t const i ) {
+      m_prices.erase( m_prices.begin() + i );
+      m_payloads.erase( m_payloads.begin() + i );
+    }
+    void clear() {
+      m_prices.clear();
+      m_payloads.clear();
+    }
+    void swap( side& o ) {
+      m_prices.swap( o.m_prices );
+      m_payloads.swap( o.m_payloads );
+    }
+   private:
+    level_array<sprice_t, 64> m_prices;
+    level_array<payload_t, 64> m_payloads;
+  };
+};
+
+/* Search policies. find<STRIDE>(p, n, price, &found) looks for price
+ * among the n ascending prices p[0], p[STRIDE], ... and returns its index
+ * if found is set, else the index it would be inserted at. */
+struct backward_scan {
+  static constexpr const char *NAME = "backward";
+  template<size_t STRIDE>
+  static size_t find( const sprice_t *p, size_t const n, sprice_t const price, bool *found ) {
+    size_t i = n;
+    while ( i && p[( i - 1 ) * STRIDE] > price ) --i;
+    *found = i && p[( i - 1 ) * STRIDE] == price;
+    return *found ? i - 1 : i;
+  }
+};
+
+struct forward_scan {
+  static constexpr const char *NAME = "forward";
+  template<size_t STRIDE>
+  static size_t find( const sprice_t *p, size_t const n, sprice_t const price, bool *found ) {
+    size_t i = 0;
+    while ( i < n && p[i * STRIDE] < price ) ++i;
+    *found = i < n && p[i * STRIDE] == price;
+    return i;
+  }
+};
+
+struct branchless_binary {
+  static constexpr const char *NAME = "binary";
+  // halves the range with a conditional move rather than a branch, so a
+  // search costs log2(n) dependent loads and no mispredictions
+  template<size_t STRIDE>
+  static size_t find( const sprice_t *p, size_t const n, sprice_t const price, bool *found ) {
+    if ( 0 == n ) {
+      *found = false;
+      return 0;
+    }
+    size_t lo = 0;
+    size_t len = n;
+    while ( len > 1 ) {
+      size_t const half = len / 2;
+      lo = p[( lo + half ) * STRIDE] <= price ? lo + half : lo;
+      len -= half;
+    }
+    // p[lo] is the last price <= price, or the first price if none is
+    *found = p[lo * STRIDE] == price;
+    return lo + ( p[lo * STRIDE] < price );
+  }
+};
+
+struct simd_search {
+  static constexpr const char *NAME = "simd";
+  template<size_t STRIDE>
+  static size_t find( const sprice_t *p, size_t const n, sprice_t const price, bool *found ) {
+    static_assert( STRIDE == 1 || STRIDE == 2, "8 or 4 prices to a compare" );
+    constexpr size_t LANES = 8 / STRIDE;
+    constexpr uint32_t PRICE_LANES = 1 == STRIDE ? 0xff : 0x55;
+    size_t i = n;
+    __m256i const key = _mm256_set1_epi32( price );
+    while ( i >= LANES ) {
+      __m256i const v = _mm256_loadu_si256( (__m256i const *)( p + ( i - LANES ) * STRIDE ) );
+      uint32_t const gt = PRICE_LANES &
+          uint32_t( _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( v, key ) ) ) );
+      if ( PRICE_LANES != gt ) {
+        i -= __builtin_popcount( gt );
+        break;
+      }
+      i -= LANES;
+    }
+    // the rest, below the last full compare; nothing if it stopped early
+    while ( i && p[( i - 1 ) * STRIDE] > price ) --i;
+    *found = i && p[( i - 1 ) * STRIDE] == price;
+    return *found ? i - 1 : i;
+  }
+};
+
+/* Order policies. The payload beside each price in a side is whatever
+ * takes an order to its level's quantity. */
+struct level_orders {
+  static constexpr const char *NAME = "level";
+  using order_t = order_level_t;
+  using payload_t = level_id_t;
+  template<class base>
+  using shared_t = pool<level, level_id_t, base::NUM_LEVELS>;
+  template<class shared_t>
+  static sprice_t price( shared_t& levels, const order_t *order ) {
+    return levels[order->level_idx].m_price;
+  }
+  static void set_price( order_t *, sprice_t ) {}
+  template<class shared_t>
+  static qty_t qty( shared_t& levels, payload_t const payload ) {
+    return levels[payload].m_qty;
+  }
+  // a new level for the order, holding qty
+  template<class shared_t>
+  static payload_t create( shared_t& levels, order_t *order, sprice_t const price, qty_t const qty ) {
+    order->level_idx = levels.alloc();
+    levels[order->level_idx].m_price = price;
+    levels[order->level_idx].m_qty = qty;
+    return order->level_idx;
+  }
+  // the order joins an existing level
+  template<class shared_t>
+  static void join( shared_t& levels, payload_t const payload, order_t *order, qty_t const qty ) {
+    order->level_idx = payload;
+    levels[payload].m_qty += qty;
+  }
+  // the order's level's quantity; the order knows its level, so find,
+  // which searches the side for its payload, is not called
+  template<class shared_t, class F>
+  static qty_t& level_qty( shared_t& levels, const order_t *order, F&& ) {
+    return levels[order->level_idx].m_qty;
+  }
+  template<class shared_t>
+  static void release( shared_t& levels, payload_t const payload ) {
+    levels.free( payload );
+  }
+};
+
+struct price_orders {
+  static constexpr const char *NAME = "price";
+  using order_t = order_price_t;
+  using payload_t = qty_t;
+  template<class base>
+  using shared_t = typename base::shared_t;
+  template<class shared_t>
+  static sprice_t price( shared_t&, const order_t *order ) {
+    return order->m_price;
+  }
+  static void set_price( order_t *order, sprice_t const price ) { order->m_price = price; }
+  template<class shared_t>
+  static qty_t qty( shared_t&, payload_t const payload ) {
+    return payload;
+  }
+  template<class shared_t>
+  static payload_t create( shared_t&, order_t *, sprice_t, qty_t const qty ) {
+    return qty;
+  }
+  template<class shared_t>
+  static void join( shared_t&, payload_t& payload, order_t *, qty_t const qty ) {
+    payload += qty;
+  }
+  // the quantity is the payload, in the side at the order's price
+  template<class shared_t, class F>
+  static qty_t& level_qty( shared_t&, const order_t *, F&& find ) {
+    return find();
+  }
+  template<class shared_t>
+  static void release( shared_t&, payload_t ) {}
+};
+
+template<class Storage, class Search, class Order, TRACE trace = TRACE::DISABLED>
+class basic_book : public order_book<basic_book<Storage, Search, Order, trace>, typename Order::order_t, trace>
+{
+public:
+  using base = order_book<basic_book<Storage, Search, Order, trace>, typename Order::order_t, trace>;
+  using order_t = typename Order::order_t;
+  using payload_t = typename Order::payload_t;
+  using shared_t = typename Order::template shared_t<base>;
+  using side_t = typename Storage::template side<payload_t>;
+  side_t m_bids;
+  side_t m_asks;
+
+  // storage/search/orders, as --isa takes it
+  static std::string name() {
+    return std::string( Storage::NAME ) + "/" + Search::NAME + "/" + Order::NAME;
+  }
+  bool check_order_bid( shared_t& shared, const order_t *order ) const {
+    return is_bid( Order::price( shared, order ) );
+  }
+  sprice_t order_price( shared_t& shared, const order_t *order ) const {
+    return Order::price( shared, order );
+  }
+
+#if CROSS_CHECK
+  template<class ref_book_t, class ref_shared_t>
+  void crosscheck( shared_t& shared, const ref_book_t& book, ref_shared_t& ref_levels, order_id_t oid, bool is_bid ) {
+    const auto& ref_side = is_bid ? book.m_bids : book.m_asks;
+    const side_t& our_side = is_bid ? m_bids : m_asks;
+    assert( ref_side.size() == our_side.size() );
+    for ( size_t i = 0; i < our_side.size(); i++ ) {
+      assert( ref_side[i].m_price == our_side.price( i ) );
+      assert( ref_levels[ref_side[i].m_ptr].m_qty == Order::qty( shared, our_side.payload( i ) ) );
+    }
+  }
+#endif
+  void clear( shared_t& ) {
+    m_bids.clear();
+    m_asks.clear();
+  }
+  void swap( basic_book& o ) {
+    m_bids.swap( o.m_bids );
+    m_asks.swap( o.m_asks );
+  }
+  // the inside of one side, or a zero level if the side is empty
+  level best( shared_t& shared, bool bid ) const {
+    const side_t& side = bid ? m_bids : m_asks;
+    if ( side.empty() ) return level( 0, qty_t(0) );
+    return level( side.price( side.size() - 1 ), Order::qty( shared, side.payload( side.size() - 1 ) ) );
+  }
+  // copies the n = min(k, depth) best levels of one side into
+  // prices/qtys[k-n, k), best last, and returns n
+  size_t top( shared_t& shared, bool bid, size_t k, sprice_t *prices, qty_t *qtys ) const {
+    const side_t& side = bid ? m_bids : m_asks;
+    size_t const n = std::min( k, side.size() );
+    size_t const first = side.size() - n;
+    for ( size_t i = 0; i < n; i++ ) {
+      prices[k - n + i] = side.price( first + i );
+      qtys[k - n + i] = Order::qty( shared, side.payload( first + i ) );
+    }
+    return n;
+  }
+  void ADD_ORDER(shared_t& shared, order_t *order, sprice_t const price, qty_t const qty)
+  {
+    side_t& side = is_bid(price) ? m_bids : m_asks;
+    bool found;
+    size_t const idx = find( side, price, &found );
+    if (found) {
+      Order::join( shared, side.payload( idx ), order, qty );
+    } else {
+      side.insert( idx, price, Order::create( shared, order, price, qty ) );
+    }
+  }
+  void REPLACE_ORDER(shared_t& shared, order_t *order, sprice_t const price, qty_t const qty)
+  {
+    if (Order::price( shared, order ) == price) {
+      qty_t& level_qty = Order::level_qty( shared, order, [&]() -> payload_t& { return payload_at( price ); } );
+      level_qty = level_qty - order->m_qty + qty;
+    } else {
+      DELETE_ORDER(shared, order);
+      Order::set_price( order, price );
+      order->m_qty = qty;
+      ADD_ORDER(shared, order, price, qty);
+    }
+    order->m_qty = qty;
+  }
+  // shared between cancel(aka partial cancel aka reduce) and execute
+  void REDUCE_ORDER(shared_t& shared, order_t *order, qty_t const qty)
+  {
+    sprice_t const price = Order::price( shared, order );
+    Order::level_qty( shared, order, [&]() -> payload_t& { return payload_at( price ); } ) -= qty;
+    order->m_qty -= qty;
+  }
+  // shared between delete and execute
+  void DELETE_ORDER(shared_t& shared, order_t *order)
+  {
+    sprice_t const price = Order::price( shared, order );
+    side_t& side = is_bid(price) ? m_bids : m_asks;
+    bool found = false;
+    size_t idx = 0;
+    qty_t& level_qty = Order::level_qty( shared, order, [&]() -> payload_t& {
+      idx = find( side, price, &found );
+      return side.payload( idx );
+    } );
+    assert( level_qty >= order->m_qty );
+    level_qty -= order->m_qty;
+    if (qty_t(0) == level_qty) {
+      if (!found) idx = find( side, price, &found );
+      assert( found );
+      Order::release( shared, side.payload( idx ) );
+      side.erase( idx );
+    }
+  }
+
+private:
+  static size_t find( const side_t& side, sprice_t const price, bool *found ) {
+    return Search::template find<side_t::STRIDE>( side.prices(), side.size(), price, found );
+  }
+  // the payload of the level at price, which is in the book
+  payload_t& payload_at( sprice_t const price ) {
+    side_t& side = is_bid(price) ? m_bids : m_asks;
+    bool found;
+    size_t const idx = find( side, price, &found );
+    assert( found );
+    return side.payload( idx );
+  }
+};
+
+// the policies that --isa matrix combines
+template<class... T>
+struct type_list {};
+using basic_storages = type_list<aos_storage, soa_storage>;
+using basic_searches = type_list<backward_scan, forward_scan, branchless_binary, simd_search>;
+using basic_orders = type_list<level_orders, price_orders>;
+
+template<TRACE trace, class Storage, class Search, class F, class... Order>
+void for_each_basic_order( F& f, type_list<Order...> ) {
+  ( f( static_cast<basic_book<Storage, Search, Order, trace> *>( nullptr ) ), ... );
+}
+template<TRACE trace, class Storage, class F, class... Search>
+void for_each_basic_search( F& f, type_list<Search...> ) {
+  ( for_each_basic_order<trace, Storage, Search>( f, basic_orders() ), ... );
+}
+template<TRACE trace, class F, class... Storage>
+void for_each_basic_storage( F& f, type_list<Storage...> ) {
+  ( for_each_basic_search<trace, Storage>( f, basic_searches() ), ... );
+}
+// calls f with a null basic_book<...>* of every combination
+template<TRACE trace, class F>
+void for_each_basic_book( F&& f ) {
+  for_each_basic_storage<trace>( f, basic_storages() );
+}
@@ -0,0 +1,495 @@
+/*
+ *
+ * order_book_btree.h
+ *
+ * B+-tree implementation of limit order book, for very deep books.
+ *
+ * Copyright (c) 2025, Archaea Software, LLC.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <x86intrin.h>
+
+/*
+ * The sorted arrays used by the other implementations are ideal when
+ * activity stays near the inside, but a book with thousands of levels
+ * pays a memmove of kilobytes for every add or delete deep in the book.
+ * Here each side is a B+-tree of 16-key nodes instead. The key array of
+ * a node is exactly one cache line and is searched with two 8-wide
+ * AVX2 compares and a movemask, as in Search_avx2.
+ *
+ * Keys are signed prices, so on both sides the best level is the
+ * largest key and lives in the rightmost leaf, which is cached. Inner
+ * nodes store the largest key of each child, unused key slots hold
+ * INT32_MAX so they never compare below a real price, and leaves are
+ * doubly linked from the worst level (head) to the best (tail).
+ *
+ * Nodes come from a pool shared by all books of an engine. Leaves split in
+ * half when full and merge with a neighbour when they fall below a
+ * quarter full, so every operation is O(log n) with a small constant.
+ * Operations at or above the first key of the best leaf skip the
+ * descent entirely.
+ */
+
+using node_id_t = uint32_t;
+
+struct alignas(64) btree_node {
+  static constexpr int FANOUT = 16;
+  static constexpr sprice_t KEY_SENTINEL = std::numeric_limits<sprice_t>::max();
+  sprice_t m_keys[FANOUT];  // leaf: level prices, inner: max key of child
+  uint32_t m_vals[FANOUT];  // leaf: level qtys, inner: child node ids
+  node_id_t m_parent;
+  node_id_t m_prev;  // leaves only
+  node_id_t m_next;  // leaves only
+  uint8_t m_n;
+  bool m_leaf;
+
+  void initialize(bool leaf, node_id_t parent);
+  sprice_t max_key() const { return m_keys[m_n - 1]; }
+  // number of keys < price, i.e. the lower bound of price in this node
+  int lower_bound(sprice_t const price) const
+  {
+    __m256i v_q = _mm256_set1_epi32(price);
+    __m256i v_lo = _mm256_load_si256((__m256i const *)m_keys);
+    __m256i v_hi = _mm256_load_si256((__m256i const *)m_keys + 1);
+    int lt = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v_q, v_lo))) |
+             (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v_q, v_hi))) << 8);
+    return __builtin_popcount(lt);
+  }
+  // index of child in an inner node
+  int child_index(node_id_t const child) const
+  {
+    __m256i v_q = _mm256_set1_epi32(int32_t(child));
+    __m256i v_lo = _mm256_load_si256((__m256i const *)m_vals);
+    __m256i v_hi = _mm256_load_si256((__m256i const *)m_vals + 1);
+    int eq = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v_q, v_lo))) |
+             (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v_q, v_hi))) << 8);
+    eq &= (1 << m_n) - 1;
+    assert(eq);
+    return __builtin_ctz(eq);
+  }
+};
+
+inline void btree_node::initialize(bool leaf, node_id_t parent)
+{
+  for (int i = 0; i < FANOUT; i++) {
+    m_keys[i] = KEY_SENTINEL;
+    m_vals[i] = 0;
+  }
+  m_parent = parent;
+  m_prev = m_next = node_id_t(-1);
+  m_n = 0;
+  m_leaf = leaf;
+}
+
+using btree_node_vector = pool<btree_node, node_id_t, 1 << 18>;
+
+/* One side of a book. The nodes live in the engine's pool, so reading
+ * the tree needs the pool as well. */
+class level_btree
+{
+ public:
+  static constexpr node_id_t NIL = node_id_t(-1);
+
+  node_id_t m_root = NIL;
+  node_id_t m_head = NIL;  // worst level
+  node_id_t m_tail = NIL;  // best level
+  uint32_t m_size = 0;
+
+  bool empty() const { return 0 == m_size; }
+  size_t size() const { return m_size; }
+  // O(1) through the cached rightmost leaf. Only valid if !empty()
+  sprice_t best_price(btree_node_vector& nodes) const { return nodes[m_tail].max_key(); }
+  qty_t best_qty(btree_node_vector& nodes) const
+  {
+    btree_node const &n = nodes[m_tail];
+    return n.m_vals[n.m_n - 1];
+  }
+};
+
+/* The tree algorithms, bound to one side and to the node pool for the
+ * duration of a single operation. */
+class btree_editor
+{
+ public:
+  static constexpr node_id_t NIL = level_btree::NIL;
+  static constexpr int FANOUT = btree_node::FANOUT;
+
+  btree_editor(btree_node_vector& nodes, level_btree& tree) : m_nodes(nodes), m_tree(tree) {}
+
+  void add(sprice_t const price, qty_t const qty)
+  {
+    node_id_t const leaf = find_leaf(price);
+    btree_node *n = node(leaf);
+    int const pos = n->lower_bound(price);
+    if (pos < n->m_n && n->m_keys[pos] == price) {
+      n->m_vals[pos] += qty;
+    } else {
+      insert_at(leaf, pos, price, qty);
+    }
+  }
+  void reduce(sprice_t const price, qty_t const qty)
+  {
+    btree_node *n = node(find_leaf(price));
+    int const pos = n->lower_bound(price);
+    assert(pos < n->m_n && n->m_keys[pos] == price);
+    n->m_vals[pos] -= qty;
+  }
+  void remove(sprice_t const price, qty_t const qty)
+  {
+    node_id_t const leaf = find_leaf(price);
+    btree_node *n = node(leaf);
+    int const pos = n->lower_bound(price);
+    assert(pos < n->m_n && n->m_keys[pos] == price);
+    assert(n->m_vals[pos] >= qty);
+    n->m_vals[pos] -= qty;
+    if (qty_t(0) == n->m_vals[pos]) {
+      erase_at(leaf, pos);
+    }
+  }
+
+  /* For a tree whose leaves hold level ids instead of quantities (see
+   * order_book_adaptive): the id at price, or if price is not there yet
+   * the one make() returns, inserted at price. */
+  template<class F>
+  uint32_t find_or_insert(sprice_t const price, F const &make)
+  {
+    node_id_t const leaf = find_leaf(price);
+    btree_node *n = node(leaf);
+    int const pos = n->lower_bound(price);
+    if (pos < n->m_n && n->m_keys[pos] == price) return n->m_vals[pos];
+    uint32_t const id = make();
+    insert_at(leaf, pos, price, id);
+    return id;
+  }
+  // and takes price out of such a tree
+  void erase(sprice_t const price)
+  {
+    node_id_t const leaf = find_leaf(price);
+    int const pos = node(leaf)->lower_bound(price);
+    assert(pos < node(leaf)->m_n && node(leaf)->m_keys[pos] == price);
+    erase_at(leaf, pos);
+  }
+
+ private:
+  btree_node_vector& m_nodes;
+  level_btree& m_tree;
+
+  btree_node *node(node_id_t const id) { return m_nodes.get(id); }
+
+  node_id_t new_node(bool leaf, node_id_t parent)
+  {
+    node_id_t const id = m_nodes.alloc();
+    node(id)->initialize(leaf, parent);
+    return id;
+  }
+
+  node_id_t find_leaf(sprice_t const price)
+  {
+    if (NIL == m_tree.m_root) {
+      m_tree.m_root = m_tree.m_head = m_tree.m_tail = new_node(true, NIL);
+      return m_tree.m_root;
+    }
+    // most activity is at the inside, which lives in the tail leaf
+    if (price >= node(m_tree.m_tail)->m_keys[0]) {
+      return m_tree.m_tail;
+    }
+    node_id_t id = m_tree.m_root;
+    btree_node *n = node(id);
+    while (!n->m_leaf) {
+      int pos = n->lower_bound(price);
+      if (pos == n->m_n) pos = n->m_n - 1;
+      id = n->m_vals[pos];
+      n = node(id);
+    }
+    return id;
+  }
+
+  // The max key of `id` changed; fix up the ancestors that record it
+  void propagate_max(node_id_t id)
+  {
+    btree_node *n = node(id);
+    while (NIL != n->m_parent) {
+      btree_node *p = node(n->m_parent);
+      int const i = p->child_index(id);
+      p->m_keys[i] = n->max_key();
+      if (i != p->m_n - 1) break;
+      id = n->m_parent;
+      n = p;
+    }
+  }
+
+  void insert_at(node_id_t id, int pos, sprice_t const key, uint32_t const val)
+  {
+    if (FANOUT == node(id)->m_n) {
+      node_id_t const right = split(id);
+      if (pos > FANOUT / 2) {
+        id = right;
+        pos -= FANOUT / 2;
+      }
+    }
+    btree_node *n = node(id);
+    for (int i = n->m_n; i > pos; i--) {
+      n->m_keys[i] = n->m_keys[i - 1];
+      n->m_vals[i] = n->m_vals[i - 1];
+    }
+    n->m_keys[pos] = key;
+    n->m_vals[pos] = val;
+    n->m_n++;
+    if (n->m_leaf) {
+      ++m_tree.m_size;
+    } else {
+      node(val)->m_parent = id;
+    }
+    if (pos == n->m_n - 1) {
+      propagate_max(id);
+    }
+  }
+
+  // Moves the upper half of a full node into a new right sibling and
+  // links it into the parent. Returns the new node.
+  node_id_t split(node_id_t const id)
+  {
+    node_id_t const right = new_node(node(id)->m_leaf, node(id)->m_parent);
+    btree_node *l = node(id);
+    btree_node *r = node(right);
+    int const half = FANOUT / 2;
+    for (int i = half; i < FANOUT; i++) {
+      r->m_keys[i - half] = l->m_keys[i];
+      r->m_vals[i - half] = l->m_vals[i];
+      l->m_keys[i] = btree_node::KEY_SENTINEL;
+      if (!r->m_leaf) node(r->m_vals[i - half])->m_parent = right;
+    }
+    l->m_n = half;
+    r->m_n = FANOUT - half;
+    if (l->m_leaf) {
+      r->m_prev = id;
+      r->m_next = l->m_next;
+      if (NIL != l->m_next) {
+        node(l->m_next)->m_prev = right;
+      } else {
+        m_tree.m_tail = right;
+      }
+      l->m_next = right;
+    }
+    if (NIL == l->m_parent) {
+      node_id_t const root = new_node(false, NIL);
+      btree_node *p = node(root);
+      l = node(id);
+      r = node(right);
+      p->m_keys[0] = l->max_key();
+      p->m_vals[0] = id;
+      p->m_keys[1] = r->max_key();
+      p->m_vals[1] = right;
+      p->m_n = 2;
+      l->m_parent = r->m_parent = root;
+      m_tree.m_root = root;
+    } else {
+      node_id_t const parent = l->m_parent;
+      btree_node *p = node(parent);
+      int const i = p->child_index(id);
+      p->m_keys[i] = l->max_key();
+      insert_at(parent, i + 1, r->max_key(), right);
+    }
+    return right;
+  }
+
+  void erase_at(node_id_t const id, int const pos)
+  {
+    btree_node *n = node(id);
+    for (int i = pos; i < n->m_n - 1; i++) {
+      n->m_keys[i] = n->m_keys[i + 1];
+      n->m_vals[i] = n->m_vals[i + 1];
+    }
+    n->m_n--;
+    n->m_keys[n->m_n] = btree_node::KEY_SENTINEL;
+    if (n->m_leaf) --m_tree.m_size;
+    if (0 == n->m_n) {
+      remove_node(id);
+      return;
+    }
+    if (pos == n->m_n) {
+      propagate_max(id);
+    }
+    if (id == m_tree.m_root) {
+      collapse_root();
+    } else {
+      maybe_merge(id);
+    }
+  }
+
+  void remove_node(node_id_t const id)
+  {
+    btree_node *n = node(id);
+    node_id_t const parent = n->m_parent;
+    if (n->m_leaf) {
+      if (NIL != n->m_prev) node(n->m_prev)->m_next = n->m_next; else m_tree.m_head = n->m_next;
+      if (NIL != n->m_next) node(n->m_next)->m_prev = n->m_prev; else m_tree.m_tail = n->m_prev;
+    }
+    m_nodes.free(id);
+    if (NIL == parent) {
+      m_tree.m_root = m_tree.m_head = m_tree.m_tail = NIL;
+      return;
+    }
+    erase_at(parent, node(parent)->child_index(id));
+  }
+
+  void collapse_root()
+  {
+    btree_node *n = node(m_tree.m_root);
+    while (!n->m_leaf && 1 == n->m_n) {
+      node_id_t const child = n->m_vals[0];
+      m_nodes.free(m_tree.m_root);
+      m_tree.m_root = child;
+      n = node(child);
+      n->m_parent = NIL;
+    }
+  }
+
+  // Merges an underfull node with a neighbour under the same parent if
+  // the result is at most three quarters full, so the two do not
+  // immediately split again.
+  void maybe_merge(node_id_t const id)
+  {
+    btree_node *n = node(id);
+    if (n->m_n >= FANOUT / 4) return;
+    btree_node *p = node(n->m_parent);
+    int const i = p->child_index(id);
+    int left_i;
+    if (i + 1 < p->m_n && n->m_n + node(p->m_vals[i + 1])->m_n <= 3 * FANOUT / 4) {
+      left_i = i;
+    } else if (i > 0 && n->m_n + node(p->m_vals[i - 1])->m_n <= 3 * FANOUT / 4) {
+      left_i = i - 1;
+    } else {
+      return;
+    }
+    node_id_t const left = p->m_vals[left_i];
+    node_id_t const right = p->m_vals[left_i + 1];
+    btree_node *l = node(left);
+    btree_node *r = node(right);
+    for (int j = 0; j < r->m_n; j++) {
+      l->m_keys[l->m_n + j] = r->m_keys[j];
+      l->m_vals[l->m_n + j] = r->m_vals[j];
+      if (!l->m_leaf) node(r->m_vals[j])->m_parent = left;
+    }
+    l->m_n += r->m_n;
+    if (l->m_leaf) {
+      l->m_next = r->m_next;
+      if (NIL != r->m_next) node(r->m_next)->m_prev = left; else m_tree.m_tail = left;
+    }
+    p->m_keys[left_i] = l->max_key();
+    m_nodes.free(right);
+    erase_at(l->m_parent, left_i + 1);
+  }
+};
+
+template<TRACE trace = TRACE::DISABLED>
+class order_book_btree : public order_book<order_book_btree<trace>, order_price_t, trace>
+{
+public:
+  using shared_t = btree_node_vector;
+  level_btree m_bids;
+  level_btree m_asks;
+  bool check_order_bid( btree_node_vector&, const order_price_t *order ) const {
+    return is_bid( order->m_price );
+  }
+  sprice_t order_price( btree_node_vector&, const order_price_t *order ) const {
+    return order->m_price;
+  }
+
+#if CROSS_CHECK
+  template<class ref_book_t, class ref_shared_t>
+  void crosscheck( btree_node_vector& nodes, const ref_book_t& book, ref_shared_t& ref_levels, order_id_t oid, bool is_bid ) {
+    const auto& ref_side = is_bid ? book.m_bids : book.m_asks;
+    const level_btree& our_side = is_bid ? m_bids : m_asks;
+    assert( ref_side.size() == our_side.size() );
+    size_t i = 0;
+    for ( node_id_t id = our_side.m_head; id != level_btree::NIL; id = nodes[id].m_next ) {
+      const btree_node& n = nodes[id];
+      for ( int j = 0; j < n.m_n; j++, i++ ) {
+        assert( ref_side[i].m_price == n.m_keys[j] );
+        assert( ref_levels[ref_side[i].m_ptr].m_qty == n.m_vals[j] );
+      }
+    }
+    assert( i == ref_side.size() );
+  }
+#endif
+  void clear( btree_node_vector& ) {
+    m_bids = level_btree();
+    m_asks = level_btree();
+  }
+  void swap( order_book_btree& o ) {
+    std::swap( m_bids, o.m_bids );
+    std::swap( m_asks, o.m_asks );
+  }
+  // the inside of one side, or a zero level if the side is empty
+  level best( btree_node_vector& nodes, bool bid ) const {
+    const level_btree& side = bid ? m_bids : m_asks;
+    if ( side.empty() ) return level( 0, qty_t(0) );
+    return level( side.best_price( nodes ), side.best_qty( nodes ) );
+  }
+  // copies the n = min(k, depth) best levels of one side into
+  // prices/qtys[k-n, k), best last, and returns n
+  size_t top( btree_node_vector& nodes, bool bid, size_t k, sprice_t *prices, qty_t *qtys ) const {
+    const level_btree& side = bid ? m_bids : m_asks;
+    size_t i = k;
+    for ( node_id_t id = side.m_tail; id != level_btree::NIL && i; id = nodes[id].m_prev ) {
+      const btree_node& n = nodes[id];
+      for ( int j = n.m_n - 1; j >= 0 && i; j-- ) {
+        --i;
+        prices[i] = n.m_keys[j];
+        qtys[i] = n.m_vals[j];
+      }
+    }
+    return k - i;
+  }
+  void ADD_ORDER(btree_node_vector& nodes, order_price_t *, sprice_t const price, qty_t const qty)
+  {
+    level_btree& side = is_bid(price) ? m_bids : m_asks;
+    btree_editor( nodes, side ).add( price, qty );
+  }
+  // The engine applies this book's replaces as a delete and an add (see
+  // REPLACE_PATH): a replace inside the tree measured no faster.
+  static constexpr REPLACE_PATH replace_path = REPLACE_PATH::DELETE_ADD;
+  // shared between cancel(aka partial cancel aka reduce) and execute
+  void REDUCE_ORDER(btree_node_vector& nodes, order_price_t *order, qty_t const qty)
+  {
+    level_btree& side = is_bid(order->m_price) ? m_bids : m_asks;
+    btree_editor( nodes, side ).reduce( order->m_price, qty );
+    order->m_qty -= qty;
+  }
+  // shared between delete and execute
+  void DELETE_ORDER(btree_node_vector& nodes, order_price_t *order)
+  {
+    level_btree& side = is_bid(order->m_price) ? m_bids : m_asks;
+    btree_editor( nodes, side ).remove( order->m_price, order->m_qty );
+  }
+};
@@ -0,0 +1,295 @@
+/*
+ *
+ * order_book_gap.h
+ *
+ * Gap-buffer implementation of limit order book.
+ *
+ * Copyright (c) 2025, Archaea Software, LLC.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <x86intrin.h>
+
+/*
+ * The sorted arrays of soa_price shift every level between the insertion
+ * point and the inside on an add or delete. That is nothing while the
+ * activity stays at the inside, but a book whose activity sits a few
+ * hundred levels in pays that whole tail on every message, and again on
+ * the next one in the same place.
+ *
+ * Here each side is a gap buffer: the levels fill one array from both
+ * ends, worst first at the front and best last at the back, and the
+ * free capacity is a gap between the two runs, left wherever the last
+ * add or delete was. An edit moves the gap to its position first, which
+ * copies only the levels between the two positions, then writes into or
+ * widens the gap. Repeated edits in one region of the book, the inside
+ * included, cost the distance between them rather than the distance to
+ * the inside.
+ *
+ * A price is looked for from the inside down, first in the run above
+ * the gap and then, only if every level there is better, in the run
+ * below it, 8 prices to an AVX2 compare, so the gap is never read.
+ */
+
+/* One side of a book: parallel prices and quantities, ascending, in one
+ * heap block. Levels [0, m_gap) are at the front of the arrays and the
+ * others at the back, after m_gap_end. Indexes are into the levels, as
+ * if there were no gap. */
+class gap_levels
+{
+ public:
+  static constexpr uint32_t MIN_CAPACITY = 16;
+
+  gap_levels() {}
+  ~gap_levels() { std::free( m_prices ); }
+  gap_levels( gap_levels const& ) = delete;
+  gap_levels& operator=( gap_levels const& ) = delete;
+
+  uint32_t size() const { return m_capacity - ( m_gap_end - m_gap ); }
+  bool empty() const { return 0 == size(); }
+  sprice_t price( uint32_t const i ) const { return m_prices[at( i )]; }
+  qty_t& qty( uint32_t const i ) { return m_qtys[at( i )]; }
+  qty_t qty( uint32_t const i ) const { return m_qtys[at( i )]; }
+  void set_price( uint32_t const i, sprice_t const price ) { m_prices[at( i )] = price; }
+
+  // the index of price if found is set, else the index it would be
+  // inserted at
+  uint32_t find( sprice_t const price, bool *found ) const {
+    uint32_t const upper = m_capacity - m_gap_end;
+    uint32_t above = count_above( m_prices + m_gap_end, upper, price );
+    if ( above == upper ) above += count_above( m_prices, m_gap, price );
+    uint32_t const idx = size() - above;
+    *found = idx && price == m_prices[at( idx - 1 )];
+    return *found ? idx - 1 : idx;
+  }
+  void insert( uint32_t const i, sprice_t const price, qty_t const qty ) {
+    if ( m_gap == m_gap_end ) grow();
+    move_gap( i );
+    m_prices[m_gap] = price;
+    m_qtys[m_gap] = qty;
+    ++m_gap;
+  }
+  void erase( uint32_t const i ) {
+    move_gap( i + 1 );
+    --m_gap;
+  }
+  // keeps the capacity
+  void clear() {
+    m_gap = 0;
+    m_gap_end = m_capacity;
+  }
+  void swap( gap_levels& o ) {
+    std::swap( m_prices, o.m_prices );
+    std::swap( m_qtys, o.m_qtys );
+    std::swap( m_capacity, o.m_capacity );
+    std::swap( m_gap, o.m_gap );
+    std::swap( m_gap_end, o.m_gap_end );
+  }
+
+ private:
+  uint32_t at( uint32_t const i ) const { return i < m_gap ? i : i + ( m_gap_end - m_gap ); }
+
+  // how many of the n ascending prices at p are above price, counted
+  // down from the end
+  static uint32_t count_above( sprice_t const *p, uint32_t const n, sprice_t const price ) {
+    uint32_t i = n;
+#ifdef __AVX2__
+    __m256i const key = _mm256_set1_epi32( price );
+    while ( i >= 8 ) {
+      __m256i const v = _mm256_loadu_si256( (__m256i const *)( p + i - 8 ) );
+      uint32_t const gt = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( v, key ) ) );
+      if ( 0xff != gt ) return n - i + __builtin_popcount( gt );
+      i -= 8;
+    }
+#endif
+    while ( i && p[i - 1] > price ) --i;
+    return n - i;
+  }
+
+  // moves the gap to start at level i, copying the levels in between
+  // across it
+  void move_gap( uint32_t const i ) {
+    uint32_t const len = m_gap_end - m_gap;
+    if ( i < m_gap ) {
+      uint32_t const n = m_gap - i;
+      std::memmove( m_prices + i + len, m_prices + i, n * sizeof( sprice_t ) );
+      std::memmove( m_qtys + i + len, m_qtys + i, n * sizeof( qty_t ) );
+    } else if ( i > m_gap ) {
+      uint32_t const n = i - m_gap;
+      std::memmove( m_prices + m_gap, m_prices + m_gap_end, n * sizeof( sprice_t ) );
+      std::memmove( m_qtys + m_gap, m_qtys + m_gap_end, n * sizeof( qty_t ) );
+    }
+    m_gap = i;
+    m_gap_end = i + len;
+  }
+
+  // doubles the capacity, widening the gap where it is
+  __attribute__((__noinline__)) void grow() {
+    uint32_t const capacity = std::max( MIN_CAPACITY, 2 * m_capacity );
+    uint32_t const upper = m_capacity - m_gap_end;
+    void *block = std::malloc( capacity * ( sizeof( sprice_t ) + sizeof( qty_t ) ) );
+    if ( !block ) throw std::bad_alloc();
+    sprice_t *prices = static_cast<sprice_t *>( block );
+    qty_t *qtys = reinterpret_cast<qty_t *>( prices + capacity );
+    if ( m_prices ) {
+      std::memcpy( prices, m_prices, m_gap * sizeof( sprice_t ) );
+      std::memcpy( qtys, m_qtys, m_gap * sizeof( qty_t ) );
+      std::memcpy( prices + capacity - upper, m_prices + m_gap_end, upper * sizeof( sprice_t ) );
+      std::memcpy( qtys + capacity - upper, m_qtys + m_gap_end, upper * sizeof( qty_t ) );
+      std::free( m_prices );
+    }
+    m_prices = prices;
+    m_qtys = qtys;
+    m_gap_end = capacity - upper;
+    m_capacity = capacity;
+  }
+
+  sprice_t *m_prices = nullptr;  // the block; m_qtys is in it too
+  qty_t *m_qtys = nullptr;
+  uint32_t m_capacity = 0;
+  uint32_t m_gap = 0;
+  uint32_t m_gap_end = 0;
+};
+
+template<TRACE trace = TRACE::DISABLED>
+class order_book_gap : public order_book<order_book_gap<trace>, order_price_t, trace>
+{
+public:
+  using base = order_book<order_book_gap<trace>, order_price_t, trace>;
+  using shared_t = typename base::shared_t;
+  gap_levels m_bids;
+  gap_levels m_asks;
+  bool check_order_bid( shared_t&, const order_price_t *order ) const {
+    return is_bid( order->m_price );
+  }
+  sprice_t order_price( shared_t&, const order_price_t *order ) const {
+    return order->m_price;
+  }
+
+#if CROSS_CHECK
+  template<class ref_book_t, class ref_shared_t>
+  void crosscheck( shared_t&, const ref_book_t& book, ref_shared_t& ref_levels, order_id_t oid, bool is_bid ) {
+    const auto& ref_side = is_bid ? book.m_bids : book.m_asks;
+    const gap_levels& our_side = is_bid ? m_bids : m_asks;
+    assert( ref_side.size() == our_side.size() );
+    for ( uint32_t i = 0; i < our_side.size(); i++ ) {
+      assert( ref_side[i].m_price == our_side.price( i ) );
+      assert( ref_levels[ref_side[i].m_ptr].m_qty == our_side.qty( i ) );
+    }
+  }
+#endif
+  void clear( shared_t& ) {
+    m_bids.clear();
+    m_asks.clear();
+  }
+  void swap( order_book_gap& o ) {
+    m_bids.swap( o.m_bids );
+    m_asks.swap( o.m_asks );
+  }
+  // the inside of one side, or a zero level if the side is empty
+  level best( shared_t&, bool bid ) const {
+    const gap_levels& side = bid ? m_bids : m_asks;
+    if ( side.empty() ) return level( 0, qty_t(0) );
+    uint32_t const i = side.size() - 1;
+    return level( side.price( i ), side.qty( i ) );
+  }
+  // copies the n = min(k, depth) best levels of one side into
+  // prices/qtys[k-n, k), best last, and returns n
+  size_t top( shared_t&, bool bid, size_t k, sprice_t *prices, qty_t *qtys ) const {
+    const gap_levels& side = bid ? m_bids : m_asks;
+    uint32_t const n = uint32_t( std::min( k, size_t( side.size() ) ) );
+    for ( uint32_t j = 0; j < n; j++ ) {
+      prices[k - n + j] = side.price( side.size() - n + j );
+      qtys[k - n + j] = side.qty( side.size() - n + j );
+    }
+    return n;
+  }
+  void ADD_ORDER(shared_t&, order_price_t *, sprice_t const price, qty_t const qty)
+  {
+    gap_levels& side = is_bid(price) ? m_bids : m_asks;
+    bool found;
+    uint32_t const idx = side.find( price, &found );
+    if (found) {
+      side.qty( idx ) += qty;
+    } else {
+      side.insert( idx, price, qty );
+    }
+  }
+  // As in soa_price: a change of quantity, or a move of a level that
+  // holds only this order to a price between its neighbours, is written
+  // in place; anything else is a delete at that index and an add, which
+  // find the gap already there when the new price is close.
+  void REPLACE_ORDER(shared_t& shared, order_price_t *order, sprice_t const price, qty_t const qty)
+  {
+    gap_levels& side = is_bid(price) ? m_bids : m_asks;
+    bool found;
+    uint32_t const idx = side.find( order->m_price, &found );
+    assert( found );
+    if (order->m_price == price) {
+      side.qty( idx ) = side.qty( idx ) - order->m_qty + qty;
+    } else if (side.qty( idx ) == order->m_qty &&
+               (0 == idx || side.price( idx - 1 ) < price) &&
+               (idx + 1 == side.size() || side.price( idx + 1 ) > price)) {
+      side.set_price( idx, price );
+      side.qty( idx ) = qty;
+    } else {
+      // the delete half, without searching again
+      side.qty( idx ) -= order->m_qty;
+      if (qty_t(0) == side.qty( idx )) side.erase( idx );
+      order->m_price = price;
+      order->m_qty = qty;
+      ADD_ORDER(shared, order, price, qty);
+    }
+    order->m_price = price;
+    order->m_qty = qty;
+  }
+  // shared between cancel(aka partial cancel aka reduce) and execute
+  void REDUCE_ORDER(shared_t&, order_price_t *order, qty_t const qty)
+  {
+    gap_levels& side = is_bid(order->m_price) ? m_bids : m_asks;
+    bool found;
+    uint32_t const idx = side.find( order->m_price, &found );
+    assert( found );
+    side.qty( idx ) -= qty;
+    order->m_qty -= qty;
+  }
+  // shared between delete and execute
+  void DELETE_ORDER(shared_t&, order_price_t *order)
+  {
+    gap_levels& side = is_bid(order->m_price) ? m_bids : m_asks;
+    bool found;
+    uint32_t const idx = side.find( order->m_price, &found );
+    assert( found );
+    side.qty( idx ) -= order->m_qty;
+    if (qty_t(0) == side.qty( idx )) side.erase( idx );
+  }
+};
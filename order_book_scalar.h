@@ -3,15 +3,49 @@ class order_book_scalar : public order_book<order_book_scalar<trace>, order_leve
 {
 public:
   using base = order_book<order_book_scalar<trace>, order_level_t, trace>;
-  using sorted_levels_t = std::vector<price_level_indirect>;
+  // each side keeps its first 14 levels in two cache lines of the book
+  static constexpr size_t LEVEL_BYTES = 128;
+  using sorted_levels_t = level_array<price_level_indirect, LEVEL_BYTES>;
   sorted_levels_t m_bids;
   sorted_levels_t m_asks;
   using level_vector = pool<level, level_id_t, base::NUM_LEVELS>;
-  static inline level_vector s_levels;
-  bool check_order_bid ( const order_level_t *order ) const {
-    return s_levels[ order->level_idx ].m_price > 0;
+  using shared_t = level_vector;
+  static constexpr bool IS_REFERENCE = true;
+  bool check_order_bid ( level_vector& levels, const order_level_t *order ) const {
+    return levels[ order->level_idx ].m_price > 0;
   }
-  void ADD_ORDER(order_level_t *order, sprice_t const price, qty_t const qty)
+  sprice_t order_price ( level_vector& levels, const order_level_t *order ) const {
+    return levels[ order->level_idx ].m_price;
+  }
+  void clear( level_vector& ) {
+    m_bids.clear();
+    m_asks.clear();
+  }
+  void swap( order_book_scalar& o ) {
+    m_bids.swap( o.m_bids );
+    m_asks.swap( o.m_asks );
+  }
+  // the inside of one side, or a zero level if the side is empty
+  level best( level_vector& levels, bool bid ) const {
+    const sorted_levels_t& side = bid ? m_bids : m_asks;
+    if ( side.empty() ) return level( 0, qty_t(0) );
+    return level( side.back().m_price, levels[side.back().m_ptr].m_qty );
+  }
+  // copies the n = min(k, depth) best levels of one side into
+  // prices/qtys[k-n, k), best last, and returns n
+  size_t top( level_vector& levels, bool bid, size_t k, sprice_t *prices, qty_t *qtys ) const {
+    const sorted_levels_t& side = bid ? m_bids : m_asks;
+    size_t const n = std::min( k, side.size() );
+    for ( size_t i = 0; i < n; i++ ) {
+      const price_level_indirect& l = side[side.size() - n + i];
+      prices[k - n + i] = l.m_price;
+      qtys[k - n + i] = levels[l.m_ptr].m_qty;
+    }
+    return n;
+  }
+  // Returns the number of levels it walked past from the inside, which
+  // is what an add costs here (see order_book_adaptive).
+  size_t ADD_ORDER(level_vector& levels, order_level_t *order, sprice_t const price, qty_t const qty)
   {
     sorted_levels_t *sorted_levels = is_bid(price) ? &m_bids : &m_asks;
     // search descending for the price
@@ -28,40 +62,77 @@ public:
         break;
       }
     }
+    size_t const walked = sorted_levels->end() - insertion_point - 1;
     if (!found) {
-      order->level_idx = s_levels.alloc();
-      s_levels[order->level_idx].m_qty = qty_t(0);
-      s_levels[order->level_idx].m_price = price;
+      order->level_idx = levels.alloc();
+      levels[order->level_idx].m_qty = qty_t(0);
+      levels[order->level_idx].m_price = price;
       price_level_indirect const px(price, order->level_idx);
       ++insertion_point;
       sorted_levels->insert(insertion_point, px);
     }
-    s_levels[order->level_idx].m_qty += qty;
+    levels[order->level_idx].m_qty += qty;
+    return walked;
+  }
+  // A replace stays on its side. The order's level is known, so only
+  // when the order was alone there does the level have to be found in
+  // the sorted side, and then both prices are found in one walk (see
+  // find_replace) and the level is repriced in place or merged.
+  void REPLACE_ORDER(level_vector& levels, order_level_t *order, sprice_t const price, qty_t const qty)
+  {
+    level_id_t const old_idx = order->level_idx;
+    if (levels[old_idx].m_price == price) {
+      levels[old_idx].m_qty = levels[old_idx].m_qty - order->m_qty + qty;
+    } else if (levels[old_idx].m_qty != order->m_qty) {
+      levels[old_idx].m_qty -= order->m_qty;
+      ADD_ORDER(levels, order, price, qty);
+    } else {
+      sorted_levels_t& side = is_bid(price) ? m_bids : m_asks;
+      replace_pos const r = find_replace([&](size_t i) { return side[i].m_price; }, side.size(),
+                                         levels[old_idx].m_price, price);
+      if (r.exists) {
+        order->level_idx = side[r.to].m_ptr;
+        levels[order->level_idx].m_qty += qty;
+        side.erase(side.begin() + r.from);
+        levels.free(old_idx);
+      } else {
+        size_t const to = move_index(r);
+        slide(side.begin(), r.from, to);
+        side[to].m_price = price;
+        levels[old_idx].m_price = price;
+        levels[old_idx].m_qty = qty;
+      }
+    }
+    order->m_qty = qty;
   }
   // shared between cancel(aka partial cancel aka reduce) and execute
-  void REDUCE_ORDER(order_level_t *order, qty_t const qty)
+  void REDUCE_ORDER(level_vector& levels, order_level_t *order, qty_t const qty)
   {
     // subtract the reduced quantity from both the level and the order
-    s_levels[order->level_idx].m_qty -= qty;
+    levels[order->level_idx].m_qty -= qty;
     order->m_qty -= qty;
   }
-  // shared between delete and execute
-  void DELETE_ORDER(order_level_t *order)
+  // shared between delete and execute. Returns the number of levels it
+  // walked past, as ADD_ORDER does
+  size_t DELETE_ORDER(level_vector& levels, order_level_t *order)
   {
-    assert(s_levels[order->level_idx].m_qty >= order->m_qty);
-    s_levels[order->level_idx].m_qty -= order->m_qty;
-    if (qty_t(0) == s_levels[order->level_idx].m_qty) {
-      sprice_t price = s_levels[order->level_idx].m_price;
+    assert(levels[order->level_idx].m_qty >= order->m_qty);
+    levels[order->level_idx].m_qty -= order->m_qty;
+    size_t walked = 0;
+    if (qty_t(0) == levels[order->level_idx].m_qty) {
+      sprice_t price = levels[order->level_idx].m_price;
       sorted_levels_t *sorted_levels = is_bid(price) ? &m_bids : &m_asks;
       auto it = sorted_levels->end();
       while (it-- != sorted_levels->begin()) {
         if (it->m_price == price) {
+          walked = sorted_levels->end() - it - 1;
           sorted_levels->erase(it);
           break;
         }
       }
-      s_levels.free(order->level_idx);
+      levels.free(order->level_idx);
     }
+    return walked;
   }
 };
 
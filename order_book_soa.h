@@ -41,32 +41,69 @@ class order_book_soa : public order_book<order_book_soa<trace>, order_level_t, t
 {
 public:
   using base = order_book<order_book_soa<trace>, order_level_t, trace>;
-  using sorted_prices_t = std::vector<sprice_t>;
-  using sorted_levels_t = std::vector<level_id_t>;
+  // each array keeps its first 12 entries in a cache line of the book
+  static constexpr size_t LEVEL_BYTES = 64;
+  using sorted_prices_t = level_array<sprice_t, LEVEL_BYTES>;
+  using sorted_levels_t = level_array<level_id_t, LEVEL_BYTES>;
   sorted_prices_t m_bid_prices;
   sorted_prices_t m_ask_prices;
   sorted_levels_t m_bid_levels;
   sorted_levels_t m_ask_levels;
   using level_vector = pool<level, level_id_t, base::NUM_LEVELS>;
-  static inline level_vector s_levels;
+  using shared_t = level_vector;
 #if CROSS_CHECK
-  void crosscheck( size_t book_idx, bool is_bid ) {
-    const auto& book = order_book_scalar<TRACE::DISABLED>::s_books[book_idx];
-    auto ref_side = is_bid ? book.m_bids : book.m_asks;
-    auto our_levels = is_bid ? m_bid_levels : m_ask_levels;
-    auto our_prices = is_bid ? m_bid_prices : m_ask_prices;
+  template<class ref_book_t, class ref_shared_t>
+  void crosscheck( level_vector& levels, const ref_book_t& book, ref_shared_t& ref_levels, order_id_t oid, bool is_bid ) {
+    const auto& ref_side = is_bid ? book.m_bids : book.m_asks;
+    const auto& our_levels = is_bid ? m_bid_levels : m_ask_levels;
+    const auto& our_prices = is_bid ? m_bid_prices : m_ask_prices;
     assert( ref_side.size() == our_prices.size() );
     assert( ref_side.size() == our_levels.size() );
     for ( size_t i = 0; i < our_prices.size(); i++ ) {
       assert( ref_side[i].m_price == our_prices[i] );
-      assert( order_book_scalar<TRACE::DISABLED>::s_levels[ref_side[i].m_ptr].m_qty == s_levels[our_levels[i]].m_qty );
+      assert( ref_levels[ref_side[i].m_ptr].m_qty == levels[our_levels[i]].m_qty );
     }
   }
 #endif
-  bool check_order_bid ( const order_level_t *order ) const {
-    return s_levels[ order->level_idx ].m_price > 0;
+  bool check_order_bid ( level_vector& levels, const order_level_t *order ) const {
+    return levels[ order->level_idx ].m_price > 0;
   }
-  void ADD_ORDER(order_level_t *order, sprice_t const price, qty_t const qty)
+  sprice_t order_price ( level_vector& levels, const order_level_t *order ) const {
+    return levels[ order->level_idx ].m_price;
+  }
+  void clear( level_vector& ) {
+    m_bid_prices.clear();
+    m_ask_prices.clear();
+    m_bid_levels.clear();
+    m_ask_levels.clear();
+  }
+  void swap( order_book_soa& o ) {
+    m_bid_prices.swap( o.m_bid_prices );
+    m_ask_prices.swap( o.m_ask_prices );
+    m_bid_levels.swap( o.m_bid_levels );
+    m_ask_levels.swap( o.m_ask_levels );
+  }
+  // the inside of one side, or a zero level if the side is empty
+  level best( level_vector& levels, bool bid ) const {
+    const sorted_prices_t& prices = bid ? m_bid_prices : m_ask_prices;
+    const sorted_levels_t& levels_idx = bid ? m_bid_levels : m_ask_levels;
+    if ( prices.empty() ) return level( 0, qty_t(0) );
+    return level( prices.back(), levels[levels_idx.back()].m_qty );
+  }
+  // copies the n = min(k, depth) best levels of one side into
+  // prices/qtys[k-n, k), best last, and returns n
+  size_t top( level_vector& levels, bool bid, size_t k, sprice_t *prices, qty_t *qtys ) const {
+    const sorted_prices_t& side_prices = bid ? m_bid_prices : m_ask_prices;
+    const sorted_levels_t& levels_idx = bid ? m_bid_levels : m_ask_levels;
+    size_t const n = std::min( k, side_prices.size() );
+    size_t const first = side_prices.size() - n;
+    std::copy( side_prices.begin() + first, side_prices.end(), prices + k - n );
+    for ( size_t i = 0; i < n; i++ ) {
+      qtys[k - n + i] = levels[levels_idx[first + i]].m_qty;
+    }
+    return n;
+  }
+  void ADD_ORDER(level_vector& levels, order_level_t *order, sprice_t const price, qty_t const qty)
   {
     sorted_prices_t& sorted_prices = is_bid(price) ? m_bid_prices : m_ask_prices;
     sorted_levels_t& sorted_levels = is_bid(price) ? m_bid_levels : m_ask_levels;
@@ -86,39 +123,64 @@ public:
       }
     }
     if (!found) {
-      order->level_idx = s_levels.alloc();
-      s_levels[order->level_idx].m_qty = qty_t(0);
-      s_levels[order->level_idx].m_price = price;
+      order->level_idx = levels.alloc();
+      levels[order->level_idx].m_qty = qty_t(0);
+      levels[order->level_idx].m_price = price;
       ++insertion_point;
       auto idx = insertion_point - sorted_prices.begin();
       sorted_prices.insert(insertion_point, price);
       sorted_levels.insert(sorted_levels.begin()+idx, order->level_idx );
     }
-    s_levels[order->level_idx].m_qty += qty;
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::add_order( order->oid, order->book_idx, price, qty );
-    crosscheck( order->book_idx, is_bid(price) );
-#endif
+    levels[order->level_idx].m_qty += qty;
+  }
+  // A replace stays on its side. The order's level is known, so only
+  // when the order was alone there does the level have to be found in
+  // the sorted side, and then both prices are found in one walk (see
+  // find_replace) and the level is repriced in place or merged.
+  void REPLACE_ORDER(level_vector& levels, order_level_t *order, sprice_t const price, qty_t const qty)
+  {
+    level_id_t const old_idx = order->level_idx;
+    if (levels[old_idx].m_price == price) {
+      levels[old_idx].m_qty = levels[old_idx].m_qty - order->m_qty + qty;
+    } else if (levels[old_idx].m_qty != order->m_qty) {
+      levels[old_idx].m_qty -= order->m_qty;
+      ADD_ORDER(levels, order, price, qty);
+    } else {
+      sorted_prices_t& sorted_prices = is_bid(price) ? m_bid_prices : m_ask_prices;
+      sorted_levels_t& sorted_levels = is_bid(price) ? m_bid_levels : m_ask_levels;
+      replace_pos const r = find_replace([&](size_t i) { return sorted_prices[i]; }, sorted_prices.size(),
+                                         levels[old_idx].m_price, price);
+      if (r.exists) {
+        order->level_idx = sorted_levels[r.to];
+        levels[order->level_idx].m_qty += qty;
+        sorted_prices.erase(sorted_prices.begin() + r.from);
+        sorted_levels.erase(sorted_levels.begin() + r.from);
+        levels.free(old_idx);
+      } else {
+        size_t const to = move_index(r);
+        slide(sorted_prices.begin(), r.from, to);
+        slide(sorted_levels.begin(), r.from, to);
+        sorted_prices[to] = price;
+        levels[old_idx].m_price = price;
+        levels[old_idx].m_qty = qty;
+      }
+    }
+    order->m_qty = qty;
   }
   // shared between cancel(aka partial cancel aka reduce) and execute
-  void REDUCE_ORDER(order_level_t *order, qty_t const qty)
+  void REDUCE_ORDER(level_vector& levels, order_level_t *order, qty_t const qty)
   {
     // subtract the reduced quantity from both the level and the order
-    s_levels[order->level_idx].m_qty -= qty;
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::cancel_order( order->oid, qty );
-    crosscheck( order->book_idx, is_bid( s_levels[order->level_idx].m_price ) );
-#endif
-    // this got done by reference_.REDUCE_ORDER in the CROSS_CHECK case
+    levels[order->level_idx].m_qty -= qty;
     order->m_qty -= qty;
   }
   // shared between delete and execute
-  void DELETE_ORDER(order_level_t *order)
+  void DELETE_ORDER(level_vector& levels, order_level_t *order)
   {
-    assert(s_levels[order->level_idx].m_qty >= order->m_qty);
-    s_levels[order->level_idx].m_qty -= order->m_qty;
-    if (qty_t(0) == s_levels[order->level_idx].m_qty) {
-      sprice_t price = s_levels[order->level_idx].m_price;
+    assert(levels[order->level_idx].m_qty >= order->m_qty);
+    levels[order->level_idx].m_qty -= order->m_qty;
+    if (qty_t(0) == levels[order->level_idx].m_qty) {
+      sprice_t price = levels[order->level_idx].m_price;
       sorted_prices_t& sorted_prices = is_bid(price) ? m_bid_prices : m_ask_prices;
       sorted_levels_t& sorted_levels = is_bid(price) ? m_bid_levels : m_ask_levels;
       auto it = sorted_prices.end();
@@ -130,12 +192,7 @@ public:
           break;
         }
       }
-      s_levels.free(order->level_idx);
+      levels.free(order->level_idx);
     }
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::delete_order( order->oid );
-    crosscheck( order->book_idx, is_bid( s_levels[order->level_idx].m_price ) );
-#endif
   }
 };
-
@@ -66,38 +66,48 @@ _mm256_srl_4b_si256( __m256i m )
 , 0, 1)), m, N );
 }
 
+//
+// Finds q in an ascending, sentinel-terminated array, searching down from
+// the block with the first sentinel, where the best prices are. Returns
+// true with the block of q, or false with the block q is to be inserted
+// in: the one with the first value greater than q. start8 is a hint
+// that is tried first.
+//
 template<typename T, typename vector>
 __attribute__((__always_inline__))
 bool
-Search_avx2( int *p, const vector& v, const T& q, __m256i& v_values, __m256i& v_cmpeq, __m256i& v_cmpgt, int start8 )
+Search_avx2( int *p, const vector& v, const T& q, __m256i& v_values, __m256i& v_cmpeq, int start8 )
 {
-  int cmpgt;
-
   __m256i *p_v = (__m256i *) v.data();
   __m256i v_q = _mm256_set1_epi32( int(q) );
-  if ( start8 < v.getN8() ) {
+  int const last8 = v.getN8() - 1;
+  // the top block is searched first anyway
+  if ( start8 < last8 ) {
     v_values = _mm256_load_si256( p_v+start8 );
     v_cmpeq = _mm256_cmpeq_epi32( v_values, v_q );
-    v_cmpgt = _mm256_cmpgt_epi32( v_values, v_q );
     int cmpeq = _mm256_movemask_ps( _mm256_castsi256_ps( v_cmpeq ) );
     if ( cmpeq ) {
         *p = start8;
         return true;
     }
   }
-  do {
-    v_values = _mm256_load_si256( p_v );
+  for ( int i8 = last8; i8 >= 0; i8-- ) {
+    v_values = _mm256_load_si256( p_v+i8 );
     v_cmpeq = _mm256_cmpeq_epi32( v_values, v_q );
-    v_cmpgt = _mm256_cmpgt_epi32( v_values, v_q );
     int cmpeq = _mm256_movemask_ps( _mm256_castsi256_ps( v_cmpeq ) );
     if ( cmpeq ) {
-        *p = (p_v-((__m256i *) v.data()));
+        *p = i8;
         return true;
     }
-    cmpgt = _mm256_movemask_ps( _mm256_castsi256_ps( v_cmpgt ) );
-    p_v += 1;
-  } while ( 0==cmpgt );
-  *p = (p_v-((__m256i *) v.data()))-1;
+    int cmplt = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( v_q, v_values ) ) );
+    if ( cmplt ) {
+        // the blocks above were all greater, so if this one has no
+        // greater value q goes first in the next one
+        *p = 0xff != cmplt ? i8 : i8+1;
+        return false;
+    }
+  }
+  *p = 0;
   return false;
 }
 
@@ -105,13 +115,15 @@ template<TRACE trace = TRACE::DISABLED>
 class order_book_soa_avx2 : public order_book<order_book_soa_avx2<trace>, order_price_t, trace>
 {
 public:
-  static constexpr int32_t price_sentinel = int32_t(1<<30);
+  using base = order_book<order_book_soa_avx2<trace>, order_price_t, trace>;
+  using shared_t = typename base::shared_t;
+  static constexpr int32_t price_sentinel = std::numeric_limits<int32_t>::max();
 
   using sorted_prices_t = AlignedVector<sprice_t, Alignment::AVX2, TARGET_ISA::AVX2>;
   using sorted_qtys_t = AlignedVector<qty_t, Alignment::AVX2, TARGET_ISA::AVX2>;
 
   order_book_soa_avx2():
-    lasti8(0),
+    lasti8{0, 0},
     m_bid_prices(sprice_t(price_sentinel)),
     m_ask_prices(sprice_t(price_sentinel)),
     m_bid_qtys(qty_t(0)),
@@ -122,15 +134,18 @@ public:
   sorted_prices_t m_ask_prices;
   sorted_qtys_t m_bid_qtys;
   sorted_qtys_t m_ask_qtys;
-  int lasti8;
-  bool check_order_bid( const order_price_t *order ) const {
+  int lasti8[2];  // the block of the last add, bid and ask
+  bool check_order_bid( shared_t&, const order_price_t *order ) const {
     return is_bid( order->m_price );
   }
+  sprice_t order_price( shared_t&, const order_price_t *order ) const {
+    return order->m_price;
+  }
 
 #if CROSS_CHECK
-  void crosscheck( order_id_t oid, size_t book_idx, bool is_bid ) {
-    const auto& book = order_book_scalar<TRACE::DISABLED>::s_books[book_idx];
-    auto ref_side = is_bid ? book.m_bids : book.m_asks;
+  template<class ref_book_t, class ref_shared_t>
+  void crosscheck( shared_t&, const ref_book_t& book, ref_shared_t& ref_levels, order_id_t oid, bool is_bid ) {
+    const auto& ref_side = is_bid ? book.m_bids : book.m_asks;
     const auto& our_prices = is_bid ? m_bid_prices : m_ask_prices;
     const auto& our_qtys = is_bid ? m_bid_qtys : m_ask_qtys;
     auto compare = [&]() -> bool {
@@ -138,7 +153,7 @@ public:
         if( ref_side[i].m_price != our_prices[i] ) {
           return false;
         }
-        if( order_book_scalar<TRACE::DISABLED>::s_levels[ref_side[i].m_ptr].m_qty != our_qtys[i] ) {
+        if( ref_levels[ref_side[i].m_ptr].m_qty != our_qtys[i] ) {
           return false;
         }
       }
@@ -148,7 +163,7 @@ public:
       printf("CROSSCHECK FAILED on order %u side %s\n", uint32_t(oid), is_bid ? "BID" : "ASK" );
       printf( "Reference: ");
       for ( size_t i = 0; i < ref_side.size(); i++ ) {
-        printf( "(%d, %d) ", ref_side[i].m_price, order_book_scalar<TRACE::DISABLED>::s_levels[ref_side[i].m_ptr].m_qty );
+        printf( "(%d, %d) ", ref_side[i].m_price, ref_levels[ref_side[i].m_ptr].m_qty );
       }
       printf( "\nOur book: ");
       for ( size_t i = 0; our_prices[i] != price_sentinel; i++ ) {
@@ -159,7 +174,59 @@ public:
     }
   }
 #endif
-  void ADD_ORDER(order_price_t *order, sprice_t const price, qty_t const qty)
+  // the used blocks are refilled with sentinels and the sides shrink to
+  // one block, as in a new book
+  void clear( shared_t& ) {
+    clear_side( m_bid_prices, m_bid_qtys );
+    clear_side( m_ask_prices, m_ask_qtys );
+    lasti8[0] = lasti8[1] = 0;
+  }
+  void swap( order_book_soa_avx2& o ) {
+    std::swap( m_bid_prices, o.m_bid_prices );
+    std::swap( m_ask_prices, o.m_ask_prices );
+    std::swap( m_bid_qtys, o.m_bid_qtys );
+    std::swap( m_ask_qtys, o.m_ask_qtys );
+    std::swap( lasti8, o.lasti8 );
+  }
+  static void clear_side( sorted_prices_t& prices, sorted_qtys_t& qtys ) {
+    size_t const n = size_t( prices.getN8() ) * 8;
+    std::fill( prices.data(), prices.data() + n, sprice_t( price_sentinel ) );
+    std::fill( qtys.data(), qtys.data() + n, qty_t(0) );
+    prices.setN8( 1 );
+    qtys.setN8( 1 );
+  }
+  // the inside of one side, or a zero level if the side is empty. The
+  // best price is the last one before the first sentinel, which is
+  // always in the last block.
+  level best( shared_t&, bool bid ) const {
+    const sorted_prices_t& prices = bid ? m_bid_prices : m_ask_prices;
+    const sorted_qtys_t& qtys = bid ? m_bid_qtys : m_ask_qtys;
+    int const last8 = prices.getN8() - 1;
+    __m256i v_prices = _mm256_load_si256( (__m256i const *) prices.data() + last8 );
+    int const sentinels = _mm256_movemask_ps( _mm256_castsi256_ps(
+        _mm256_cmpeq_epi32( v_prices, _mm256_set1_epi32( price_sentinel ) ) ) );
+    assert( sentinels );
+    int const i = last8 * 8 + __builtin_ctz( sentinels ) - 1;
+    if ( i < 0 ) return level( 0, qty_t(0) );
+    return level( prices[i], qtys[i] );
+  }
+  // copies the n = min(k, depth) best levels of one side into
+  // prices/qtys[k-n, k), best last, and returns n
+  size_t top( shared_t&, bool bid, size_t k, sprice_t *out_prices, qty_t *out_qtys ) const {
+    const sorted_prices_t& prices = bid ? m_bid_prices : m_ask_prices;
+    const sorted_qtys_t& qtys = bid ? m_bid_qtys : m_ask_qtys;
+    int const last8 = prices.getN8() - 1;
+    __m256i v_prices = _mm256_load_si256( (__m256i const *) prices.data() + last8 );
+    int const sentinels = _mm256_movemask_ps( _mm256_castsi256_ps(
+        _mm256_cmpeq_epi32( v_prices, _mm256_set1_epi32( price_sentinel ) ) ) );
+    assert( sentinels );
+    size_t const depth = size_t( last8 * 8 + __builtin_ctz( sentinels ) );
+    size_t const n = std::min( k, depth );
+    std::copy( prices.data() + depth - n, prices.data() + depth, out_prices + k - n );
+    std::copy( qtys.data() + depth - n, qtys.data() + depth, out_qtys + k - n );
+    return n;
+  }
+  void ADD_ORDER(shared_t&, order_price_t *, sprice_t const price, qty_t const qty)
   {
     sorted_prices_t& sorted_prices = is_bid(price) ? m_bid_prices : m_ask_prices;
     sorted_qtys_t& sorted_qtys = is_bid(price) ? m_bid_qtys : m_ask_qtys;
@@ -167,8 +234,9 @@ public:
     int i8;
     __m256i v_prices, v_cmpeq, v_cmpgt;
 
-    bool soa_found = Search_avx2( &i8, sorted_prices, price, v_prices, v_cmpeq, v_cmpgt, lasti8 );
-    lasti8 = i8;
+    int& last = lasti8[is_bid(price) ? 0 : 1];
+    bool soa_found = Search_avx2( &i8, sorted_prices, price, v_prices, v_cmpeq, last );
+    last = i8;
     if ( soa_found ) {
         __m256i v_qtys = _mm256_load_si256( (__m256i *) sorted_qtys.data() + i8 );
                 v_qtys = _mm256_add_epi32( v_qtys, _mm256_and_si256( v_cmpeq, _mm256_set1_epi32( int32_t(qty) ) ) );
@@ -221,61 +289,68 @@ public:
         sorted_prices.setN8(i8);
         sorted_qtys.setN8(i8);
     }
-
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::add_order( order->oid, order->book_idx, price, qty );
-    crosscheck( order->oid, order->book_idx, is_bid(price) );
-#endif
   }
 
+  // Replaces at a new price are a delete and an add in the engine (see
+  // REPLACE_PATH): finding the order's level first to move it in place
+  // would add a scan to every replace that moves, which is most of them,
+  // and doing the two here measured slower than the engine's. At the
+  // same price it is a change of quantity in the level's block, found
+  // with one search.
+  static constexpr REPLACE_PATH replace_path = REPLACE_PATH::SAME_PRICE_IN_BOOK;
+  void REPLACE_ORDER(shared_t& shared, order_price_t *order, sprice_t const price, qty_t const qty)
+  {
+    assert( order->m_price == price );
+    if ( qty > order->m_qty ) {
+      // the level exists, so this only adds to it
+      ADD_ORDER( shared, order, price, qty - order->m_qty );
+    } else {
+      REDUCE_ORDER( shared, order, order->m_qty - qty );
+    }
+    order->m_qty = qty;
+  }
   // shared between cancel(aka partial cancel aka reduce) and execute
-  void REDUCE_ORDER(order_price_t *order, qty_t const qty)
+  void REDUCE_ORDER(shared_t&, order_price_t *order, qty_t const qty)
   {
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::cancel_order( order->oid, qty );
-#endif
     sorted_prices_t& sorted_prices = is_bid(order->m_price) ? m_bid_prices : m_ask_prices;
     sorted_qtys_t& sorted_qtys = is_bid(order->m_price) ? m_bid_qtys : m_ask_qtys;
 
+    // down from the inside, the level is there
     __m256i v_prices;
     __m256i v_cmpeq;
     int cmpeq;
-    __m256i *p = (__m256i *) sorted_prices.data();
+    __m256i *p = (__m256i *) sorted_prices.data() + sorted_prices.getN8();
     do {
-      v_prices = *p++;
+      v_prices = *--p;
       v_cmpeq = _mm256_cmpeq_epi32( v_prices, _mm256_set1_epi32( order->m_price ) );
       cmpeq = _mm256_movemask_ps( _mm256_castsi256_ps( v_cmpeq ) );
     } while ( ! cmpeq );
-    size_t i8 = (p - (__m256i *) sorted_prices.data()) - 1;
+    size_t i8 = p - (__m256i *) sorted_prices.data();
     __m256i v_qtys = _mm256_load_si256( (__m256i *) sorted_qtys.data() + i8 );
     __m256i v_masked_order = _mm256_and_si256( v_cmpeq, _mm256_set1_epi32( int32_t(qty) ) );
             v_qtys = _mm256_sub_epi32( v_qtys, v_masked_order );
       _mm256_store_si256( (__m256i *) sorted_qtys.data() + i8, v_qtys );
-
-#if CROSS_CHECK
-    //order_book_scalar::cancel_order( order->oid, qty );
-    crosscheck( order->oid, order->book_idx, is_bid( order->m_price ) );
-#endif
     order->m_qty -= qty;
   }
   // shared between delete and execute
-  void DELETE_ORDER(order_price_t *order)
+  void DELETE_ORDER(shared_t&, order_price_t *order)
   {
     sorted_prices_t& sorted_prices = is_bid(order->m_price) ? m_bid_prices : m_ask_prices;
     sorted_qtys_t& sorted_qtys = is_bid(order->m_price) ? m_bid_qtys : m_ask_qtys;
 
+    // down from the inside, the level is there
     __m256i v_prices;
     __m256i v_cmpeq;
     __m256i v_cmpgt;
     int cmpeq;
-    __m256i *p = (__m256i *) sorted_prices.data();
+    __m256i *p = (__m256i *) sorted_prices.data() + sorted_prices.getN8();
     do {
-      v_prices = *p++;
+      v_prices = *--p;
       v_cmpeq = _mm256_cmpeq_epi32( v_prices, _mm256_set1_epi32( order->m_price ) );
-      v_cmpgt = _mm256_cmpgt_epi32( v_prices, _mm256_set1_epi32( order->m_price ) );
       cmpeq = _mm256_movemask_ps( _mm256_castsi256_ps( v_cmpeq ) );
     } while ( ! cmpeq );
-    size_t i8 = (p - (__m256i *) sorted_prices.data()) - 1;
+    v_cmpgt = _mm256_cmpgt_epi32( v_prices, _mm256_set1_epi32( order->m_price ) );
+    size_t i8 = p - (__m256i *) sorted_prices.data();
     __m256i v_qtys = _mm256_load_si256( (__m256i *) sorted_qtys.data() + i8 );
     __m256i v_masked_order = _mm256_and_si256( v_cmpeq, _mm256_set1_epi32( int32_t(order->m_qty) ) );
             v_qtys = _mm256_sub_epi32( v_qtys, _mm256_and_si256( v_cmpeq, v_masked_order ) );
@@ -306,10 +381,17 @@ public:
         v_next_price = _mm256_load_si256( p_p+1 /*(__m256i *) sorted_prices.data() + i8 + 1*/ );
         v_next_qty = _mm256_load_si256( p_q+1 /*(__m256i *) sorted_qtys.data() + i8 + 1*/ );
       } while ( i8 < sorted_prices.getN8() );
+      // keep the first sentinel in the last block, so best() can find
+      // the inside without scanning
+      int const last8 = sorted_prices.getN8() - 1;
+      if ( last8 > 0 ) {
+        __m256i v_prev = _mm256_load_si256( (__m256i *) sorted_prices.data() + last8 - 1 );
+        if ( 0 != _mm256_movemask_ps( _mm256_castsi256_ps(
+                 _mm256_cmpeq_epi32( v_prev, _mm256_set1_epi32( price_sentinel ) ) ) ) ) {
+          sorted_prices.setN8( last8 );
+          sorted_qtys.setN8( last8 );
+        }
+      }
     }
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::delete_order( order->oid );
-    crosscheck( order->oid, order->book_idx, is_bid( order->m_price ) );
-#endif
   }
 };
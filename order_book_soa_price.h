@@ -4,32 +4,68 @@ template<TRACE trace = TRACE::DISABLED>
 class order_book_soa_price : public order_book<order_book_soa_price<trace>, order_price_t, trace>
 {
 public:
-  using sorted_prices_t = std::vector<sprice_t>;
-  using sorted_qtys_t = std::vector<qty_t>;
+  using base = order_book<order_book_soa_price<trace>, order_price_t, trace>;
+  using shared_t = typename base::shared_t;
+  // each array keeps its first 12 entries in a cache line of the book
+  static constexpr size_t LEVEL_BYTES = 64;
+  using sorted_prices_t = level_array<sprice_t, LEVEL_BYTES>;
+  using sorted_qtys_t = level_array<qty_t, LEVEL_BYTES>;
   sorted_prices_t m_bid_prices;
   sorted_prices_t m_ask_prices;
   sorted_qtys_t m_bid_qtys;
   sorted_qtys_t m_ask_qtys;
-  bool check_order_bid( const order_price_t *order ) const {
+  bool check_order_bid( shared_t&, const order_price_t *order ) const {
     return is_bid( order->m_price );
   }
+  sprice_t order_price( shared_t&, const order_price_t *order ) const {
+    return order->m_price;
+  }
 
 #if CROSS_CHECK
-  void crosscheck( size_t book_idx, bool is_bid ) {
-    const auto& book = order_book_scalar<TRACE::DISABLED>::s_books[book_idx];
-    auto ref_side = is_bid ? book.m_bids : book.m_asks;
-    auto our_prices = is_bid ? m_bid_prices : m_ask_prices;
-    auto our_qtys = is_bid ? m_bid_qtys : m_ask_qtys;
+  template<class ref_book_t, class ref_shared_t>
+  void crosscheck( shared_t&, const ref_book_t& book, ref_shared_t& ref_levels, order_id_t oid, bool is_bid ) {
+    const auto& ref_side = is_bid ? book.m_bids : book.m_asks;
+    const auto& our_prices = is_bid ? m_bid_prices : m_ask_prices;
+    const auto& our_qtys = is_bid ? m_bid_qtys : m_ask_qtys;
 
     assert( ref_side.size() == our_prices.size() );
     assert( ref_side.size() == our_qtys.size() );
     for ( size_t i = 0; i < our_prices.size(); i++ ) {
       assert( ref_side[i].m_price == our_prices[i] );
-      assert( order_book_scalar<TRACE::DISABLED>::s_levels[ref_side[i].m_ptr].m_qty == our_qtys[i] );
+      assert( ref_levels[ref_side[i].m_ptr].m_qty == our_qtys[i] );
     }
   }
 #endif
-  void ADD_ORDER(order_price_t *order, sprice_t const price, qty_t const qty)
+  void clear( shared_t& ) {
+    m_bid_prices.clear();
+    m_ask_prices.clear();
+    m_bid_qtys.clear();
+    m_ask_qtys.clear();
+  }
+  void swap( order_book_soa_price& o ) {
+    m_bid_prices.swap( o.m_bid_prices );
+    m_ask_prices.swap( o.m_ask_prices );
+    m_bid_qtys.swap( o.m_bid_qtys );
+    m_ask_qtys.swap( o.m_ask_qtys );
+  }
+  // the inside of one side, or a zero level if the side is empty
+  level best( shared_t&, bool bid ) const {
+    const sorted_prices_t& prices = bid ? m_bid_prices : m_ask_prices;
+    const sorted_qtys_t& qtys = bid ? m_bid_qtys : m_ask_qtys;
+    if ( prices.empty() ) return level( 0, qty_t(0) );
+    return level( prices.back(), qtys.back() );
+  }
+  // copies the n = min(k, depth) best levels of one side into
+  // prices/qtys[k-n, k), best last, and returns n
+  size_t top( shared_t&, bool bid, size_t k, sprice_t *prices, qty_t *qtys ) const {
+    const sorted_prices_t& side_prices = bid ? m_bid_prices : m_ask_prices;
+    const sorted_qtys_t& side_qtys = bid ? m_bid_qtys : m_ask_qtys;
+    size_t const n = std::min( k, side_prices.size() );
+    std::copy( side_prices.end() - n, side_prices.end(), prices + k - n );
+    std::copy( side_qtys.end() - n, side_qtys.end(), qtys + k - n );
+    return n;
+  }
+  void ADD_ORDER(shared_t&, order_price_t *order, sprice_t const price, qty_t const qty)
   {
     sorted_prices_t& sorted_prices = is_bid(price) ? m_bid_prices : m_ask_prices;
     sorted_qtys_t& sorted_qtys = is_bid(price) ? m_bid_qtys : m_ask_qtys;
@@ -57,13 +93,42 @@ public:
       sorted_prices.insert(insertion_point, price);
       sorted_qtys.insert(sorted_qtys.begin()+idx, qty );
     }
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::add_order( order->oid, order->book_idx, price, qty );
-    crosscheck( order->book_idx, is_bid(price) );
-#endif
+  }
+  // A replace stays on its side. The order's level is found once; a
+  // change of quantity, or a move of a level that holds only this order
+  // to a price between its neighbours (the usual one tick away), is then
+  // written in place. Anything else is a delete at that index and an add.
+  void REPLACE_ORDER(shared_t& shared, order_price_t *order, sprice_t const price, qty_t const qty)
+  {
+    sorted_prices_t& sorted_prices = is_bid(price) ? m_bid_prices : m_ask_prices;
+    sorted_qtys_t& sorted_qtys = is_bid(price) ? m_bid_qtys : m_ask_qtys;
+    sprice_t const old_price = order->m_price;
+    qty_t const old_qty = order->m_qty;
+    // the order is the new one from here on, as ADD_ORDER expects
+    order->m_price = price;
+    order->m_qty = qty;
+    auto it = std::find( sorted_prices.begin(), sorted_prices.end(), old_price );
+    assert( it != sorted_prices.end() );
+    auto idx = it - sorted_prices.begin();
+    if (old_price == price) {
+      sorted_qtys[idx] = sorted_qtys[idx] - old_qty + qty;
+    } else if (sorted_qtys[idx] == old_qty &&
+               (it == sorted_prices.begin() || *(it - 1) < price) &&
+               (it + 1 == sorted_prices.end() || *(it + 1) > price)) {
+      *it = price;
+      sorted_qtys[idx] = qty;
+    } else {
+      // the delete half, without searching again
+      sorted_qtys[idx] -= old_qty;
+      if (qty_t(0) == sorted_qtys[idx]) {
+        sorted_prices.erase(it);
+        sorted_qtys.erase(sorted_qtys.begin() + idx);
+      }
+      ADD_ORDER(shared, order, price, qty);
+    }
   }
   // shared between cancel(aka partial cancel aka reduce) and execute
-  void REDUCE_ORDER(order_price_t *order, qty_t const qty)
+  void REDUCE_ORDER(shared_t&, order_price_t *order, qty_t const qty)
   {
     sorted_prices_t& sorted_prices = is_bid(order->m_price) ? m_bid_prices : m_ask_prices;
     sorted_qtys_t& sorted_qtys = is_bid(order->m_price) ? m_bid_qtys : m_ask_qtys;
@@ -71,15 +136,10 @@ public:
     assert( it != sorted_prices.end() );
     auto idx = it - sorted_prices.begin();
     sorted_qtys[idx] -= qty;
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::cancel_order( order->oid, qty );
-    crosscheck( order->book_idx, is_bid( order->m_price ) );
-#endif
-    // this got done by cancel_order in the CROSS_CHECK case
     order->m_qty -= qty;
   }
   // shared between delete and execute
-  void DELETE_ORDER(order_price_t *order)
+  void DELETE_ORDER(shared_t&, order_price_t *order)
   {
     sorted_prices_t& sorted_prices = is_bid(order->m_price) ? m_bid_prices : m_ask_prices;
     sorted_qtys_t& sorted_qtys = is_bid(order->m_price) ? m_bid_qtys : m_ask_qtys;
@@ -91,10 +151,5 @@ public:
       sorted_prices.erase( it );
       sorted_qtys.erase( sorted_qtys.begin() + idx );
     }
-#if CROSS_CHECK
-    order_book_scalar<TRACE::DISABLED>::delete_order( order->oid );
-    crosscheck( order->book_idx, is_bid( order->m_price ) );
-#endif
   }
 };
-
@@ -0,0 +1,154 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <x86intrin.h>
+#include "itch.h"
+
+/* Releases a replay's messages on the schedule of their ITCH timestamps
+ * (--pace), at the feed's own speed or `speed` times it, to drive
+ * whatever consumes the books (book_shm, book_epoch, live_stats readers)
+ * the way the exchange would, bursts included.
+ *
+ * The first message released anchors the schedule: message i is due
+ * (timestamp_i - timestamp_0) / speed after it. release() busy-waits on
+ * the TSC until the message is due, so it goes out within one TSC read
+ * and a pause of its time; only a gap of more than SLEEP_ABOVE (the
+ * pre-market, a halt) is slept through, up to SPIN_FOR before it is due.
+ * A message that is already due is released at once.
+ *
+ * For every message it records the lag, how late it went out against
+ * the schedule, and the busy time, from its release to the next call
+ * (the engine and any publishing). Both go into log2 histograms, overall
+ * and per half hour of the feed's clock. Lag that builds up in a window
+ * whose busy time stays below the messages' spacing was not spent on
+ * the messages: the replay is being held up from outside, e.g. by a
+ * reader on the same core.
+ */
+class pacer
+{
+ public:
+  static constexpr uint64_t SLEEP_ABOVE = 2000000;  // ns
+  static constexpr uint64_t SPIN_FOR = 1000000;     // ns
+  static constexpr size_t BUCKETS = 48;
+  static constexpr timestamp_t WINDOW = 1800ULL * 1000000000ULL;  // half an hour
+  static constexpr size_t WINDOWS = 48;
+
+  struct histogram {
+    uint64_t counts[BUCKETS] = {};
+    uint64_t n = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    void add(uint64_t const ns)
+    {
+      ++counts[ns ? 64 - __builtin_clzll(ns) : 0];  // [2^(b-1), 2^b)
+      ++n;
+      sum += ns;
+      if (ns > max) max = ns;
+    }
+    // the upper end of the bucket the q-th quantile falls in
+    uint64_t quantile(double const q) const
+    {
+      uint64_t const rank = uint64_t(q * n);
+      uint64_t seen = 0;
+      for (size_t b = 0; b < BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) return b ? std::min(uint64_t(1) << b, max) : 0;
+      }
+      return max;
+    }
+  };
+
+  explicit pacer(double const speed) : m_speed(speed), m_ticks_per_ns(calibrate()) {}
+
+  // waits until the message with this timestamp is due
+  __attribute__((__always_inline__)) void release(timestamp_t const timestamp)
+  {
+    uint64_t now = __rdtsc();
+    if (__builtin_expect(0 == m_anchor_tsc, 0)) {
+      m_anchor_tsc = now;
+      m_anchor_timestamp = timestamp;
+    } else {
+      account(now);
+    }
+    uint64_t const due = m_anchor_tsc + uint64_t(int64_t(timestamp - m_anchor_timestamp) * m_ticks_per_tick);
+    if (int64_t(due - now) > 0) {
+      if (double(due - now) > SLEEP_ABOVE * m_ticks_per_ns) {
+        std::this_thread::sleep_for(
+            std::chrono::nanoseconds(uint64_t((due - now) / m_ticks_per_ns) - SPIN_FOR));
+      }
+      while (int64_t(due - (now = __rdtsc())) > 0) _mm_pause();
+    }
+    m_window = std::min(size_t(timestamp / WINDOW), WINDOWS - 1);
+    m_lag.add(ns(now - due));
+    m_windows[m_window].lag.add(ns(now - due));
+    m_released = now;
+  }
+
+  // closes the busy time of the last message
+  void finish()
+  {
+    if (m_anchor_tsc) account(__rdtsc());
+  }
+
+  void print(FILE *out) const
+  {
+    fprintf(out, "pace: %gx, %lu messages, lag behind the schedule p50 %lu p99 %lu p99.9 %lu max %lu ns, "
+            "busy p50 %lu p99 %lu max %lu ns\n",
+            m_speed, m_lag.n, m_lag.quantile(0.5), m_lag.quantile(0.99), m_lag.quantile(0.999), m_lag.max,
+            m_busy.quantile(0.5), m_busy.quantile(0.99), m_busy.max);
+    fprintf(out, "pace: lag (ns)          messages\n");
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUCKETS; b++) {
+      if (!m_lag.counts[b]) continue;
+      seen += m_lag.counts[b];
+      fprintf(out, "pace:   < %-12lu %10lu %7.3f%%\n", uint64_t(1) << b, m_lag.counts[b],
+              100.0 * seen / m_lag.n);
+    }
+    fprintf(out, "pace: feed time  messages   lag mean    lag p99    lag max  busy mean   busy p99\n");
+    for (size_t w = 0; w < WINDOWS; w++) {
+      window_t const &win = m_windows[w];
+      if (!win.lag.n) continue;
+      fprintf(out, "pace:   %02lu:%02lu %10lu %10lu %10lu %10lu %10lu %10lu\n", w / 2, w % 2 * 30, win.lag.n,
+              win.lag.sum / win.lag.n, win.lag.quantile(0.99), win.lag.max,
+              win.busy.n ? win.busy.sum / win.busy.n : 0, win.busy.quantile(0.99));
+    }
+  }
+
+ private:
+  struct window_t {
+    histogram lag;
+    histogram busy;
+  };
+
+  void account(uint64_t const now)
+  {
+    m_busy.add(ns(now - m_released));
+    m_windows[m_window].busy.add(ns(now - m_released));
+  }
+  uint64_t ns(uint64_t const ticks) const { return uint64_t(ticks / m_ticks_per_ns); }
+
+  // TSC ticks per ns, against the steady clock over a few milliseconds
+  static double calibrate()
+  {
+    auto const t0 = std::chrono::steady_clock::now();
+    uint64_t const c0 = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    auto const t1 = std::chrono::steady_clock::now();
+    uint64_t const c1 = __rdtsc();
+    return (c1 - c0) / double(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+  }
+
+  double const m_speed;
+  double const m_ticks_per_ns;
+  double const m_ticks_per_tick = m_ticks_per_ns / m_speed;  // TSC ticks per ns of feed time
+  uint64_t m_anchor_tsc = 0;
+  timestamp_t m_anchor_timestamp = 0;
+  uint64_t m_released = 0;
+  size_t m_window = 0;
+  histogram m_lag;
+  histogram m_busy;
+  window_t m_windows[WINDOWS];
+};
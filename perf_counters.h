@@ -0,0 +1,170 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Hardware counters around the replay loop, so a difference in
+ * ns/packet between implementations can be put down to cache misses,
+ * dTLB misses or branch mispredicts instead of guessed at.
+ *
+ * The counters are opened with perf_event_open for the calling thread,
+ * user space only (which is what perf_event_paranoid 2, the usual
+ * default, allows). A PMU has only a few programmable counters, so they
+ * are opened as two groups of three that the kernel can always schedule
+ * whole: cycles, instructions and branch misses, then L1D, LLC and dTLB
+ * read misses. Counts within a group come from the same interval; if
+ * the kernel has to multiplex the groups, each is scaled by its time
+ * enabled over its time running.
+ *
+ * Any counter that cannot be opened (no PMU in a VM, perf blocked by a
+ * container's seccomp profile, a cache event the CPU lacks) is left out
+ * and reported as n/a; if none open, there is one line saying why and
+ * the replay runs as usual.
+ */
+
+class perf_counters
+{
+ public:
+  enum EVENT { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, DTLB_MISSES, NUM_EVENTS };
+  static constexpr int GROUP_SIZE = 3;
+
+  perf_counters()
+  {
+    for (int e = 0; e < NUM_EVENTS; e++) {
+      m_fd[e] = -1;
+      m_count[e] = -1.0;
+    }
+    for (int g = 0; g < NUM_EVENTS / GROUP_SIZE; g++) {
+      int leader = -1;
+      for (int e = g * GROUP_SIZE; e < (g + 1) * GROUP_SIZE; e++) {
+        m_fd[e] = open_event(EVENT(e), leader);
+        if (m_fd[e] < 0) {
+          m_errno = errno;
+        } else if (leader < 0) {
+          leader = m_fd[e];
+        }
+      }
+      m_leader[g] = leader;
+    }
+  }
+  ~perf_counters()
+  {
+    for (int e = 0; e < NUM_EVENTS; e++) {
+      if (m_fd[e] >= 0) close(m_fd[e]);
+    }
+  }
+  perf_counters(perf_counters const &) = delete;
+  perf_counters &operator=(perf_counters const &) = delete;
+
+  bool available() const { return m_leader[0] >= 0 || m_leader[1] >= 0; }
+
+  void start()
+  {
+    for (int const leader : m_leader) {
+      if (leader < 0) continue;
+      ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+  }
+  // reads the counters into m_count, scaled for multiplexing
+  void stop()
+  {
+    for (int g = 0; g < NUM_EVENTS / GROUP_SIZE; g++) {
+      if (m_leader[g] < 0) continue;
+      ioctl(m_leader[g], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+      // PERF_FORMAT_GROUP: nr, time enabled, time running, then the
+      // values in the order the events were added to the group
+      uint64_t data[3 + GROUP_SIZE];
+      if (read(m_leader[g], data, sizeof(data)) < ssize_t(3 * sizeof(uint64_t))) continue;
+      uint64_t const nr = data[0];
+      double const scale = data[2] ? double(data[1]) / data[2] : 0.0;
+      uint64_t i = 0;
+      for (int e = g * GROUP_SIZE; e < (g + 1) * GROUP_SIZE && i < nr; e++) {
+        if (m_fd[e] >= 0) m_count[e] = data[3 + i++] * scale;
+      }
+    }
+  }
+
+  // one line of counts per message, n/a for counters that did not open
+  void print(FILE *out, size_t const npkts) const
+  {
+    if (!available()) {
+      fprintf(out, "perf: counters unavailable (%s)\n", strerror(m_errno));
+      return;
+    }
+    static char const *const names[NUM_EVENTS] = {
+        "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses", "dTLB-misses"};
+    fprintf(out, "perf per packet:");
+    for (int e = 0; e < NUM_EVENTS; e++) {
+      if (m_count[e] < 0) {
+        fprintf(out, " %s n/a", names[e]);
+      } else {
+        fprintf(out, " %s %.2f", names[e], m_count[e] / npkts);
+      }
+    }
+    if (m_count[CYCLES] > 0 && m_count[INSTRUCTIONS] >= 0) {
+      fprintf(out, " IPC %.2f", m_count[INSTRUCTIONS] / m_count[CYCLES]);
+    }
+    fprintf(out, "\n");
+  }
+
+ private:
+  int m_fd[NUM_EVENTS];
+  int m_leader[NUM_EVENTS / GROUP_SIZE];
+  double m_count[NUM_EVENTS];  // -1 if not counted
+  int m_errno = 0;
+
+  static uint64_t cache_event(uint64_t const cache)
+  {
+    return cache | (uint64_t(PERF_COUNT_HW_CACHE_OP_READ) << 8) |
+           (uint64_t(PERF_COUNT_HW_CACHE_RESULT_MISS) << 16);
+  }
+
+  static int open_event(EVENT const e, int const group_fd)
+  {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    switch (e) {
+      case CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case BRANCH_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+      case L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache_event(PERF_COUNT_HW_CACHE_L1D);
+        break;
+      case LLC_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache_event(PERF_COUNT_HW_CACHE_LL);
+        break;
+      case DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache_event(PERF_COUNT_HW_CACHE_DTLB);
+        break;
+      default:
+        errno = EINVAL;
+        return -1;
+    }
+    attr.disabled = group_fd < 0;  // members follow their leader
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return int(syscall(SYS_perf_event_open, &attr, 0 /* this thread */, -1 /* any cpu */,
+                       group_fd, PERF_FLAG_FD_CLOEXEC));
+  }
+};
@@ -0,0 +1,110 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "bufferedreader.h"
+
+/* Keeps a cold file ahead of the parser, so the replay does not take
+ * major faults on buf_t's mapping in the hot loop and does not need the
+ * file pre-warmed with `cat file > /dev/null`.
+ *
+ * A helper thread follows buf.pos and keeps the next `window` bytes of
+ * the file in the page cache, a chunk at a time: readahead(2) reads the
+ * chunk synchronously on the helper, and MADV_WILLNEED asks for it to
+ * be mapped. Behind the parser, consumed chunks are dropped from the
+ * mapping (MADV_DONTNEED) and from the page cache
+ * (POSIX_FADV_DONTNEED), so a day larger than memory streams through
+ * instead of evicting everything else. One chunk is kept behind the
+ * parse position for the message being decoded.
+ *
+ * The hot loop is not changed: the helper reads buf.pos, which only the
+ * parser writes, with a relaxed atomic load. An aligned 8-byte load is
+ * never torn, and a stale position only makes the helper a little
+ * conservative.
+ *
+ * I/O stalls are reported two ways: the parser thread's major faults
+ * (each one a wait on the disk in the hot loop), and the time the
+ * helper spent reading chunks that the parser had already reached,
+ * which is time the parser was waiting on the same I/O.
+ */
+
+class readahead_t
+{
+ public:
+  static constexpr size_t CHUNK = size_t(2) << 20;
+
+  // to be constructed and stopped on the thread that parses buf
+  readahead_t(buf_t &buf, size_t const window)
+      : m_buf(buf), m_window(std::max(window, 2 * CHUNK))
+  {
+    madvise(m_buf.ptr, m_buf.limit, MADV_SEQUENTIAL);
+    m_majflt = major_faults();
+    m_thread = std::thread([this]() { run(); });
+  }
+  ~readahead_t() { stop(); }
+
+  void stop()
+  {
+    if (!m_thread.joinable()) return;
+    m_stop.store(true, std::memory_order_relaxed);
+    m_thread.join();
+    m_majflt = major_faults() - m_majflt;
+  }
+
+  // after stop()
+  long m_majflt = 0;          // major faults taken by the parser thread
+  size_t m_stall_nanos = 0;   // helper reads the parser was waiting for
+  size_t m_read_bytes = 0;    // read ahead of the parser
+  size_t m_dropped_bytes = 0; // dropped behind it
+
+ private:
+  buf_t &m_buf;
+  size_t const m_window;
+  std::atomic<bool> m_stop{false};
+  std::thread m_thread;
+
+  static long major_faults()
+  {
+    rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_majflt;
+  }
+
+  void run()
+  {
+    uint64_t const limit = m_buf.limit;
+    uint64_t ahead = 0;    // end of what has been read
+    uint64_t dropped = 0;  // end of what has been dropped
+    while (!m_stop.load(std::memory_order_relaxed)) {
+      uint64_t const pos = __atomic_load_n(&m_buf.pos, __ATOMIC_RELAXED);
+      uint64_t const consumed = pos / CHUNK * CHUNK;
+      if (consumed > dropped + CHUNK) {
+        uint64_t const end = consumed - CHUNK;
+        madvise(m_buf.ptr + dropped, end - dropped, MADV_DONTNEED);
+        posix_fadvise(m_buf.fd, off_t(dropped), off_t(end - dropped), POSIX_FADV_DONTNEED);
+        m_dropped_bytes += end - dropped;
+        dropped = end;
+      }
+      if (ahead < limit && ahead < pos + m_window) {
+        uint64_t const len = std::min<uint64_t>(CHUNK, limit - ahead);
+        bool const waiting = pos >= ahead;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ::readahead(m_buf.fd, off_t(ahead), len);
+        madvise(m_buf.ptr + ahead, len, MADV_WILLNEED);
+        if (waiting) {
+          m_stall_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start).count();
+        }
+        m_read_bytes += len;
+        ahead += len;
+      } else {
+        // the window is full (or the file is read): wait for the parser
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+  }
+};
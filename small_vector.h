@@ -0,0 +1,122 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+/* The sorted level arrays of one book side, with the first levels stored
+ * in the book itself.
+ *
+ * A std::vector side is a pointer in the book and its elements on the
+ * heap, so every operation on a book reads at least two cache lines in
+ * two places. Most books only ever hold a handful of levels per side, so
+ * here the pointer, the size and up to K elements share one BYTES-sized,
+ * line-aligned block inside the book, and the pointer points into the
+ * block. A side that outgrows K moves to the heap, doubling as a vector
+ * does, so a deep book costs what it did with a vector, and moves back
+ * once it is down to K / 2 (not K, so that a side going back and forth
+ * around K does not move every time). clear keeps a heap side's
+ * capacity, as a vector's does.
+ *
+ * Only what the books use of std::vector is here. Elements are trivially
+ * copyable and moved with memmove; iterators are pointers. The block
+ * points into itself, so it cannot be copied or moved, nor can a book
+ * that holds one; two blocks can be swapped.
+ */
+template<class T, size_t BYTES = 64>
+class alignas(64) small_vector
+{
+  static_assert(std::is_trivially_copyable<T>::value, "elements are moved with memmove");
+
+ public:
+  // elements that fit in the block next to the pointer and the sizes
+  static constexpr uint32_t K = (BYTES - sizeof(T *) - 2 * sizeof(uint32_t)) / sizeof(T);
+  static_assert(K > 0, "BYTES too small for one element");
+
+  using value_type = T;
+  using iterator = T *;
+  using const_iterator = T const *;
+
+  small_vector() : m_data(m_inline) {}
+  ~small_vector()
+  {
+    if (m_data != m_inline) std::free(m_data);
+  }
+  small_vector(small_vector const &) = delete;
+  small_vector &operator=(small_vector const &) = delete;
+
+  T *begin() { return m_data; }
+  T *end() { return m_data + m_size; }
+  T const *begin() const { return m_data; }
+  T const *end() const { return m_data + m_size; }
+  T *data() { return m_data; }
+  T const *data() const { return m_data; }
+  size_t size() const { return m_size; }
+  bool empty() const { return 0 == m_size; }
+  bool is_inline() const { return m_data == m_inline; }
+  T &operator[](size_t const i) { return m_data[i]; }
+  T const &operator[](size_t const i) const { return m_data[i]; }
+  T &back() { return m_data[m_size - 1]; }
+  T const &back() const { return m_data[m_size - 1]; }
+
+  T *insert(T *const pos, T const &v)
+  {
+    size_t const idx = pos - m_data;
+    if (m_size == m_capacity) grow();
+    std::memmove(m_data + idx + 1, m_data + idx, (m_size - idx) * sizeof(T));
+    m_data[idx] = v;
+    ++m_size;
+    return m_data + idx;
+  }
+  T *erase(T *const pos)
+  {
+    std::memmove(pos, pos + 1, (end() - pos - 1) * sizeof(T));
+    --m_size;
+    if (__builtin_expect(m_size == K / 2 && m_data != m_inline, 0)) {
+      size_t const idx = pos - m_data;
+      shrink();
+      return m_data + idx;
+    }
+    return pos;
+  }
+  void push_back(T const &v) { insert(end(), v); }
+  void clear() { m_size = 0; }
+  // exchanges the contents of two blocks, for moving books around (see
+  // engine::repack)
+  void swap(small_vector &o)
+  {
+    bool const was_inline = is_inline();
+    bool const o_was_inline = o.is_inline();
+    alignas(small_vector) unsigned char tmp[sizeof(small_vector)];
+    std::memcpy(tmp, static_cast<void *>(this), sizeof(small_vector));
+    std::memcpy(static_cast<void *>(this), static_cast<void *>(&o), sizeof(small_vector));
+    std::memcpy(static_cast<void *>(&o), tmp, sizeof(small_vector));
+    if (o_was_inline) m_data = m_inline;
+    if (was_inline) o.m_data = o.m_inline;
+  }
+
+ private:
+  __attribute__((__noinline__)) void grow()
+  {
+    uint32_t const capacity = 2 * m_capacity;
+    T *p = static_cast<T *>(std::malloc(capacity * sizeof(T)));
+    if (!p) throw std::bad_alloc();
+    std::memcpy(p, m_data, m_size * sizeof(T));
+    if (m_data != m_inline) std::free(m_data);
+    m_data = p;
+    m_capacity = capacity;
+  }
+  __attribute__((__noinline__)) void shrink()
+  {
+    std::memcpy(m_inline, m_data, m_size * sizeof(T));
+    std::free(m_data);
+    m_data = m_inline;
+    m_capacity = K;
+  }
+
+  T *m_data;
+  uint32_t m_size = 0;
+  uint32_t m_capacity = K;
+  T m_inline[K];
+};
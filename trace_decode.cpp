@@ -0,0 +1,111 @@
+/*
+ * trace_decode.cpp
+ *
+ * Prints a trace ring written by `a.out --trace` (see trace_ring.h) in
+ * the text format the engine used to printf, oldest operation first.
+ * Only the last `capacity` operations are in the ring; if earlier ones
+ * were overwritten, that is said on stderr. With --tsc each line starts
+ * with the TSC ticks since the first printed operation, and with
+ * --last <n> only the last n operations are printed.
+ *
+ *   ./trace_decode [--tsc] [--last <n>] [file]      file defaults to itch.trace
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "trace_ring.h"
+
+using namespace trace_ring;
+
+static void print(record_t const &r)
+{
+  switch (r.op) {
+    case OP::ADD:
+      printf("ADD %u, %u, %d, %u\n", r.oid, uint32_t(r.locate), r.price, r.qty);
+      break;
+    case OP::DELETE:
+      printf("DELETE %u\n", r.oid);
+      break;
+    case OP::REDUCE:
+      printf("REDUCE %u, %u\n", r.oid, r.qty);
+      break;
+    case OP::EXECUTE:
+      printf("EXECUTE %lu %u\n", uint64_t(r.oid), r.qty);
+      break;
+    case OP::REPLACE:
+      printf("REPLACE %lu %lu %d %u\n", uint64_t(r.oid), uint64_t(r.new_oid), r.price, r.qty);
+      break;
+    default:
+      printf("UNKNOWN %u\n", unsigned(r.op));
+      break;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  std::string path = "itch.trace";
+  bool tsc = false;
+  uint64_t last = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--tsc") {
+      tsc = true;
+    } else if (arg == "--last") {
+      if (i + 1 < argc) {
+        last = std::stoull(argv[++i]);
+      } else {
+        fprintf(stderr, "Error: --last requires an argument\n");
+        return 1;
+      }
+    } else if (arg[0] == '-') {
+      fprintf(stderr, "Usage: %s [--tsc] [--last <n>] [file]\n", argv[0]);
+      fprintf(stderr, "  file defaults to itch.trace, as written by a.out --trace\n");
+      return arg != "--help" && arg != "-h";
+    } else {
+      path = arg;
+    }
+  }
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(path.c_str());
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || size_t(st.st_size) < sizeof(header_t)) {
+    fprintf(stderr, "%s is not a trace ring\n", path.c_str());
+    close(fd);
+    return 1;
+  }
+  void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == p) {
+    perror("mmap");
+    return 1;
+  }
+  header_t const &h = *static_cast<header_t const *>(p);
+  if (MAGIC != h.magic || VERSION != h.version || sizeof(record_t) != h.record_size ||
+      size_t(st.st_size) < file_size(h.capacity)) {
+    fprintf(stderr, "%s is not a trace ring of version %u\n", path.c_str(), VERSION);
+    return 1;
+  }
+  record_t const *records = reinterpret_cast<record_t const *>(&h + 1);
+  uint64_t const head = h.head.load(std::memory_order_acquire);
+  uint64_t first = head > h.capacity ? head - h.capacity : 0;
+  if (first) {
+    fprintf(stderr, "%lu earlier operations were overwritten\n", first);
+  }
+  if (last && head - first > last) first = head - last;
+  uint64_t const tsc0 = head > first ? records[first & (h.capacity - 1)].tsc : 0;
+  for (uint64_t i = first; i < head; i++) {
+    record_t const &r = records[i & (h.capacity - 1)];
+    if (tsc) printf("%12lu ", r.tsc - tsc0);
+    print(r);
+  }
+  munmap(p, size_t(st.st_size));
+  return 0;
+}
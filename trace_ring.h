@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+/* The engine's trace (--trace) as fixed-size binary records in a
+ * memory-mapped ring file, instead of a printf per operation.
+ *
+ * Each engine writes its own ring, so there is no sharing between
+ * threads. A record is 32 bytes: the TSC, the operation and its
+ * arguments as the engine got them. The ring holds a power of two of
+ * records and wraps, so it keeps the last `capacity` operations, like a
+ * flight recorder; `head` in the header counts every record ever written
+ * and is stored after each one, so a ring left by a crashed process is
+ * still readable. The file is MAP_SHARED: the kernel writes it back in
+ * the background and the replay never waits on the disk.
+ *
+ * Reading the TSC is most of the cost of a record, and some hypervisors
+ * trap it, which makes it cost more than the operation being traced.
+ * With tsc_every = n > 1 it is read for every nth record only and the
+ * records in between repeat it.
+ *
+ * trace_decode prints a ring in the text format the printf trace had.
+ * The layout is versioned by trace_ring::VERSION.
+ */
+
+namespace trace_ring {
+
+static constexpr uint64_t MAGIC = 0x6563617274686374;  // "tchtrace"
+static constexpr uint32_t VERSION = 1;
+
+enum class OP : uint8_t { ADD = 1, DELETE, REDUCE, EXECUTE, REPLACE };
+
+struct record_t {
+  uint64_t tsc;
+  uint32_t oid;
+  uint32_t new_oid;  // REPLACE only
+  int32_t price;     // ADD: as the book keeps it, or the wire price on the
+                     // 64-bit path (see engine::add_wide); REPLACE: the wire price
+  uint32_t qty;
+  uint16_t locate;   // ADD only
+  OP op;
+  uint8_t pad[5];
+};
+static_assert(sizeof(record_t) == 32, "two records per cache line");
+
+struct alignas(64) header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;  // records, a power of two
+  std::atomic<uint64_t> head;  // records written, the last capacity are kept
+};
+
+inline size_t file_size(uint64_t const capacity) { return sizeof(header_t) + capacity * sizeof(record_t); }
+
+/* The engine's side. If the file cannot be created, ok() is false and
+ * nothing is recorded. */
+class writer
+{
+ public:
+  writer(char const *path, size_t events, size_t tsc_every = 1)
+  {
+    while (m_tsc_mask + 1 < tsc_every) m_tsc_mask = m_tsc_mask << 1 | 1;
+    uint64_t capacity = 1;
+    while (capacity < events) capacity <<= 1;
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+      perror(path);
+      return;
+    }
+    if (ftruncate(fd, off_t(file_size(capacity)))) {
+      perror("ftruncate");
+      close(fd);
+      return;
+    }
+    void *p = mmap(nullptr, file_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == p) {
+      perror("mmap");
+      return;
+    }
+    m_header = static_cast<header_t *>(p);
+    m_records = reinterpret_cast<record_t *>(m_header + 1);
+    m_mask = capacity - 1;
+    m_header->version = VERSION;
+    m_header->record_size = sizeof(record_t);
+    m_header->capacity = capacity;
+    m_header->magic = MAGIC;
+  }
+  ~writer()
+  {
+    if (!m_header) return;
+    msync(m_header, file_size(m_mask + 1), MS_ASYNC);
+    munmap(m_header, file_size(m_mask + 1));
+  }
+  writer(writer const &) = delete;
+  writer &operator=(writer const &) = delete;
+
+  bool ok() const { return nullptr != m_header; }
+  uint64_t written() const { return m_head; }
+  uint64_t capacity() const { return m_mask + 1; }
+
+  __attribute__((__always_inline__)) void record(OP const op, uint32_t const oid, uint32_t const new_oid,
+                                                 uint16_t const locate, int32_t const price,
+                                                 uint32_t const qty)
+  {
+    record_t &r = m_records[m_head & m_mask];
+    if (0 == (m_head & m_tsc_mask)) m_tsc = __rdtsc();
+    r.tsc = m_tsc;
+    r.oid = oid;
+    r.new_oid = new_oid;
+    r.price = price;
+    r.qty = qty;
+    r.locate = locate;
+    r.op = op;
+    m_header->head.store(++m_head, std::memory_order_release);
+  }
+
+ private:
+  header_t *m_header = nullptr;
+  record_t *m_records = nullptr;
+  uint64_t m_mask = 0;
+  uint64_t m_head = 0;
+  uint64_t m_tsc_mask = 0;  // tsc_every - 1, rounded up to a power of two
+  uint64_t m_tsc = 0;
+};
+
+}  // namespace trace_ring
@@ -0,0 +1,82 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+#include "itch.h"
+
+/* Per-symbol trade analytics, accumulated as the feed is replayed.
+ *
+ * Executions arrive as EXECUTE_ORDER (at the resting order's price, which
+ * the engine returns), EXECUTE_ORDER_WITH_PRICE (at the price in the
+ * message) and TRADE (executions against hidden orders, which never
+ * touch the book). Per ITCH, 'C' executions marked non-printable must
+ * not be counted in volume, so they are dropped here.
+ *
+ * The accumulators are kept as separate arrays indexed by stock locate.
+ * An execution is a handful of loads and stores with no branches beyond
+ * the high/low compares, and the arrays for the active symbols stay in
+ * cache, so this costs next to nothing next to the book update.
+ */
+
+class null_trade_listener
+{
+ public:
+  void on_execution(uint16_t, price_t, qty_t) {}
+};
+
+class trade_stats
+{
+ public:
+  static constexpr size_t MAX_SYMBOLS = 1 << 14;  // locates are < MAX_BOOKS
+
+  trade_stats()
+  {
+    std::fill(m_low, m_low + MAX_SYMBOLS, std::numeric_limits<price_t>::max());
+  }
+
+  void on_execution(uint16_t const locate, price_t const price, qty_t const qty)
+  {
+    size_t const i = locate;
+    m_volume[i] += qty;
+    m_notional[i] += uint64_t(price) * qty;
+    m_trades[i] += 1;
+    m_high[i] = std::max(m_high[i], price);
+    m_low[i] = std::min(m_low[i], price);
+  }
+
+  uint64_t volume(uint16_t const locate) const { return m_volume[locate]; }
+  uint64_t notional(uint16_t const locate) const { return m_notional[locate]; }
+  uint32_t trades(uint16_t const locate) const { return m_trades[locate]; }
+  price_t high(uint16_t const locate) const { return m_high[locate]; }
+  price_t low(uint16_t const locate) const { return m_low[locate]; }
+  // in the feed's price units (1/10000 dollar)
+  double vwap(uint16_t const locate) const
+  {
+    return m_volume[locate] ? double(m_notional[locate]) / m_volume[locate] : 0.0;
+  }
+
+  /* Prints one line per symbol that traded. names maps locates to
+   * tickers and may be shorter than the locate range. */
+  void dump(FILE *out, std::vector<std::string> const &names) const
+  {
+    fprintf(out, "%-8s %10s %14s %12s %12s %12s\n", "symbol", "trades",
+            "volume", "vwap", "high", "low");
+    for (size_t i = 0; i < MAX_SYMBOLS; i++) {
+      if (!m_trades[i]) continue;
+      char const *name = i < names.size() ? names[i].c_str() : "";
+      fprintf(out, "%-8s %10u %14lu %12.4f %12.4f %12.4f\n", name,
+              m_trades[i], m_volume[i], vwap(uint16_t(i)) / 10000.0,
+              m_high[i] / 10000.0, m_low[i] / 10000.0);
+    }
+  }
+
+ private:
+  uint64_t m_volume[MAX_SYMBOLS] = {};
+  uint64_t m_notional[MAX_SYMBOLS] = {};  // sum of price * qty
+  uint32_t m_trades[MAX_SYMBOLS] = {};
+  price_t m_high[MAX_SYMBOLS] = {};
+  price_t m_low[MAX_SYMBOLS];
+};